@@ -0,0 +1,54 @@
+/*
+ * Copyright 2016, The EFIDroid Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+#ifndef _CHUNKSTORE_H
+#define _CHUNKSTORE_H
+
+#include <stdint.h>
+#include <limits.h>
+#include <lib/sha256.h>
+
+#define CHUNKSTORE_CHUNKSZ (64*1024)
+#define CHUNKSTORE_DIRNAME "chunks"
+
+// an image as a list of chunk hashes, all-zero chunks have an all-zero hash
+typedef struct {
+    char storedir[PATH_MAX];
+    char manifest[PATH_MAX];
+    uint64_t size;
+    uint32_t num_chunks;
+    uint8_t *hashes;
+} chunkstore_t;
+
+// the store is opt-in, creating a 'chunks' directory next to the images enables it
+int chunkstore_enabled(const char *image);
+int chunkstore_has_manifest(const char *image);
+
+int chunkstore_open(chunkstore_t *store, const char *image);
+void chunkstore_close(chunkstore_t *store);
+size_t chunkstore_chunk_len(const chunkstore_t *store, uint32_t index);
+int chunkstore_read_chunk(const chunkstore_t *store, uint32_t index, void *buf);
+int chunkstore_put_chunk(chunkstore_t *store, uint32_t index, const void *buf);
+int chunkstore_write_manifest(const chunkstore_t *store);
+
+int chunkstore_import(const char *source, const char *image);
+int chunkstore_materialize(const char *image, const char *target);
+int chunkstore_gc(const char *dir);
+
+// serves an image from the store as <mountpoint>/loop.fs
+int chunkfs_main(int argc, char **argv);
+
+#endif
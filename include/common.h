@@ -56,6 +56,7 @@
 #define MBPATH_TRIGGER_BIN MBPATH_BIN "/trigger"
 #define MBPATH_TRIGGER_CMD MBPATH_ROOT "/.trigger_cmd"
 #define MBPATH_TRIGGER_WAIT_FILE MBPATH_ROOT "/.trigger_wait"
+#define MBPATH_DEV_LABELS MBPATH_ROOT "/.dev_labels"
 #define MBPATH_STATEFILE MBPATH_ROOT "/mbstate"
 
 #define UNUSED __attribute__((unused))
@@ -68,12 +69,24 @@ typedef enum {
     MBPART_TYPE_BIND,
 } multiboot_partition_type_t;
 
+// numeric values are -1 and scheduler is NULL if not set
+typedef struct {
+    int direct_io;
+    int block_size;
+    int nr_requests;
+    int read_ahead_kb;
+    char *scheduler;
+} loop_tuning_t;
+
 typedef struct {
     char *name;
     char *path;
 
     multiboot_partition_type_t type;
     uevent_block_t *uevent_block;
+
+    // multiboot.ini [loop.<name>]
+    loop_tuning_t loop_tuning;
 } multiboot_partition_t;
 
 typedef struct {
@@ -110,9 +123,12 @@ typedef struct {
     // multiboot.ini data
     multiboot_partition_t *mbparts;
     uint32_t num_mbparts;
+    loop_tuning_t loop_tuning;
 
     // datamedia
     uint32_t native_data_layout_version;
+    uint32_t mb_sdk_version;
+    uint32_t mb_layout_version;
     const char *datamedia_source;
     const char *datamedia_target;
 } multiboot_data_t;
@@ -145,6 +161,7 @@ typedef struct {
 
     // mount: loop, also used for direct IO
     char *loopdevice;
+    loop_tuning_t loop_tuning;
 
     // optional, for delayed losetup
     int losetup_done;
@@ -152,6 +169,9 @@ typedef struct {
 
     // optional, file to sync changes to
     char *loop_sync_target;
+
+    // optional, loopfile gets served from the chunk store of this image
+    char *chunkstore_image;
 } part_replacement_t;
 
 
@@ -165,5 +185,8 @@ int boot_android(void);
 int handle_trigger(char *cmd);
 int state_save(void);
 int state_restore(void);
+int bootplan_load(void);
+int bootplan_save(void);
+int efivar_main(int argc, char **argv);
 
 #endif
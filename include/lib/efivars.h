@@ -44,6 +44,8 @@ typedef struct {
 } efi_guid_t;
 
 int efivar_dump(void);
+// prints printable strings as text, optionally quoted, and everything else as hex
+void efivar_print_value(const uint8_t *data, uint32_t datasize, int hex, int quote);
 int efivar_get(const char *name, efi_guid_t *guid,
                uint32_t *attributes, uint32_t *datasize, void *data);
 int efivar_set(const char *name, efi_guid_t *guid,
@@ -55,5 +57,20 @@ int efivar_set_global(const char *name, uint32_t datasize, const void *data);
 int efivar_get_efidroid(const char *name, uint32_t *datasize, void *data);
 int efivar_set_efidroid(const char *name, uint32_t datasize, const void *data);
 
+// uses the given device instead of the nvvars partition, has to be called before anything else
+int efivar_set_device(const char *device);
+// loads the NV area without writing to it
+int efivar_load(void);
+// loads the NV area and prepares the slot for fatal errors, which may rewrite it
+int efivar_init(void);
+// appends changed variables to the log of the NV area, the firmware doesn't see
+// them before efivar_compact. changes which weren't synced get compacted at exit.
+// the log gets dropped if the firmware rewrites the image first, so always compact
+// before handing off to the firmware.
+int efivar_sync(void);
+// writes changed variables and the log into the compacted image which the firmware reads,
+// nothing is written if that is up to date already. call it before handing off to the firmware.
+int efivar_compact(void);
+
 int efivars_set_error(const char *fmt, ...) __attribute__ ((format(printf, 1, 2)));
 #endif
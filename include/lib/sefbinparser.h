@@ -20,8 +20,12 @@
 #include <lib/list.h>
 #include <pcre.h>
 
-typedef struct {
+#define SEFBIN_STEM_BUCKETS 64
+
+typedef struct sefbin_stem {
     list_node_t node;
+    struct sefbin_stem *hash_next;
+    int32_t id;
 
     char *name;
 } sefbin_stem_t;
@@ -48,11 +52,22 @@ typedef struct  {
     uint32_t pcre_version_size;
     list_node_t stems;
     list_node_t specs;
+
+    // stem index
+    sefbin_stem_t **stem_array;
+    uint32_t num_stems;
+    uint32_t stem_array_size;
+    sefbin_stem_t *stem_buckets[SEFBIN_STEM_BUCKETS];
+
+    // parsed files reference their mapping
+    void *map;
+    size_t map_size;
 } sefbin_file_t;
 
 sefbin_file_t *sefbin_parse(const char *filename, int allow_magicerror);
 int sefbin_write(sefbin_file_t *seffile, const char *filename);
 int sefbin_append(sefbin_file_t *dst, sefbin_file_t *src);
-int sefbin_append_multiboot_rules(sefbin_file_t *dst);
+// returns the context for path, mode is the st_mode of the file
+const char *sefbin_lookup(sefbin_file_t *seffile, const char *path, uint32_t mode);
 void sefbin_decomp(sefbin_file_t *seffile);
 #endif
@@ -17,5 +17,8 @@
 #ifndef _LIB_SEFSRCPARSER_H_
 #define _LIB_SEFSRCPARSER_H_
 
-int sefsrc_append_multiboot_rules(const char *filename);
+#include <stddef.h>
+
+// appends payload and a /multiboot copy of every /dev rule in the file and the payload
+int sefsrc_append_multiboot_rules(const char *filename, const void *payload, size_t payload_size);
 #endif
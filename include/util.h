@@ -52,12 +52,22 @@ int util_mount(const char *source, const char *target,
                const char *filesystemtype, unsigned long mountflags,
                const void *data);
 int util_make_loop(const char *path);
+int util_make_loop_ex(const char *path, bool attach_later);
 int util_losetup(const char *device, const char *file, bool ro);
+int util_losetup_ex(const char *device, const char *file, uint32_t lo_flags, const loop_tuning_t *tuning);
+void util_loop_tuning_init(loop_tuning_t *tuning);
+int util_loop_tuning_set(loop_tuning_t *tuning, const char *name, const char *value);
+void util_loop_tuning_resolve(loop_tuning_t *tuning, const loop_tuning_t *part, const loop_tuning_t *global);
 int util_losetup_free(const char *_device);
+int util_loop_detach(const char *device);
 int util_mkfs(const char *device, const char *fstype);
+int util_mkfs_ex(const char *device, const char *fstype, const char *label);
 int util_block_num(const char *path, unsigned long *numblocks);
 int util_dd(const char *source, const char *target, unsigned long blocks);
 int util_cp(const char *source, const char *target);
+int util_copy_sparse(const char *source, const char *target);
+int util_resparsify(const char *filename, uint64_t *pfreed);
+int util_buf_is_zero(const void *buf, size_t len);
 int util_shell(const char *cmd);
 char *util_get_fstype(const char *filename);
 char *util_get_espdir(const char *mountpoint);
@@ -67,6 +77,7 @@ char *util_getmbpath_from_device(const char *device);
 int util_fs_supports_multiboot_bind(const char *type);
 int util_mount_esp(int abort_on_error);
 int util_dynfilefs(const char *_source, const char *_target, uint64_t size);
+int util_chunkfs(const char *image, const char *loopfile);
 int util_mount_mbinipart(const char *name, const char *mountpoint);
 char *util_get_property(const char *filename, const char *propertyname);
 int util_read_int(const char *filename, uint32_t *pvalue);
@@ -20,6 +20,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mount.h>
+#include <sys/stat.h>
+#include <fcntl.h>
 #include <unistd.h>
 
 #include "fs_mgr_priv.h"
@@ -111,7 +113,7 @@ static uint64_t calculate_zram_size(unsigned int percentage)
     return total;
 }
 
-static int parse_flags(char *flags, struct flag_list *fl,
+static int parse_flags(struct fstab *fstab, char *flags, struct flag_list *fl,
                        struct fs_mgr_flag_values *flag_vals,
                        char *fs_options, int fs_options_len)
 {
@@ -146,25 +148,25 @@ static int parse_flags(char *flags, struct flag_list *fl,
                     /* The encryptable flag is followed by an = and the
                      * location of the keys.  Get it and return it.
                      */
-                    flag_vals->key_loc = strdup(strchr(p, '=') + 1);
+                    flag_vals->key_loc = fs_mgr_arena_strdup(fstab, strchr(p, '=') + 1);
                 } else if ((fl[i].flag == MF_VERIFY) && flag_vals) {
                     /* If the verify flag is followed by an = and the
                      * location for the verity state,  get it and return it.
                      */
                     char *start = strchr(p, '=');
                     if (start) {
-                        flag_vals->verity_loc = strdup(start + 1);
+                        flag_vals->verity_loc = fs_mgr_arena_strdup(fstab, start + 1);
                     }
                 } else if ((fl[i].flag == MF_FORCECRYPT) && flag_vals) {
                     /* The forceencrypt flag is followed by an = and the
                      * location of the keys.  Get it and return it.
                      */
-                    flag_vals->key_loc = strdup(strchr(p, '=') + 1);
+                    flag_vals->key_loc = fs_mgr_arena_strdup(fstab, strchr(p, '=') + 1);
                 } else if ((fl[i].flag == MF_FORCEFDEORFBE) && flag_vals) {
                     /* The forcefdeorfbe flag is followed by an = and the
                      * location of the keys.  Get it and return it.
                      */
-                    flag_vals->key_loc = strdup(strchr(p, '=') + 1);
+                    flag_vals->key_loc = fs_mgr_arena_strdup(fstab, strchr(p, '=') + 1);
                     flag_vals->file_encryption_mode = EM_SOFTWARE;
                 } else if ((fl[i].flag == MF_FILEENCRYPTION) && flag_vals) {
                     /* The fileencryption flag is followed by an = and the
@@ -199,8 +201,8 @@ static int parse_flags(char *flags, struct flag_list *fl,
                     label_start = strchr(p, '=') + 1;
                     label_end = strchr(p, ':');
                     if (label_end) {
-                        flag_vals->label = strndup(label_start,
-                                                   (int) (label_end - label_start));
+                        flag_vals->label = fs_mgr_arena_strndup(fstab, label_start,
+                                                               label_end - label_start);
                         part_start = strchr(p, ':') + 1;
                         if (!strcmp(part_start, "auto")) {
                             flag_vals->partnum = -1;
@@ -222,7 +224,7 @@ static int parse_flags(char *flags, struct flag_list *fl,
                 } else if ((fl[i].flag == MF_ZRAMSTREAMS) && flag_vals) {
                     flag_vals->zram_streams = strtoll(strchr(p, '=') + 1, NULL, 0);
                 } else if ((fl[i].flag == MF_ESP) && flag_vals) {
-                    flag_vals->esp = strdup(strchr(p, '=') + 1);
+                    flag_vals->esp = fs_mgr_arena_strdup(fstab, strchr(p, '=') + 1);
                 }
                 break;
             }
@@ -253,63 +255,121 @@ static int parse_flags(char *flags, struct flag_list *fl,
     return f;
 }
 
+static struct fstab_arena *arena_new_block(size_t size)
+{
+    struct fstab_arena *block = malloc(sizeof(*block) + size);
+    if (!block) {
+        return NULL;
+    }
+
+    block->next = NULL;
+    block->size = size;
+    block->used = 0;
+
+    return block;
+}
+
+void *fs_mgr_arena_alloc(struct fstab *fstab, size_t size)
+{
+    struct fstab_arena *block = fstab->arena;
+
+    if (!block || block->size - block->used < size) {
+        /* the first block is sized for the whole file, so this is rare */
+        block = arena_new_block(size > 256 ? size : 256);
+        if (!block) {
+            return NULL;
+        }
+        block->next = fstab->arena;
+        fstab->arena = block;
+    }
+
+    void *ptr = block->data + block->used;
+    block->used += size;
+
+    return ptr;
+}
+
+char *fs_mgr_arena_strndup(struct fstab *fstab, const char *s, size_t len)
+{
+    char *ret = fs_mgr_arena_alloc(fstab, len + 1);
+    if (!ret) {
+        return NULL;
+    }
+
+    memcpy(ret, s, len);
+    ret[len] = '\0';
+
+    return ret;
+}
+
+char *fs_mgr_arena_strdup(struct fstab *fstab, const char *s)
+{
+    return fs_mgr_arena_strndup(fstab, s, strlen(s));
+}
+
+static struct fstab_rec *fstab_new_rec(struct fstab *fstab, int *alloc_entries)
+{
+    if (fstab->num_entries == *alloc_entries) {
+        int n = *alloc_entries ? *alloc_entries * 2 : 16;
+        struct fstab_rec *recs = realloc(fstab->recs, n * sizeof(struct fstab_rec));
+        if (!recs) {
+            return NULL;
+        }
+        fstab->recs = recs;
+        *alloc_entries = n;
+    }
+
+    struct fstab_rec *rec = &fstab->recs[fstab->num_entries++];
+    memset(rec, 0, sizeof(*rec));
+
+    return rec;
+}
+
 struct fstab *fs_mgr_read_fstab(const char *fstab_path)
 {
-    FILE *fstab_file;
-    int cnt, entries;
-    ssize_t len;
-    size_t alloc_len = 0;
-    char *line = NULL;
+    int fd;
+    struct stat sb;
+    int alloc_entries = 0;
     const char *delim = " \t";
-    char *save_ptr, *p;
+    char *save_ptr, *line_save_ptr, *p, *line;
     struct fstab *fstab = NULL;
     struct fs_mgr_flag_values flag_vals;
 #define FS_OPTIONS_LEN 1024
     char tmp_fs_options[FS_OPTIONS_LEN];
 
-    fstab_file = fopen(fstab_path, "r");
-    if (!fstab_file) {
+    fd = open(fstab_path, O_RDONLY|O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &sb)) {
         ERROR("Cannot open file %s\n", fstab_path);
-        return 0;
-    }
-
-    entries = 0;
-    while ((len = getline(&line, &alloc_len, fstab_file)) != -1) {
-        /* if the last character is a newline, shorten the string by 1 byte */
-        if (line[len - 1] == '\n') {
-            line[len - 1] = '\0';
-        }
-        /* Skip any leading whitespace */
-        p = line;
-        while (isspace(*p)) {
-            p++;
-        }
-        /* ignore comments or empty lines */
-        if (*p == '#' || *p == '\0')
-            continue;
-        entries++;
-    }
-
-    if (!entries) {
-        ERROR("No entries found in fstab\n");
         goto err;
     }
 
     /* Allocate and init the fstab structure */
     fstab = calloc(1, sizeof(struct fstab));
-    fstab->num_entries = entries;
-    fstab->fstab_filename = strdup(fstab_path);
-    fstab->recs = calloc(fstab->num_entries, sizeof(struct fstab_rec));
+    if (!fstab) {
+        goto err;
+    }
 
-    fseek(fstab_file, 0, SEEK_SET);
+    /* The file gets tokenized in place. Only the flags are copied, because
+     * parse_flags modifies them, and all other strings are derived from the
+     * flags. So three times the file size always fits into the first block.
+     */
+    fstab->arena = arena_new_block(3 * (size_t)sb.st_size + strlen(fstab_path) + 64);
+    if (!fstab->arena) {
+        goto err;
+    }
+    fstab->fstab_filename = fs_mgr_arena_strdup(fstab, fstab_path);
 
-    cnt = 0;
-    while ((len = getline(&line, &alloc_len, fstab_file)) != -1) {
-        /* if the last character is a newline, shorten the string by 1 byte */
-        if (line[len - 1] == '\n') {
-            line[len - 1] = '\0';
-        }
+    char *data = fs_mgr_arena_alloc(fstab, sb.st_size + 1);
+    ssize_t len = read(fd, data, sb.st_size);
+    if (len < 0) {
+        ERROR("Cannot read file %s\n", fstab_path);
+        goto err;
+    }
+    data[len] = '\0';
+    close(fd);
+    fd = -1;
 
+    for (line = strtok_r(data, "\n", &line_save_ptr); line; line = strtok_r(NULL, "\n", &line_save_ptr)) {
         /* Skip any leading whitespace */
         p = line;
         while (isspace(*p)) {
@@ -319,82 +379,87 @@ struct fstab *fs_mgr_read_fstab(const char *fstab_path)
         if (*p == '#' || *p == '\0')
             continue;
 
-        /* If a non-comment entry is greater than the size we allocated, give an
-         * error and quit.  This can happen in the unlikely case the file changes
-         * between the two reads.
-         */
-        if (cnt >= entries) {
-            ERROR("Tried to process more entries than counted\n");
-            break;
+        struct fstab_rec *rec = fstab_new_rec(fstab, &alloc_entries);
+        if (!rec) {
+            goto err;
         }
 
         if (!(p = strtok_r(line, delim, &save_ptr))) {
             ERROR("Error parsing mount source\n");
             goto err;
         }
-        fstab->recs[cnt].blk_device = strdup(p);
+        rec->blk_device = p;
 
         if (!(p = strtok_r(NULL, delim, &save_ptr))) {
             ERROR("Error parsing mount_point\n");
             goto err;
         }
-        fstab->recs[cnt].mount_point = strdup(p);
+        rec->mount_point = p;
 
         if (!(p = strtok_r(NULL, delim, &save_ptr))) {
             ERROR("Error parsing fs_type\n");
             goto err;
         }
-        fstab->recs[cnt].fs_type = strdup(p);
+        rec->fs_type = p;
 
         if (!(p = strtok_r(NULL, delim, &save_ptr))) {
             ERROR("Error parsing mount_flags\n");
             goto err;
         }
-        fstab->recs[cnt].mnt_flags_orig = strdup(p);
+        rec->mnt_flags_orig = fs_mgr_arena_strdup(fstab, p);
 
         tmp_fs_options[0] = '\0';
-        fstab->recs[cnt].flags = parse_flags(p, mount_flags, NULL,
-                                       tmp_fs_options, FS_OPTIONS_LEN);
+        rec->flags = parse_flags(fstab, p, mount_flags, NULL,
+                                 tmp_fs_options, FS_OPTIONS_LEN);
 
         /* fs_options are optional */
         if (tmp_fs_options[0]) {
-            fstab->recs[cnt].fs_options = strdup(tmp_fs_options);
+            rec->fs_options = fs_mgr_arena_strdup(fstab, tmp_fs_options);
         } else {
-            fstab->recs[cnt].fs_options = NULL;
+            rec->fs_options = NULL;
         }
 
         if (!(p = strtok_r(NULL, delim, &save_ptr))) {
             ERROR("Error parsing fs_mgr_options\n");
             goto err;
         }
-        fstab->recs[cnt].fs_mgr_flags_orig = strdup(p);
-
-        fstab->recs[cnt].fs_mgr_flags = parse_flags(p, fs_mgr_flags,
-                                                    &flag_vals, NULL, 0);
-        fstab->recs[cnt].key_loc = flag_vals.key_loc;
-        fstab->recs[cnt].verity_loc = flag_vals.verity_loc;
-        fstab->recs[cnt].length = flag_vals.part_length;
-        fstab->recs[cnt].label = flag_vals.label;
-        fstab->recs[cnt].partnum = flag_vals.partnum;
-        fstab->recs[cnt].swap_prio = flag_vals.swap_prio;
-        fstab->recs[cnt].zram_size = flag_vals.zram_size;
-        fstab->recs[cnt].zram_streams = flag_vals.zram_streams;
-        fstab->recs[cnt].file_encryption_mode = flag_vals.file_encryption_mode;
-        fstab->recs[cnt].esp = flag_vals.esp;
-        cnt++;
+        rec->fs_mgr_flags_orig = fs_mgr_arena_strdup(fstab, p);
+
+        rec->fs_mgr_flags = parse_flags(fstab, p, fs_mgr_flags,
+                                        &flag_vals, NULL, 0);
+        rec->key_loc = flag_vals.key_loc;
+        rec->verity_loc = flag_vals.verity_loc;
+        rec->length = flag_vals.part_length;
+        rec->label = flag_vals.label;
+        rec->partnum = flag_vals.partnum;
+        rec->swap_prio = flag_vals.swap_prio;
+        rec->zram_size = flag_vals.zram_size;
+        rec->zram_streams = flag_vals.zram_streams;
+        rec->file_encryption_mode = flag_vals.file_encryption_mode;
+        rec->esp = flag_vals.esp;
+    }
+
+    if (!fstab->num_entries) {
+        ERROR("No entries found in fstab\n");
+        goto err;
     }
+
     /* If an A/B partition, modify block device to be the real block device */
     if (fs_mgr_update_for_slotselect(fstab) != 0) {
         ERROR("Error updating for slotselect\n");
         goto err;
     }
-    fclose(fstab_file);
-    free(line);
+
+    if (fs_mgr_index_fstab(fstab) != 0) {
+        ERROR("Error indexing fstab\n");
+        goto err;
+    }
+
     return fstab;
 
 err:
-    fclose(fstab_file);
-    free(line);
+    if (fd >= 0)
+        close(fd);
     if (fstab)
         fs_mgr_free_fstab(fstab);
     return NULL;
@@ -402,27 +467,21 @@ err:
 
 void fs_mgr_free_fstab(struct fstab *fstab)
 {
-    int i;
+    struct fstab_arena *block, *next;
 
     if (!fstab) {
         return;
     }
 
-    for (i = 0; i < fstab->num_entries; i++) {
-        /* Free the pointers return by strdup(3) */
-        free(fstab->recs[i].blk_device);
-        free(fstab->recs[i].mount_point);
-        free(fstab->recs[i].fs_type);
-        free(fstab->recs[i].fs_options);
-        free(fstab->recs[i].key_loc);
-        free(fstab->recs[i].label);
+    /* All strings live in the arena */
+    for (block = fstab->arena; block; block = next) {
+        next = block->next;
+        free(block);
     }
 
-    /* Free the fstab_recs array created by calloc(3) */
+    /* Free the fstab_recs array created by realloc(3) */
     free(fstab->recs);
-
-    /* Free the fstab filename */
-    free(fstab->fstab_filename);
+    free(fstab->index);
 
     /* Free fstab */
     free(fstab);
@@ -445,16 +504,16 @@ int fs_mgr_add_entry(struct fstab *fstab,
 
     /* A new entry was added, so initialize it */
      memset(&new_fstab_recs[n], 0, sizeof(struct fstab_rec));
-     new_fstab_recs[n].mount_point = strdup(mount_point);
-     new_fstab_recs[n].fs_type = strdup(fs_type);
-     new_fstab_recs[n].blk_device = strdup(blk_device);
+     new_fstab_recs[n].mount_point = fs_mgr_arena_strdup(fstab, mount_point);
+     new_fstab_recs[n].fs_type = fs_mgr_arena_strdup(fstab, fs_type);
+     new_fstab_recs[n].blk_device = fs_mgr_arena_strdup(fstab, blk_device);
      new_fstab_recs[n].length = 0;
 
      /* Update the fstab struct */
      fstab->recs = new_fstab_recs;
      fstab->num_entries++;
 
-     return 0;
+     return fs_mgr_index_fstab(fstab);
 }
 
 /*
@@ -97,6 +97,10 @@ __BEGIN_DECLS
 
 int fs_mgr_set_blk_ro(const char *blockdev);
 int fs_mgr_update_for_slotselect(struct fstab *fstab);
+void *fs_mgr_arena_alloc(struct fstab *fstab, size_t size);
+char *fs_mgr_arena_strndup(struct fstab *fstab, const char *s, size_t len);
+char *fs_mgr_arena_strdup(struct fstab *fstab, const char *s);
+int fs_mgr_index_fstab(struct fstab *fstab);
 
 __END_DECLS
 
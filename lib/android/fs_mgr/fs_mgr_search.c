@@ -26,59 +26,110 @@
 
 #include "fs_mgr_priv.h"
 
-struct fstab_rec *fs_mgr_esp(struct fstab *fstab)
+static uint32_t index_hash(const char *s)
 {
-    int i = 0;
+    uint32_t hash = 2166136261u;
 
-    if (!fstab) {
-        return NULL;
+    while (*s) {
+        hash ^= (unsigned char)*s++;
+        hash *= 16777619u;
     }
 
-    for (i = 0; i < fstab->num_entries; i++) {
-        if (fstab->recs[i].esp)
-            return &fstab->recs[i];
+    return hash % FSTAB_INDEX_BUCKETS;
+}
+
+static const char *index_key(const struct fstab_rec *rec, int key)
+{
+    switch (key) {
+        case FSTAB_INDEX_MOUNT_POINT:
+            return rec->mount_point;
+        case FSTAB_INDEX_NAME:
+            return rec->mount_point[0] ? rec->mount_point + 1 : rec->mount_point;
+        case FSTAB_INDEX_BLK_DEVICE:
+            return rec->blk_device;
+        default:
+            return NULL;
     }
+}
 
-    return NULL;
+int fs_mgr_index_fstab(struct fstab *fstab)
+{
+    int i, key;
+    size_t size = sizeof(struct fstab_index) + fstab->num_entries * sizeof(fstab->index->next[0]);
+
+    struct fstab_index *index = realloc(fstab->index, size);
+    if (!index) {
+        return -1;
+    }
+    fstab->index = index;
+
+    index->size = size;
+    index->esp = -1;
+    index->nvvars = -1;
+    memset(index->buckets, 0xff, sizeof(index->buckets));
+
+    /* insert in reverse, so the chains keep the order of the fstab */
+    for (i = fstab->num_entries - 1; i >= 0; i--) {
+        struct fstab_rec *rec = &fstab->recs[i];
+
+        for (key = 0; key < FSTAB_INDEX_NUM_KEYS; key++) {
+            int *bucket = &index->buckets[key][index_hash(index_key(rec, key))];
+            index->next[i][key] = *bucket;
+            *bucket = i;
+        }
+
+        if (rec->esp)
+            index->esp = i;
+        if (fs_mgr_is_nvvars(rec))
+            index->nvvars = i;
+    }
+
+    return 0;
 }
 
-struct fstab_rec *fs_mgr_nvvars(struct fstab *fstab)
+static struct fstab_rec *index_lookup(struct fstab *fstab, int key, const char *value)
 {
-    int i = 0;
+    int i;
 
-    if (!fstab) {
+    if (!fstab || !fstab->index) {
         return NULL;
     }
 
-    for (i = 0; i < fstab->num_entries; i++) {
-        if (fs_mgr_is_nvvars(&fstab->recs[i]))
+    for (i = fstab->index->buckets[key][index_hash(value)]; i >= 0; i = fstab->index->next[i][key]) {
+        if (!strcmp(index_key(&fstab->recs[i], key), value))
             return &fstab->recs[i];
     }
 
     return NULL;
 }
 
+struct fstab_rec *fs_mgr_esp(struct fstab *fstab)
+{
+    if (!fstab || !fstab->index || fstab->index->esp < 0) {
+        return NULL;
+    }
+
+    return &fstab->recs[fstab->index->esp];
+}
+
+struct fstab_rec *fs_mgr_nvvars(struct fstab *fstab)
+{
+    if (!fstab || !fstab->index || fstab->index->nvvars < 0) {
+        return NULL;
+    }
+
+    return &fstab->recs[fstab->index->nvvars];
+}
+
 struct fstab_rec *fs_mgr_get_by_ueventblock(struct fstab *fstab, uevent_block_t *block)
 {
     int i = 0;
-    char buf[PATH_MAX];
-    char *fstype = NULL;
     struct fstab_rec *ret = NULL;
-    int rc;
 
     if (!fstab) {
         return NULL;
     }
 
-    // build dev name
-    rc = snprintf(buf, sizeof(buf), MBPATH_DEV"/block/%s", block->devname);
-    if (rc<0 || (size_t)rc>=sizeof(buf)) {
-        return NULL;
-    }
-
-    // get fstype
-    fstype = util_get_fstype(buf);
-
     for (i = 0; i < fstab->num_entries; i++) {
         uevent_block_t *fstab_block = get_blockinfo_for_path(multiboot_get_data()->blockinfo, fstab->recs[i].blk_device);
         if (!fstab_block)
@@ -91,38 +142,20 @@ struct fstab_rec *fs_mgr_get_by_ueventblock(struct fstab *fstab, uevent_block_t
         }
     }
 
-    free(fstype);
     return ret;
 }
 
 struct fstab_rec *fs_mgr_get_by_mountpoint(struct fstab *fstab, const char *mount_point)
 {
-    int i = 0;
-
-    if (!fstab) {
-        return NULL;
-    }
-
-    for (i = 0; i < fstab->num_entries; i++) {
-        if (!strcmp(fstab->recs[i].mount_point, mount_point))
-            return &fstab->recs[i];
-    }
-
-    return NULL;
+    return index_lookup(fstab, FSTAB_INDEX_MOUNT_POINT, mount_point);
 }
 
 struct fstab_rec *fs_mgr_get_by_name(struct fstab *fstab, const char *name)
 {
-    int i = 0;
-
-    if (!fstab) {
-        return NULL;
-    }
-
-    for (i = 0; i < fstab->num_entries; i++) {
-        if (!strcmp(fstab->recs[i].mount_point+1, name))
-            return &fstab->recs[i];
-    }
+    return index_lookup(fstab, FSTAB_INDEX_NAME, name);
+}
 
-    return NULL;
+struct fstab_rec *fs_mgr_get_by_blk_device(struct fstab *fstab, const char *blk_device)
+{
+    return index_lookup(fstab, FSTAB_INDEX_BLK_DEVICE, blk_device);
 }
@@ -144,6 +144,7 @@ int fs_mgr_update_for_slotselect(struct fstab *fstab)
     for (n = 0; n < fstab->num_entries; n++) {
         if (fstab->recs[n].fs_mgr_flags & MF_SLOTSELECT) {
             char *tmp;
+            size_t len;
 
             if (!got_suffix) {
                 memset(suffix, '\0', sizeof(suffix));
@@ -154,13 +155,13 @@ int fs_mgr_update_for_slotselect(struct fstab *fstab)
                 got_suffix = 1;
             }
 
-            if (asprintf(&tmp, "%s%s", fstab->recs[n].blk_device,
-                         suffix) > 0) {
-                free(fstab->recs[n].blk_device);
-                fstab->recs[n].blk_device = tmp;
-            } else {
+            len = strlen(fstab->recs[n].blk_device) + strlen(suffix) + 1;
+            tmp = fs_mgr_arena_alloc(fstab, len);
+            if (!tmp) {
                 return -1;
             }
+            snprintf(tmp, len, "%s%s", fstab->recs[n].blk_device, suffix);
+            fstab->recs[n].blk_device = tmp;
         }
     }
     return 0;
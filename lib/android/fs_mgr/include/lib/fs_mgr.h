@@ -18,6 +18,7 @@
 #define __CORE_FS_MGR_H
 
 #include <stdint.h>
+#include <stddef.h>
 #include <lib/uevent.h>
 //#include <linux/dm-ioctl.h>
 
@@ -50,6 +51,40 @@ struct fstab {
     int num_entries;
     struct fstab_rec *recs;
     char *fstab_filename;
+    struct fstab_arena *arena;
+    struct fstab_index *index;
+};
+
+/*
+ * All strings of an fstab are allocated from a chain of arena blocks,
+ * so the whole fstab can be freed or serialized in one piece.
+ */
+struct fstab_arena {
+    struct fstab_arena *next;
+    size_t size;
+    size_t used;
+    char data[];
+};
+
+enum fstab_index_key {
+    FSTAB_INDEX_MOUNT_POINT = 0,
+    FSTAB_INDEX_NAME,
+    FSTAB_INDEX_BLK_DEVICE,
+    FSTAB_INDEX_NUM_KEYS,
+};
+
+#define FSTAB_INDEX_BUCKETS 32
+
+/*
+ * Hash index over the entries. It references entries by their position,
+ * chains are ordered like the fstab and end with -1.
+ */
+struct fstab_index {
+    uint32_t size;
+    int esp;
+    int nvvars;
+    int buckets[FSTAB_INDEX_NUM_KEYS][FSTAB_INDEX_BUCKETS];
+    int next[][FSTAB_INDEX_NUM_KEYS];
 };
 
 struct fstab_rec {
@@ -101,6 +136,7 @@ struct fstab_rec *fs_mgr_nvvars(struct fstab *fstab);
 struct fstab_rec *fs_mgr_get_by_ueventblock(struct fstab *fstab, uevent_block_t *block);
 struct fstab_rec *fs_mgr_get_by_mountpoint(struct fstab *fstab, const char *mount_point);
 struct fstab_rec *fs_mgr_get_by_name(struct fstab *fstab, const char *name);
+struct fstab_rec *fs_mgr_get_by_blk_device(struct fstab *fstab, const char *blk_device);
 int fs_mgr_get_crypt_info(struct fstab *fstab, char *key_loc,
                           char *real_blk_device, int size);
 int fs_mgr_load_verity_state(int *mode);
@@ -23,8 +23,10 @@ extern "C" {
 
 #include <lib/list.h>
 
-typedef struct {
+typedef struct mounted_volume {
     list_node_t node;
+    struct mounted_volume *mount_point_next;
+    struct mounted_volume *majmin_next;
 
     int id;
     int parentid;
@@ -37,12 +39,31 @@ typedef struct {
     const char *flags;
 } mounted_volume_t;
 
-typedef list_node_t mounts_state_t;
+#define MOUNTS_HASH_BUCKETS 64
+
+typedef struct {
+    list_node_t volumes;
+    mounted_volume_t *by_mount_point[MOUNTS_HASH_BUCKETS];
+    mounted_volume_t *by_majmin[MOUNTS_HASH_BUCKETS];
+} mounts_state_t;
+
+#define MOUNTS_STATE_INITIAL_VALUE(state) { .volumes = LIST_INITIAL_VALUE((state).volumes) }
 
 void free_mounts_state(mounts_state_t *mounts_state);
 
 int scan_mounted_volumes(mounts_state_t *mounts_state);
 
+/*
+ * Process wide mount table which only gets rescanned after the kernel
+ * reported a change. The returned state stays valid and unchanged
+ * until mounts_cache_put() is called.
+ * Returns NULL with errno set if the table can't be read, don't call
+ * mounts_cache_put() in that case.
+ */
+mounts_state_t *mounts_cache_get(void);
+void mounts_cache_put(void);
+void mounts_cache_invalidate(void);
+
 const mounted_volume_t *find_mounted_volume_by_device(mounts_state_t *mounts_state, const char *device);
 
 const mounted_volume_t *
@@ -22,6 +22,9 @@
 #include <errno.h>
 #include <sys/mount.h>
 #include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
 
 #include <lib/mounts.h>
 #include <common.h>
@@ -29,24 +32,51 @@
 static inline void
 free_volume_internals(const mounted_volume_t *volume)
 {
-    free((char *)volume->device);
-    free((char *)volume->mount_root);
-    free((char *)volume->mount_point);
-    free((char *)volume->filesystem);
-    free((char *)volume->flags);
+    /* the strings are part of the same allocation */
     free((mounted_volume_t *)volume);
 }
 
 void free_mounts_state(mounts_state_t *mounts_state)
 {
-    while (!list_is_empty(mounts_state)) {
-        mounted_volume_t *volume = list_remove_tail_type(mounts_state, mounted_volume_t, node);
+    while (!list_is_empty(&mounts_state->volumes)) {
+        mounted_volume_t *volume = list_remove_tail_type(&mounts_state->volumes, mounted_volume_t, node);
         free_volume_internals(volume);
     }
+
+    memset(mounts_state->by_mount_point, 0, sizeof(mounts_state->by_mount_point));
+    memset(mounts_state->by_majmin, 0, sizeof(mounts_state->by_majmin));
 }
 
 #define PROC_MOUNTS_FILENAME   MBPATH_PROC"/1/mountinfo"
 
+static uint32_t str_hash(const char *s)
+{
+    uint32_t hash = 2166136261u;
+
+    while (*s) {
+        hash ^= (unsigned char)*s++;
+        hash *= 16777619u;
+    }
+
+    return hash % MOUNTS_HASH_BUCKETS;
+}
+
+static uint32_t majmin_hash(unsigned major, unsigned minor)
+{
+    return ((major * 31) ^ minor) % MOUNTS_HASH_BUCKETS;
+}
+
+static char *put_str(char **pos, const char *str)
+{
+    char *ret = *pos;
+    size_t len = strlen(str) + 1;
+
+    memcpy(ret, str, len);
+    *pos += len;
+
+    return ret;
+}
+
 int
 scan_mounted_volumes(mounts_state_t *mounts_state)
 {
@@ -54,6 +84,7 @@ scan_mounted_volumes(mounts_state_t *mounts_state)
     mntentex_t *mentry;
     mntentex_t buf_mntent;
     char buf_mntstr[PATH_MAX];
+    mounted_volume_t *v;
 
     /* Free the old volume state.
      */
@@ -65,28 +96,101 @@ scan_mounted_volumes(mounts_state_t *mounts_state)
         return -1;
     }
     while ((mentry = getmntentex(fp, &buf_mntent, buf_mntstr, sizeof(buf_mntstr))) != NULL) {
-        mounted_volume_t *v = safe_calloc(1, sizeof(mounted_volume_t));
+        size_t len = strlen(mentry->mnt_fsname) + strlen(mentry->mnt_root) + strlen(mentry->mnt_dir)
+                   + strlen(mentry->mnt_type) + strlen(mentry->mnt_opts) + 5;
+
+        v = safe_calloc(1, sizeof(mounted_volume_t) + len);
+        char *pos = (char *)(v + 1);
+
         v->id = mentry->mnt_id;
         v->parentid = mentry->mnt_pid;
         v->major = mentry->mnt_major;
         v->minor = mentry->mnt_minor;
-        v->device = safe_strdup(mentry->mnt_fsname);
-        v->mount_root = safe_strdup(mentry->mnt_root);
-        v->mount_point = safe_strdup(mentry->mnt_dir);
-        v->filesystem = safe_strdup(mentry->mnt_type);
-        v->flags = safe_strdup(mentry->mnt_opts);
+        v->device = put_str(&pos, mentry->mnt_fsname);
+        v->mount_root = put_str(&pos, mentry->mnt_root);
+        v->mount_point = put_str(&pos, mentry->mnt_dir);
+        v->filesystem = put_str(&pos, mentry->mnt_type);
+        v->flags = put_str(&pos, mentry->mnt_opts);
 
-        list_add_tail(mounts_state, &v->node);
+        list_add_tail(&mounts_state->volumes, &v->node);
     }
     endmntentex(fp);
+
+    /* Index in reverse, so lookups return the first match like a list walk.
+     */
+    for (v = list_peek_tail_type(&mounts_state->volumes, mounted_volume_t, node); v;
+         v = list_prev_type(&mounts_state->volumes, &v->node, mounted_volume_t, node)) {
+        mounted_volume_t **bucket = &mounts_state->by_mount_point[str_hash(v->mount_point)];
+        v->mount_point_next = *bucket;
+        *bucket = v;
+
+        bucket = &mounts_state->by_majmin[majmin_hash(v->major, v->minor)];
+        v->majmin_next = *bucket;
+        *bucket = v;
+    }
+
     return 0;
 }
 
+static struct {
+    pthread_mutex_t lock;
+    mounts_state_t state;
+    int fd;
+    int valid;
+    int dirty;
+} mounts_cache = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .state = MOUNTS_STATE_INITIAL_VALUE(mounts_cache.state),
+    .fd = -1,
+};
+
+mounts_state_t *mounts_cache_get(void)
+{
+    pthread_mutex_lock(&mounts_cache.lock);
+
+    /* mountinfo reports POLLPRI|POLLERR once after every change of the namespace */
+    if (mounts_cache.fd < 0) {
+        mounts_cache.fd = open(PROC_MOUNTS_FILENAME, O_RDONLY|O_CLOEXEC);
+        mounts_cache.valid = 0;
+    }
+    if (mounts_cache.fd >= 0) {
+        struct pollfd pfd = {.fd = mounts_cache.fd, .events = POLLPRI};
+        if (poll(&pfd, 1, 0) != 0)
+            mounts_cache.valid = 0;
+    }
+    if (__sync_lock_test_and_set(&mounts_cache.dirty, 0))
+        mounts_cache.valid = 0;
+
+    /* without the fd we can't know about changes, so always rescan */
+    if (!mounts_cache.valid || mounts_cache.fd < 0) {
+        if (scan_mounted_volumes(&mounts_cache.state)) {
+            int errno_saved = errno;
+            pthread_mutex_unlock(&mounts_cache.lock);
+            errno = errno_saved;
+            return NULL;
+        }
+        mounts_cache.valid = 1;
+    }
+
+    return &mounts_cache.state;
+}
+
+void mounts_cache_put(void)
+{
+    pthread_mutex_unlock(&mounts_cache.lock);
+}
+
+/* may be called while holding the cache */
+void mounts_cache_invalidate(void)
+{
+    __sync_lock_test_and_set(&mounts_cache.dirty, 1);
+}
+
 const mounted_volume_t *
 find_mounted_volume_by_device(mounts_state_t *mounts_state, const char *device)
 {
     mounted_volume_t *v;
-    list_for_every_entry(mounts_state, v, mounted_volume_t, node) {
+    list_for_every_entry(&mounts_state->volumes, v, mounted_volume_t, node) {
         /* May be null if it was unmounted and we haven't rescanned.
          */
         if (v->device != NULL) {
@@ -103,7 +207,7 @@ const mounted_volume_t *
 find_mounted_volume_by_mount_point(mounts_state_t *mounts_state, const char *mount_point)
 {
     mounted_volume_t *v;
-    list_for_every_entry(mounts_state, v, mounted_volume_t, node) {
+    for (v = mounts_state->by_mount_point[str_hash(mount_point)]; v; v = v->mount_point_next) {
         /* May be null if it was unmounted and we haven't rescanned.
          */
         if (v->mount_point != NULL) {
@@ -119,8 +223,8 @@ const mounted_volume_t *
 find_mounted_volume_by_majmin(mounts_state_t *mounts_state, unsigned major, unsigned minor, int with_bindmounts)
 {
     mounted_volume_t *v;
-    list_for_every_entry(mounts_state, v, mounted_volume_t, node) {
-        if (v->major == major && v->minor == minor) {
+    for (v = mounts_state->by_majmin[majmin_hash(major, minor)]; v; v = v->majmin_next) {
+        if (v->mount_point != NULL && v->major == major && v->minor == minor) {
             if (with_bindmounts || !strcmp(v->mount_root, "/"))
                 return v;
         }
@@ -137,8 +241,11 @@ unmount_mounted_volume(const mounted_volume_t *volume)
      */
     int ret = umount(volume->mount_point);
     if (ret == 0) {
-        list_delete((list_node_t *)&volume->node);
-        free_volume_internals(volume);
+        /* the indexes still reference it, so it gets freed on the next rescan */
+        mounted_volume_t *v = (mounted_volume_t *)volume;
+        v->device = NULL;
+        v->mount_point = NULL;
+        mounts_cache_invalidate();
         return 0;
     }
     return ret;
@@ -25,7 +25,10 @@
 #include <string.h>
 #include <ctype.h>
 #include <limits.h>
+#include <pthread.h>
+#include <sched.h>
 #include <sys/stat.h>
+#include <sys/file.h>
 
 #include <lib/cksum.h>
 #include <lib/efivars.h>
@@ -40,11 +43,27 @@
 #define ALIGN(a, b) ROUNDUP(a, b)
 #define MIN(a, b) (((a) < (b)) ? (a) : (b))
 
+// NV area layout, the last 64KiB of the nvvars partition:
+//   efivar_hdr_t, variable records      the compacted image the firmware reads
+//   efivar_log_hdr_t                    8 byte aligned, right after the image
+//   efivar_log_rec_t, variable record   updates, replayed in order on load
+//   efivar_log_rec_t with size 0        end of the log
+// the log only counts if its header matches the image in front of it, and the
+// firmware only reads the image. so the log gets compacted into a new image
+// before control goes back to the firmware, and whenever the area is full.
+//
+// the trigger, the applet and forked children all keep their own copy of the
+// area. writers hold an flock on the device and only update the area in place
+// if it still is the one they read, otherwise they read it again first.
 #define EFIVAR_MAGIC 0x6f69766e // nvio
+#define EFIVAR_LOG_MAGIC 0x676c766e // nvlg
+#define EFIVAR_LOG_VERSION 1
+#define EFIVAR_AREA_SIZE 0x10000
+#define EFIVAR_HASH_BUCKETS 32
 
-#define EFIVAR_ENTRY_SIZE(name, datasize) \
+#define EFIVAR_RECORD_SIZE(namesize, datasize) \
         (sizeof(uint32_t) + /* namesize */ \
-        ALIGN((strlen(name)+1)*sizeof(uint16_t), sizeof(uint32_t)) + /* name */ \
+        ALIGN(namesize, sizeof(uint32_t)) + /* name */ \
         ALIGN(sizeof(efi_guid_t), sizeof(uint32_t)) + /* guid */ \
         ALIGN(sizeof(uint32_t), sizeof(uint32_t)) + /* attributes */ \
         sizeof(uint32_t) + /* datasize */ \
@@ -52,6 +71,20 @@
 
 #define EFIVARDEV MBPATH_DEV "/efivardev"
 
+// fatal errors go into a preallocated variable, which is always the first
+// record of the NV area. while no error is set it's named EFIDroidErrorPad,
+// so both names need to have the same length.
+#define EFIVAR_ERROR_NAME "EFIDroidErrorStr"
+#define EFIVAR_ERROR_PAD_NAME "EFIDroidErrorPad"
+#define EFIVAR_ERROR_SIZE 512
+#define EFIVAR_ERROR_NAMESIZE (sizeof(EFIVAR_ERROR_NAME)*sizeof(uint16_t))
+#define EFIVAR_ERROR_NAME_OFFSET (sizeof(efivar_hdr_t) + sizeof(uint32_t))
+#define EFIVAR_ERROR_DATA_OFFSET (EFIVAR_ERROR_NAME_OFFSET + \
+        ALIGN(EFIVAR_ERROR_NAMESIZE, sizeof(uint32_t)) + \
+        ALIGN(sizeof(efi_guid_t), sizeof(uint32_t)) + \
+        2*sizeof(uint32_t))
+#define EFIVAR_ERROR_END (EFIVAR_ERROR_DATA_OFFSET + EFIVAR_ERROR_SIZE)
+
 typedef struct {
     uint32_t magic;
     uint32_t data_size;
@@ -59,41 +92,143 @@ typedef struct {
 } __attribute__((packed)) efivar_hdr_t;
 
 typedef struct {
-    // device for writing
-    void *buf;
-    uint32_t bufsize;
-    bool found;
+    uint32_t magic;
+    uint32_t version;
+    // data_size and CRC of the image, without the error slot
+    uint32_t base_size;
+    uint32_t base_crc32;
+} __attribute__((packed)) efivar_log_hdr_t;
+
+typedef struct {
+    // including this header, a multiple of 4
+    uint32_t size;
+    // of size and the variable record
+    uint32_t crc32;
+} __attribute__((packed)) efivar_log_rec_t;
 
-    // backup data in case the variable exists
+typedef struct {
+    // name and data share one allocation
     uint16_t *name;
     uint32_t namesize;
-    const void *data;
+    void *data;
     uint32_t datasize;
     efi_guid_t guid;
     uint32_t attributes;
-} efivar_pdata_t;
+
+    // hash of name+guid and the next entry in the same bucket
+    uint32_t hash;
+    int next;
+
+    // changed since the last sync, deleted entries stay until then
+    int dirty;
+    int deleted;
+} efivar_entry_t;
 
 typedef unsigned long addr_t;
 typedef int (*efivar_callback_t)(void *pdata, const uint16_t *name, const uint32_t namesize, const void *data,
                                  const uint32_t datasize, efi_guid_t guid, uint32_t attributes);
 
-static int copy_ansi2unicodestr(uint16_t **outdst, const char *src, size_t *outsz)
+// the whole NV area is read once and written back at sync points
+static struct {
+    pthread_mutex_t lock;
+    char *device;
+    int loaded;
+    int dirty;
+    pid_t owner;
+    int atexit_registered;
+
+    // the NV area as it is on disk
+    int fd;
+    int writable;
+    off_t area_offset;
+    uint8_t *image;
+    uint32_t log_start;
+    // offset of the end marker, 0 while there's no log
+    uint32_t log_end;
+
+    // the error slot is written without taking the lock, see efivars_report_error
+    int image_busy;
+    volatile int slot_ready;
+    volatile int error_reported;
+    int slot_dirty;
+    int need_compact;
+    // the image was read again by efivars_report_error, the table is outdated
+    volatile int stale;
+
+    efivar_entry_t *entries;
+    int num_entries;
+    int max_entries;
+    int buckets[EFIVAR_HASH_BUCKETS];
+} efivar_store = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .fd = -1,
+};
+
+static uint32_t efivar_hash_guid(uint32_t hash, const efi_guid_t *guid)
+{
+    const uint8_t *p = (const uint8_t *)guid;
+    size_t i;
+
+    for (i=0; i<sizeof(*guid); i++) {
+        hash ^= p[i];
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+static uint32_t efivar_hash_unicode(const uint16_t *name, uint32_t namesize, const efi_guid_t *guid)
 {
-    uint16_t *dst = NULL;
-    size_t sz = (strlen(src)+1)*sizeof(uint16_t);
+    uint32_t hash = 2166136261u;
+    uint32_t i;
 
-    *outdst = dst = malloc(sz);
-    if (!dst) return (int)dst;
+    for (i=0; i<namesize/sizeof(uint16_t) && name[i]; i++) {
+        hash ^= name[i];
+        hash *= 16777619u;
+    }
+
+    return efivar_hash_guid(hash, guid);
+}
+
+// must hash the same as the unicode version of the name
+static uint32_t efivar_hash_ansi(const char *name, const efi_guid_t *guid)
+{
+    uint32_t hash = 2166136261u;
 
-    while (*src) {
-        *(dst++) = *(src++);
+    for (; *name; name++) {
+        hash ^= (uint16_t)*name;
+        hash *= 16777619u;
     }
-    *dst = 0;
 
-    if (outsz)
-        *outsz = sz;
+    return efivar_hash_guid(hash, guid);
+}
 
-    return 0;
+static bool efivar_name_equals(const efivar_entry_t *entry, const char *name)
+{
+    uint32_t i;
+
+    for (i=0; i<entry->namesize/sizeof(uint16_t); i++) {
+        if (entry->name[i]!=(uint16_t)name[i])
+            return false;
+        if (!name[i])
+            return true;
+    }
+
+    return false;
+}
+
+static bool efivar_name_equals_unicode(const efivar_entry_t *entry, const uint16_t *name, uint32_t namesize)
+{
+    uint32_t i;
+
+    for (i=0; i<entry->namesize/sizeof(uint16_t) && i<namesize/sizeof(uint16_t); i++) {
+        if (entry->name[i]!=name[i])
+            return false;
+        if (!name[i])
+            return true;
+    }
+
+    return false;
 }
 
 static char *efivar_getdev(void)
@@ -127,130 +262,148 @@ err:
     return NULL;
 }
 
-static int efivar_read_to_buf(const char *device, void **buf, uint32_t *outdatasize)
+static int efivar_open(void)
 {
-    off_t off;
     int fd;
-    ssize_t nbytes;
-    int rc = 0;
-    efivar_hdr_t hdr;
-    uint8_t *data = NULL;
+    off_t off;
+
+    if (efivar_store.fd>=0)
+        return 0;
 
-    if (!device) {
+    // resolving the device may create a node, so only do it once
+    if (!efivar_store.device)
+        efivar_store.device = efivar_getdev();
+    if (!efivar_store.device) {
         LOGE("nvvars device is NULL\n");
         return -1;
     }
 
-    // open device
-    fd = open(device, O_RDONLY);
+    // open device, reading doesn't need write access
+    fd = open(efivar_store.device, O_RDONLY|O_CLOEXEC);
     if (fd<0) {
-        LOGE("can't open %s: %s\n", device, strerror(-fd));
-        return fd;
+        LOGE("can't open %s: %s\n", efivar_store.device, strerror(errno));
+        return -errno;
     }
 
-    // seek to start of the NVVARS data
-    off = lseek(fd, -0x10000, SEEK_END);
-    if (off<0) {
-        perror("seek failed");
-        rc = (int)fd;
-        goto err_close;
+    // the NVVARS data is at the end of the device
+    off = lseek(fd, 0, SEEK_END);
+    if (off<EFIVAR_AREA_SIZE) {
+        LOGE("nvvars device is too small\n");
+        close(fd);
+        return -EINVAL;
     }
 
-    // read header
-    nbytes = read(fd, &hdr, sizeof(hdr));
-    if (nbytes!=sizeof(hdr)) {
-        perror("reading header failed");
-        rc = (int)nbytes;
-        goto err_close;
-    }
+    efivar_store.fd = fd;
+    efivar_store.area_offset = off - EFIVAR_AREA_SIZE;
+    efivar_store.owner = getpid();
 
-    // check magic
-    if (hdr.magic!=EFIVAR_MAGIC) {
-        LOGE("Invalid magic\n");
-        rc = EINVAL;
-        goto err_close;
+    return 0;
+}
+
+// the first write reopens the device, the fd number stays the same
+static int efivar_open_rw(void)
+{
+    int fd;
+
+    if (efivar_store.writable)
+        return 0;
+
+    fd = open(efivar_store.device, O_RDWR|O_CLOEXEC);
+    if (fd<0) {
+        LOGE("can't open %s: %s\n", efivar_store.device, strerror(errno));
+        return -errno;
     }
 
-    if (outdatasize)
-        *outdatasize = hdr.data_size;
+    if (dup2(fd, efivar_store.fd)<0 || fcntl(efivar_store.fd, F_SETFD, FD_CLOEXEC)<0) {
+        LOGE("can't reopen %s: %s\n", efivar_store.device, strerror(errno));
+        close(fd);
+        return -errno;
+    }
+    close(fd);
 
-    if (buf) {
-        // allocate memory for data
-        data = malloc(hdr.data_size);
-        if (!data) {
-            LOGE("allocating data failed\n");
-            goto err_close;
-        }
+    efivar_store.writable = 1;
 
-        // read whole data area into memory
-        nbytes = read(fd, data, hdr.data_size);
-        if (nbytes!=(ssize_t)hdr.data_size) {
-            perror("reading data failed");
-            rc = (int)nbytes;
-            goto err_free;
-        }
+    return 0;
+}
 
-        // verify CRC32
-        uint32_t crc32sum = cksum_crc32(0, data, hdr.data_size);
-        if (hdr.crc32!=crc32sum) {
-            LOGE("Invalid checksum\n");
-            rc = -EIO;
-            goto err_free;
-        }
+// forked children share our file and with it the lock, so they lock a file of their own.
+// returns the locked fd, this may be called from a signal handler.
+static int efivar_flock(int operation)
+{
+    int fd = efivar_store.fd;
 
-        *buf = data;
+    if (efivar_store.owner!=getpid()) {
+        fd = open(efivar_store.device, O_RDONLY|O_CLOEXEC);
+        if (fd<0) return -1;
     }
 
-    goto err_close;
+    while (flock(fd, operation)) {
+        if (errno==EINTR)
+            continue;
 
-err_free:
-    free(data);
+        if (fd!=efivar_store.fd)
+            close(fd);
+        return -1;
+    }
 
-err_close:
-    close(fd);
+    return fd;
+}
 
-    return rc;
+static void efivar_funlock(int fd)
+{
+    flock(fd, LOCK_UN);
+    if (fd!=efivar_store.fd)
+        close(fd);
 }
 
-static int efivar_write_from_buf(const char *device, void *data, uint32_t datasize)
+static int efivar_read_image(uint32_t *outdatasize)
 {
-    off_t off;
-    int fd;
-    size_t nbytes;
-    int rc = 0;
+    ssize_t nbytes;
+    efivar_hdr_t hdr;
 
-    if (!device) {
-        LOGE("nvvars device is NULL\n");
-        return -1;
+    if (!efivar_store.image) {
+        efivar_store.image = malloc(EFIVAR_AREA_SIZE);
+        if (!efivar_store.image) {
+            LOGE("allocating data failed\n");
+            return -ENOMEM;
+        }
     }
 
-    // open device
-    fd = open(device, O_WRONLY);
-    if (fd<0) {
-        LOGE("can't open %s\n", device);
-        return fd;
+    // read the whole area, the log follows the image
+    nbytes = pread(efivar_store.fd, efivar_store.image, EFIVAR_AREA_SIZE, efivar_store.area_offset);
+    if (nbytes!=EFIVAR_AREA_SIZE) {
+        perror("reading data failed");
+        return -EIO;
+    }
+
+    // check magic
+    memcpy(&hdr, efivar_store.image, sizeof(hdr));
+    if (hdr.magic!=EFIVAR_MAGIC || hdr.data_size>EFIVAR_AREA_SIZE-sizeof(hdr)) {
+        LOGE("Invalid magic\n");
+        return EINVAL;
     }
 
-    // seek to start of the NVVARS data
-    off = lseek(fd, -0x10000, SEEK_END);
-    if (off<0) {
-        perror("seek failed");
-        rc = (int)fd;
-        goto err_close;
+    // verify CRC32
+    uint32_t crc32sum = cksum_crc32(0, efivar_store.image + sizeof(hdr), hdr.data_size);
+    if (hdr.crc32!=crc32sum) {
+        LOGE("Invalid checksum\n");
+        return -EIO;
     }
 
-    // write data
-    nbytes = write(fd, data, datasize);
-    if (nbytes!=datasize) {
+    *outdatasize = hdr.data_size;
+
+    return 0;
+}
+
+static int efivar_write_image(uint32_t offset, uint32_t size)
+{
+    ssize_t nbytes = pwrite(efivar_store.fd, efivar_store.image + offset, size, efivar_store.area_offset + offset);
+    if (nbytes!=(ssize_t)size) {
         perror("write failed");
-        rc = (int)nbytes;
-        goto err_close;
+        return -EIO;
     }
 
-err_close:
-    close(fd);
-
-    return rc;
+    return 0;
 }
 
 static int efivar_iterate(const void *buf, uint32_t bufsize, efivar_callback_t cb, void *pdata)
@@ -331,127 +484,1154 @@ static int efivar_append(void **buf, const uint16_t *name, const uint32_t namesi
     return 0;
 }
 
-static int efivar_setvar_cb(void *_pdata, const uint16_t *name, const uint32_t namesize, const void *data,
+static void efivar_store_reindex(void)
+{
+    int i;
+
+    memset(efivar_store.buckets, 0xff, sizeof(efivar_store.buckets));
+
+    // insert in reverse, so the chains keep the order of the NV area
+    for (i=efivar_store.num_entries-1; i>=0; i--) {
+        efivar_entry_t *entry = &efivar_store.entries[i];
+        int *bucket = &efivar_store.buckets[entry->hash % EFIVAR_HASH_BUCKETS];
+
+        entry->next = *bucket;
+        *bucket = i;
+    }
+}
+
+static efivar_entry_t *efivar_store_lookup_unicode(const uint16_t *name, uint32_t namesize, const efi_guid_t *guid)
+{
+    uint32_t hash = efivar_hash_unicode(name, namesize, guid);
+    int i;
+
+    for (i=efivar_store.buckets[hash % EFIVAR_HASH_BUCKETS]; i>=0; i=efivar_store.entries[i].next) {
+        efivar_entry_t *entry = &efivar_store.entries[i];
+
+        if (entry->hash==hash && !memcmp(&entry->guid, guid, sizeof(*guid)) &&
+                efivar_name_equals_unicode(entry, name, namesize))
+            return entry;
+    }
+
+    return NULL;
+}
+
+// deleted entries are returned too
+static efivar_entry_t *efivar_store_lookup(const char *name, const efi_guid_t *guid)
+{
+    uint32_t hash = efivar_hash_ansi(name, guid);
+    int i;
+
+    for (i=efivar_store.buckets[hash % EFIVAR_HASH_BUCKETS]; i>=0; i=efivar_store.entries[i].next) {
+        efivar_entry_t *entry = &efivar_store.entries[i];
+
+        if (entry->hash==hash && !memcmp(&entry->guid, guid, sizeof(*guid)) && efivar_name_equals(entry, name))
+            return entry;
+    }
+
+    return NULL;
+}
+
+// name and data have to be filled in by the caller, the index isn't updated
+static efivar_entry_t *efivar_store_new_entry(uint32_t namesize, uint32_t datasize)
+{
+    efivar_entry_t *entry;
+
+    if (efivar_store.num_entries==efivar_store.max_entries) {
+        int max_entries = efivar_store.max_entries ? efivar_store.max_entries*2 : 16;
+        efivar_entry_t *entries = realloc(efivar_store.entries, max_entries*sizeof(*entries));
+        if (!entries) return NULL;
+
+        efivar_store.entries = entries;
+        efivar_store.max_entries = max_entries;
+    }
+
+    entry = &efivar_store.entries[efivar_store.num_entries];
+    memset(entry, 0, sizeof(*entry));
+
+    entry->name = malloc(ALIGN(namesize, sizeof(uint32_t)) + datasize);
+    if (!entry->name) return NULL;
+    entry->namesize = namesize;
+    entry->data = ((uint8_t *)entry->name) + ALIGN(namesize, sizeof(uint32_t));
+    entry->datasize = datasize;
+
+    efivar_store.num_entries++;
+
+    return entry;
+}
+
+static bool efivar_is_slot_name(const char *name, const efi_guid_t *guid)
+{
+    efi_guid_t efidroid_guid = EFI_EFIDROID_VARIABLE;
+
+    return !memcmp(guid, &efidroid_guid, sizeof(*guid)) &&
+           (!strcmp(name, EFIVAR_ERROR_NAME) || !strcmp(name, EFIVAR_ERROR_PAD_NAME));
+}
+
+static bool efivar_is_slot(const efivar_entry_t *entry)
+{
+    efi_guid_t efidroid_guid = EFI_EFIDROID_VARIABLE;
+
+    return entry==efivar_store.entries && !entry->deleted && entry->datasize==EFIVAR_ERROR_SIZE &&
+           !memcmp(&entry->guid, &efidroid_guid, sizeof(efidroid_guid)) &&
+           (efivar_name_equals(entry, EFIVAR_ERROR_NAME) || efivar_name_equals(entry, EFIVAR_ERROR_PAD_NAME));
+}
+
+static void efivar_store_link(efivar_entry_t *entry)
+{
+    int *bucket = &efivar_store.buckets[entry->hash % EFIVAR_HASH_BUCKETS];
+
+    entry->next = *bucket;
+    *bucket = entry - efivar_store.entries;
+}
+
+static int efivar_entry_set_data(efivar_entry_t *entry, const void *data, uint32_t datasize)
+{
+    if (entry->datasize!=datasize) {
+        uint16_t *name = malloc(ALIGN(entry->namesize, sizeof(uint32_t)) + datasize);
+        if (!name) return -ENOMEM;
+
+        memcpy(name, entry->name, entry->namesize);
+        free(entry->name);
+        entry->name = name;
+        entry->data = ((uint8_t *)name) + ALIGN(entry->namesize, sizeof(uint32_t));
+        entry->datasize = datasize;
+    }
+
+    memcpy(entry->data, data, datasize);
+
+    return 0;
+}
+
+static void efivar_store_remove(efivar_entry_t *entry)
+{
+    int i = entry - efivar_store.entries;
+
+    free(entry->name);
+    memmove(entry, entry+1, (efivar_store.num_entries-i-1)*sizeof(*entry));
+    efivar_store.num_entries--;
+
+    efivar_store_reindex();
+}
+
+static void efivar_store_drop_deleted(void)
+{
+    int i, j;
+
+    for (i=0, j=0; i<efivar_store.num_entries; i++) {
+        efivar_entry_t *entry = &efivar_store.entries[i];
+
+        entry->dirty = 0;
+        if (entry->deleted) {
+            free(entry->name);
+            continue;
+        }
+
+        efivar_store.entries[j++] = *entry;
+    }
+
+    if (j!=efivar_store.num_entries) {
+        efivar_store.num_entries = j;
+        efivar_store_reindex();
+    }
+}
+
+static void efivar_store_clear(void)
+{
+    int i;
+
+    for (i=0; i<efivar_store.num_entries; i++)
+        free(efivar_store.entries[i].name);
+
+    free(efivar_store.entries);
+    efivar_store.entries = NULL;
+    efivar_store.num_entries = 0;
+    efivar_store.max_entries = 0;
+    memset(efivar_store.buckets, 0xff, sizeof(efivar_store.buckets));
+}
+
+static int efivar_load_cb(UNUSED void *pdata, const uint16_t *name, const uint32_t namesize, const void *data,
+                          const uint32_t datasize, efi_guid_t guid, uint32_t attributes)
+{
+    // terminator
+    if (!namesize)
+        return 0;
+
+    efivar_entry_t *entry = efivar_store_new_entry(namesize, datasize);
+    if (!entry) {
+        LOGE("Error allocating variable\n");
+        return -ENOMEM;
+    }
+
+    memcpy(entry->name, name, namesize);
+    memcpy(entry->data, data, datasize);
+    entry->guid = guid;
+    entry->attributes = attributes;
+    entry->hash = efivar_hash_unicode(entry->name, namesize, &guid);
+
+    return 0;
+}
+
+static int efivar_replay_cb(UNUSED void *pdata, const uint16_t *name, const uint32_t namesize, const void *data,
                             const uint32_t datasize, efi_guid_t guid, uint32_t attributes)
 {
-    efivar_pdata_t *pdata = _pdata;
+    efivar_entry_t *entry;
+    int rc;
+
+    if (!namesize)
+        return 0;
 
-    if (pdata->namesize==namesize && !memcmp(pdata->name, name, namesize) &&
-            !memcmp(&pdata->guid, &guid, sizeof(guid))) {
-        free(pdata->name);
-        pdata->name = (uint16_t *)name;
-        pdata->namesize = namesize;
-        pdata->data = data;
-        pdata->datasize = datasize;
-        pdata->guid = guid;
-        pdata->attributes = attributes;
+    entry = efivar_store_lookup_unicode(name, namesize, &guid);
 
-        pdata->found = true;
+    // the error slot is only ever updated in place
+    if (entry && efivar_is_slot(entry))
+        return 0;
 
+    // delete
+    if (!attributes || !datasize) {
+        if (entry)
+            efivar_store_remove(entry);
         return 0;
     }
 
-    if (pdata->buf)
-        return efivar_append(&pdata->buf, name, namesize, data, datasize, guid, attributes);
+    if (entry) {
+        entry->attributes = attributes;
+        return efivar_entry_set_data(entry, data, datasize);
+    }
+
+    rc = efivar_load_cb(NULL, name, namesize, data, datasize, guid, attributes);
+    if (rc) return rc;
+
+    efivar_store_link(&efivar_store.entries[efivar_store.num_entries-1]);
 
     return 0;
 }
 
-int efivar_get(const char *name, efi_guid_t *guid,
-               uint32_t *attributes, uint32_t *datasize, void *data)
+// the error slot may be taken by a signal handler, so never wait for it forever there
+static int efivar_image_trylock(int tries)
+{
+    int i;
+
+    for (i=0; !__sync_bool_compare_and_swap(&efivar_store.image_busy, 0, 1); i++) {
+        if (tries>=0 && i>=tries)
+            return -EBUSY;
+        sched_yield();
+    }
+
+    return 0;
+}
+
+static void efivar_image_unlock(void)
+{
+    __sync_lock_release(&efivar_store.image_busy);
+}
+
+// whether the header on disk and, with_log, the log up to its end marker are
+// still the ones in the image. returns 1 if so, 0 if not and <0 on errors.
+// the device has to be locked.
+static int efivar_disk_matches(bool with_log)
+{
+    efivar_hdr_t hdr;
+    uint32_t start, end;
+    uint8_t *buf;
+    int rc;
+
+    if (pread(efivar_store.fd, &hdr, sizeof(hdr), efivar_store.area_offset)!=sizeof(hdr))
+        return -EIO;
+    if (memcmp(&hdr, efivar_store.image, sizeof(hdr)))
+        return 0;
+
+    // the header covers the image with its CRC
+    if (!with_log)
+        return 1;
+
+    // without a log, whatever somebody else's new log would have overwritten
+    start = efivar_store.log_start;
+    if (efivar_store.log_end)
+        end = efivar_store.log_end + sizeof(efivar_log_rec_t);
+    else
+        end = MIN(start + sizeof(efivar_log_hdr_t) + sizeof(efivar_log_rec_t), EFIVAR_AREA_SIZE);
+    if (start>=end)
+        return 1;
+
+    buf = malloc(end - start);
+    if (!buf)
+        return -ENOMEM;
+
+    if (pread(efivar_store.fd, buf, end - start, efivar_store.area_offset + start)!=(ssize_t)(end - start))
+        rc = -EIO;
+    else
+        rc = !memcmp(buf, efivar_store.image + start, end - start);
+
+    free(buf);
+
+    return rc;
+}
+
+static void efivar_slot_set(efivar_entry_t *slot, const char *name, const void *data, uint32_t datasize)
+{
+    uint32_t i;
+
+    for (i=0; i<EFIVAR_ERROR_NAMESIZE/sizeof(uint16_t); i++)
+        slot->name[i] = name[i];
+
+    datasize = MIN(datasize, EFIVAR_ERROR_SIZE-1);
+    memcpy(slot->data, data, datasize);
+    memset(((uint8_t *)slot->data) + datasize, 0, EFIVAR_ERROR_SIZE-datasize);
+
+    slot->hash = efivar_hash_ansi(name, &slot->guid);
+    efivar_store_reindex();
+    efivar_store.slot_dirty = 1;
+    efivar_store.dirty = 1;
+}
+
+static bool efivar_image_name_equals(const uint16_t *name, const char *ansi)
+{
+    uint32_t i;
+
+    for (i=0; i<EFIVAR_ERROR_NAMESIZE/sizeof(uint16_t); i++) {
+        if (name[i]!=(uint16_t)ansi[i])
+            return false;
+    }
+
+    return true;
+}
+
+// whether the first record of the image is the error slot
+static bool efivar_image_has_slot(uint32_t data_size)
+{
+    efi_guid_t guid = EFI_EFIDROID_VARIABLE;
+    uint32_t namesize, datasize;
+    const uint8_t *image = efivar_store.image;
+    const uint16_t *name = (const uint16_t *)(image + EFIVAR_ERROR_NAME_OFFSET);
+
+    if (data_size < EFIVAR_ERROR_END - sizeof(efivar_hdr_t))
+        return false;
+
+    memcpy(&namesize, image + sizeof(efivar_hdr_t), sizeof(namesize));
+    memcpy(&datasize, image + EFIVAR_ERROR_DATA_OFFSET - sizeof(datasize), sizeof(datasize));
+    if (namesize!=EFIVAR_ERROR_NAMESIZE || datasize!=EFIVAR_ERROR_SIZE)
+        return false;
+
+    if (memcmp(image + EFIVAR_ERROR_NAME_OFFSET + ALIGN(EFIVAR_ERROR_NAMESIZE, sizeof(uint32_t)), &guid, sizeof(guid)))
+        return false;
+
+    return efivar_image_name_equals(name, EFIVAR_ERROR_NAME) || efivar_image_name_equals(name, EFIVAR_ERROR_PAD_NAME);
+}
+
+// updates the slot in the image and writes the header and the slot, nothing else.
+// the image and the device have to be locked.
+static int efivar_slot_write_locked(const char *name, const void *data, size_t datasize)
+{
+    uint32_t i;
+    int rc;
+    efivar_hdr_t hdr;
+    uint8_t *image = efivar_store.image;
+
+    // somebody else wrote the area since we read it. our header would not match
+    // their image, so take theirs over. this must not allocate, so the table
+    // gets reloaded at the next sync.
+    rc = efivar_disk_matches(false);
+    if (rc<0)
+        return rc;
+    if (!rc) {
+        efivar_store.stale = 1;
+        efivar_store.slot_ready = 0;
+
+        if (pread(efivar_store.fd, image, EFIVAR_AREA_SIZE, efivar_store.area_offset)!=EFIVAR_AREA_SIZE)
+            return -EIO;
+
+        memcpy(&hdr, image, sizeof(hdr));
+        if (hdr.magic!=EFIVAR_MAGIC || hdr.data_size>EFIVAR_AREA_SIZE-sizeof(hdr) ||
+                hdr.crc32!=cksum_crc32(0, image + sizeof(hdr), hdr.data_size) || !efivar_image_has_slot(hdr.data_size))
+            return -ESTALE;
+
+        efivar_store.slot_ready = 1;
+    }
+
+    uint16_t *slotname = (uint16_t *)(image + EFIVAR_ERROR_NAME_OFFSET);
+    for (i=0; i<EFIVAR_ERROR_NAMESIZE/sizeof(uint16_t); i++)
+        slotname[i] = name[i];
+
+    datasize = MIN(datasize, EFIVAR_ERROR_SIZE-1);
+    memcpy(image + EFIVAR_ERROR_DATA_OFFSET, data, datasize);
+    memset(image + EFIVAR_ERROR_DATA_OFFSET + datasize, 0, EFIVAR_ERROR_SIZE-datasize);
+
+    memcpy(&hdr, image, sizeof(hdr));
+    hdr.crc32 = cksum_crc32(0, image + sizeof(hdr), hdr.data_size);
+    memcpy(image, &hdr, sizeof(hdr));
+
+    if (pwrite(efivar_store.fd, image, EFIVAR_ERROR_END, efivar_store.area_offset)!=EFIVAR_ERROR_END)
+        return -EIO;
+
+    return 0;
+}
+
+// efivars_report_error only updates the image, take that over into the table
+static void efivar_slot_pull_locked(void)
+{
+    efivar_entry_t *slot = efivar_store.entries;
+
+    if (!efivar_store.error_reported)
+        return;
+    efivar_store.error_reported = 0;
+
+    memcpy(slot->name, efivar_store.image + EFIVAR_ERROR_NAME_OFFSET, EFIVAR_ERROR_NAMESIZE);
+    memcpy(slot->data, efivar_store.image + EFIVAR_ERROR_DATA_OFFSET, EFIVAR_ERROR_SIZE);
+    slot->hash = efivar_hash_unicode(slot->name, slot->namesize, &slot->guid);
+    efivar_store_reindex();
+}
+
+static void efivar_slot_pull(void)
+{
+    if (!efivar_store.error_reported)
+        return;
+
+    efivar_image_trylock(-1);
+    efivar_slot_pull_locked();
+    efivar_image_unlock();
+}
+
+// the log belongs to the image in front of it. the error slot is updated in
+// place without touching the log, so it isn't covered.
+static uint32_t efivar_log_base_crc(uint32_t data_size)
+{
+    uint32_t skip = 0;
+
+    if (efivar_image_has_slot(data_size))
+        skip = EFIVAR_ERROR_END - sizeof(efivar_hdr_t);
+
+    return cksum_crc32(0, efivar_store.image + sizeof(efivar_hdr_t) + skip, data_size - skip);
+}
+
+static void efivar_log_init_locked(uint32_t data_size)
 {
-    void *rawdata = NULL;
+    efivar_log_hdr_t loghdr = {
+        .magic = EFIVAR_LOG_MAGIC,
+        .version = EFIVAR_LOG_VERSION,
+        .base_size = data_size,
+        .base_crc32 = efivar_log_base_crc(data_size),
+    };
+
+    memcpy(efivar_store.image + efivar_store.log_start, &loghdr, sizeof(loghdr));
+}
+
+// the table has to be built from the image already
+static int efivar_log_replay(void)
+{
+    int rc;
+    efivar_hdr_t hdr;
+    efivar_log_hdr_t loghdr;
+    efivar_log_rec_t rec;
+    uint32_t off;
+    uint32_t num = 0;
+    uint8_t *image = efivar_store.image;
+
+    memcpy(&hdr, image, sizeof(hdr));
+    efivar_store.log_start = ALIGN(sizeof(hdr) + hdr.data_size, 8);
+    efivar_store.log_end = 0;
+
+    if (efivar_store.log_start + sizeof(loghdr) + sizeof(rec) > EFIVAR_AREA_SIZE)
+        return 0;
+
+    // no log yet, or one which belongs to an older image
+    memcpy(&loghdr, image + efivar_store.log_start, sizeof(loghdr));
+    if (loghdr.magic!=EFIVAR_LOG_MAGIC || loghdr.version!=EFIVAR_LOG_VERSION || loghdr.base_size!=hdr.data_size ||
+            loghdr.base_crc32!=efivar_log_base_crc(hdr.data_size))
+        return 0;
+
+    // a torn write ends the log too
+    off = efivar_store.log_start + sizeof(loghdr);
+    while (off + sizeof(rec) <= EFIVAR_AREA_SIZE) {
+        memcpy(&rec, image + off, sizeof(rec));
+        if (rec.size<sizeof(rec)+EFIVAR_RECORD_SIZE(0, 0) || rec.size>EFIVAR_AREA_SIZE-off || rec.size%sizeof(uint32_t))
+            break;
+
+        uint32_t crc32sum = cksum_crc32(0, (const uint8_t *)&rec.size, sizeof(rec.size));
+        crc32sum = cksum_crc32(crc32sum, image + off + sizeof(rec), rec.size - sizeof(rec));
+        if (rec.crc32!=crc32sum)
+            break;
+
+        rc = efivar_iterate(image + off + sizeof(rec), rec.size - sizeof(rec), efivar_replay_cb, NULL);
+        if (rc) return rc;
+
+        off += rec.size;
+        num++;
+    }
+    efivar_store.log_end = off;
+
+    LOGV("replayed %u log records\n", num);
+
+    return 0;
+}
+
+// appends all changed variables to the log with one write, -ENOSPC if the area is full
+static int efivar_log_append_locked(void)
+{
+    int i;
+    int rc;
+    uint32_t start, off;
+    efivar_log_rec_t rec;
+    efivar_hdr_t hdr;
+    uint8_t *image = efivar_store.image;
+
+    if (efivar_store.slot_dirty) {
+        efivar_entry_t *slot = efivar_store.entries;
+        const char *name = efivar_name_equals(slot, EFIVAR_ERROR_NAME) ? EFIVAR_ERROR_NAME : EFIVAR_ERROR_PAD_NAME;
+
+        // only a compaction can put the slot into the image
+        if (!efivar_store.slot_ready)
+            return -ENOSPC;
+
+        rc = efivar_slot_write_locked(name, slot->data, strnlen(slot->data, EFIVAR_ERROR_SIZE));
+        if (rc) return rc;
+        efivar_store.slot_dirty = 0;
+    }
+
+    // the first update after a foreign image starts a new log
+    start = off = efivar_store.log_end;
+    if (!start) {
+        memcpy(&hdr, image, sizeof(hdr));
+        start = efivar_store.log_start;
+        if (start + sizeof(efivar_log_hdr_t) + sizeof(rec) > EFIVAR_AREA_SIZE)
+            return -ENOSPC;
+
+        efivar_log_init_locked(hdr.data_size);
+        off = start + sizeof(efivar_log_hdr_t);
+    }
+
+    for (i=0; i<efivar_store.num_entries; i++) {
+        efivar_entry_t *entry = &efivar_store.entries[i];
+        uint32_t datasize = entry->deleted ? 0 : entry->datasize;
+
+        if (!entry->dirty)
+            continue;
+
+        rec.size = sizeof(rec) + EFIVAR_RECORD_SIZE(entry->namesize, datasize);
+        if (off + rec.size + sizeof(rec) > EFIVAR_AREA_SIZE)
+            return -ENOSPC;
+
+        void *bufptr = image + off + sizeof(rec);
+        efivar_append(&bufptr, entry->name, entry->namesize, entry->data, datasize, entry->guid,
+                      entry->deleted ? 0 : entry->attributes);
+
+        rec.crc32 = cksum_crc32(0, (const uint8_t *)&rec.size, sizeof(rec.size));
+        rec.crc32 = cksum_crc32(rec.crc32, image + off + sizeof(rec), rec.size - sizeof(rec));
+        memcpy(image + off, &rec, sizeof(rec));
+
+        off += rec.size;
+    }
+
+    // end marker
+    memset(image + off, 0, sizeof(rec));
+
+    rc = efivar_write_image(start, off + sizeof(rec) - start);
+    if (rc) return rc;
+
+    efivar_store.log_end = off;
+    efivar_store_drop_deleted();
+
+    return 0;
+}
+
+// writes all variables as a new image followed by an empty log
+static int efivar_compact_locked(void)
+{
+    int i;
+    int rc;
+    uint32_t datasize = 0;
+    uint32_t log_start;
+    uint8_t *image = efivar_store.image;
+
+    for (i=0; i<efivar_store.num_entries; i++) {
+        efivar_entry_t *entry = &efivar_store.entries[i];
+        if (!entry->deleted)
+            datasize += EFIVAR_RECORD_SIZE(entry->namesize, entry->datasize);
+    }
+
+    log_start = ALIGN(sizeof(efivar_hdr_t) + datasize, 8);
+    if (log_start + sizeof(efivar_log_hdr_t) + sizeof(efivar_log_rec_t) > EFIVAR_AREA_SIZE) {
+        LOGE("variables don't fit into the NV area\n");
+        return -ENOSPC;
+    }
+
+    void *bufptr = image + sizeof(efivar_hdr_t);
+    for (i=0; i<efivar_store.num_entries; i++) {
+        efivar_entry_t *entry = &efivar_store.entries[i];
+        if (!entry->deleted)
+            efivar_append(&bufptr, entry->name, entry->namesize, entry->data, entry->datasize, entry->guid, entry->attributes);
+    }
+
+    efivar_hdr_t hdr = {
+        .magic = EFIVAR_MAGIC,
+        .data_size = datasize,
+        .crc32 = cksum_crc32(0, image + sizeof(efivar_hdr_t), datasize),
+    };
+    memcpy(image, &hdr, sizeof(hdr));
+    memset(image + sizeof(hdr) + datasize, 0, log_start - sizeof(hdr) - datasize);
+
+    efivar_store.log_start = log_start;
+    efivar_log_init_locked(datasize);
+    memset(image + log_start + sizeof(efivar_log_hdr_t), 0, sizeof(efivar_log_rec_t));
+
+    rc = efivar_write_image(0, log_start + sizeof(efivar_log_hdr_t) + sizeof(efivar_log_rec_t));
+
+    // the fast path needs the image to match the disk
+    efivar_store.slot_ready = !rc && efivar_image_has_slot(datasize);
+    if (rc) {
+        // the disk may have parts of the new image now
+        efivar_store.need_compact = 1;
+        efivar_store.log_end = 0;
+        return rc;
+    }
+
+    efivar_store_drop_deleted();
+    efivar_store.need_compact = 0;
+    efivar_store.log_end = log_start + sizeof(efivar_log_hdr_t);
+    efivar_store.slot_dirty = 0;
+
+    return 0;
+}
+
+// makes the error slot the first entry, which replaces variables of the same name.
+// only a compaction can write it.
+static int efivar_slot_insert(const char *name, const void *data, uint32_t datasize)
+{
+    efi_guid_t guid = EFI_EFIDROID_VARIABLE;
+    efivar_entry_t *entry;
+
+    entry = efivar_store_lookup(EFIVAR_ERROR_NAME, &guid);
+    if (entry) {
+        efivar_store_remove(entry);
+    }
+    entry = efivar_store_lookup(EFIVAR_ERROR_PAD_NAME, &guid);
+    if (entry) {
+        efivar_store_remove(entry);
+    }
+
+    entry = efivar_store_new_entry(EFIVAR_ERROR_NAMESIZE, EFIVAR_ERROR_SIZE);
+    if (!entry) {
+        LOGE("Error allocating variable\n");
+        return -ENOMEM;
+    }
+
+    // move it to the front
+    efivar_entry_t slot = *entry;
+    slot.guid = guid;
+    slot.attributes = EFI_VARIABLE_DEFAULT_ATTRIBUTES;
+    memmove(efivar_store.entries+1, efivar_store.entries, (efivar_store.num_entries-1)*sizeof(*entry));
+    efivar_store.entries[0] = slot;
+    efivar_slot_set(efivar_store.entries, name, data, datasize);
+
+    return 0;
+}
+
+static bool efivar_log_empty(void)
+{
+    return !efivar_store.log_end || efivar_store.log_end==efivar_store.log_start + sizeof(efivar_log_hdr_t);
+}
+
+// builds the table from the image and the log
+static int efivar_store_build(uint32_t rawdatasize)
+{
+    int rc = 0;
+
+    efivar_store_clear();
+    if (rawdatasize)
+        rc = efivar_iterate(efivar_store.image + sizeof(efivar_hdr_t), rawdatasize, efivar_load_cb, NULL);
+    if (rc) {
+        efivar_store_clear();
+        return rc;
+    }
+    efivar_store_reindex();
+
+    rc = efivar_log_replay();
+    if (rc) {
+        efivar_store_clear();
+        return rc;
+    }
+
+    return 0;
+}
+
+// somebody else wrote the area since we read it. reads it again and puts the
+// changes which weren't written yet on top. the image and the device have to be locked.
+static int efivar_store_reload_locked(void)
+{
+    efivar_entry_t *entries = efivar_store.entries;
+    int num_entries = efivar_store.num_entries;
+    int max_entries = efivar_store.max_entries;
+    int had_slot = num_entries && efivar_is_slot(entries);
     uint32_t rawdatasize = 0;
+    efivar_entry_t *entry;
+    int i;
+    int rc;
+
+    LOGD("NV area was changed by another process, reloading\n");
+
+    // the image won't be the one the slot was checked against anymore
+    efivar_store.slot_ready = 0;
+    efivar_store.stale = 1;
+
+    rc = efivar_read_image(&rawdatasize);
+    if (rc) return rc;
+
+    // keep the old table for the changes
+    efivar_store.entries = NULL;
+    efivar_store.num_entries = 0;
+    efivar_store.max_entries = 0;
+
+    rc = efivar_store_build(rawdatasize);
+    if (rc) {
+        efivar_store.entries = entries;
+        efivar_store.num_entries = num_entries;
+        efivar_store.max_entries = max_entries;
+        efivar_store_reindex();
+        return rc;
+    }
+
+    for (i=had_slot ? 1 : 0; !rc && i<num_entries; i++) {
+        efivar_entry_t *old = &entries[i];
+
+        if (!old->dirty)
+            continue;
+
+        if (!old->deleted)
+            rc = efivar_replay_cb(NULL, old->name, old->namesize, old->data, old->datasize, old->guid, old->attributes);
+
+        entry = efivar_store_lookup_unicode(old->name, old->namesize, &old->guid);
+        if (entry && !efivar_is_slot(entry)) {
+            entry->deleted = old->deleted;
+            entry->dirty = 1;
+        }
+    }
+
+    // reported errors are on disk already, ours may not be written yet.
+    // without the slot in front, it has to be put back there.
+    efivar_store.error_reported = 0;
+    if (!rc && had_slot) {
+        if (!efivar_store.num_entries || !efivar_is_slot(efivar_store.entries)) {
+            const char *name = efivar_name_equals(&entries[0], EFIVAR_ERROR_NAME) ? EFIVAR_ERROR_NAME : EFIVAR_ERROR_PAD_NAME;
+            rc = efivar_slot_insert(name, entries[0].data, strnlen(entries[0].data, EFIVAR_ERROR_SIZE));
+        } else if (efivar_store.slot_dirty) {
+            entry = efivar_store.entries;
+            memcpy(entry->name, entries[0].name, EFIVAR_ERROR_NAMESIZE);
+            memcpy(entry->data, entries[0].data, EFIVAR_ERROR_SIZE);
+            entry->hash = entries[0].hash;
+            efivar_store_reindex();
+        }
+    }
+
+    for (i=0; i<num_entries; i++)
+        free(entries[i].name);
+    free(entries);
+
+    efivar_store.slot_ready = efivar_image_has_slot(rawdatasize) && efivar_store.num_entries &&
+                              efivar_is_slot(efivar_store.entries);
+    efivar_store.stale = 0;
+    efivar_store.dirty = 1;
+
+    return rc;
+}
+
+static int efivar_store_flush(int compact)
+{
     int rc = 0;
-    efivar_pdata_t pdata;
+    int lockfd;
+
+    if (efivar_store.need_compact)
+        compact = 1;
+    if (!efivar_store.dirty && !compact)
+        return 0;
+
+    efivar_image_trylock(-1);
+
+    rc = efivar_open_rw();
+    if (rc) goto out_unlock;
+
+    lockfd = efivar_flock(LOCK_EX);
+    if (lockfd<0) {
+        rc = -errno;
+        LOGE("can't lock %s: %s\n", efivar_store.device, strerror(errno));
+        goto out_unlock;
+    }
+
+    // a failed compaction left a mix of both images on disk, which only we can fix
+    if (!efivar_store.need_compact) {
+        rc = efivar_disk_matches(true);
+        if (rc<0) goto out_funlock;
+
+        if (!rc || efivar_store.stale) {
+            rc = efivar_store_reload_locked();
+            if (rc) goto out_funlock;
+        }
+        rc = 0;
+    }
+
+    // an error which was reported since the last pull must not get lost
+    efivar_slot_pull_locked();
+
+    // the image has everything already, don't wear out the flash
+    if (compact && !efivar_store.need_compact && !efivar_store.dirty && efivar_log_empty())
+        goto out_funlock;
+
+    if (!compact) {
+        rc = efivar_log_append_locked();
+        if (rc==-ENOSPC) {
+            LOGD("compacting NV variables\n");
+            compact = 1;
+        }
+    }
+
+    if (compact)
+        rc = efivar_compact_locked();
+
+    if (!rc)
+        efivar_store.dirty = 0;
+
+out_funlock:
+    efivar_funlock(lockfd);
+out_unlock:
+    efivar_image_unlock();
+
+    return rc;
+}
+
+// makes the error slot the first record, so efivars_report_error can update it in place
+static int efivar_slot_prepare(void)
+{
+    efi_guid_t guid = EFI_EFIDROID_VARIABLE;
+    char error[EFIVAR_ERROR_SIZE];
+    const char *name = EFIVAR_ERROR_PAD_NAME;
+    uint32_t errorsize = 0;
+    efivar_entry_t *entry;
+    int rc;
+
+    if (efivar_store.num_entries && efivar_is_slot(efivar_store.entries)) {
+        efivar_store.slot_ready = 1;
+        return 0;
+    }
+
+    // keep an error which is still set
+    entry = efivar_store_lookup(EFIVAR_ERROR_NAME, &guid);
+    if (entry && !entry->deleted) {
+        errorsize = MIN(entry->datasize, sizeof(error));
+        memcpy(error, entry->data, errorsize);
+        name = EFIVAR_ERROR_NAME;
+    }
+
+    rc = efivar_slot_insert(name, error, errorsize);
+    if (rc) return rc;
+
+    return efivar_store_flush(1);
+}
+
+static void efivar_atexit(void)
+{
+    // forked children inherit the table, only the process which loaded it writes it back
+    if (efivar_store.owner!=getpid())
+        return;
+
+    // nobody synced these, so they may be the last changes before a reboot
+    if (efivar_store.dirty)
+        efivar_compact();
+}
+
+static int efivar_store_load(void)
+{
+    uint32_t rawdatasize = 0;
+    int lockfd;
+    int rc;
 
-    memset(&pdata, 0, sizeof(pdata));
+    if (efivar_store.loaded)
+        return 0;
+
+    rc = efivar_open();
+    if (rc) return rc;
 
-    // read variable data into buffer
-    rc = efivar_read_to_buf(efivar_getdev(), &rawdata, &rawdatasize);
-    if (rc || !rawdata) {
+    // read variable data into the image, without catching a writer halfway through
+    efivar_image_trylock(-1);
+    lockfd = efivar_flock(LOCK_SH);
+    if (lockfd<0) {
+        rc = -errno;
+        LOGE("can't lock %s: %s\n", efivar_store.device, strerror(errno));
+    } else {
+        rc = efivar_read_image(&rawdatasize);
+        efivar_funlock(lockfd);
+    }
+    efivar_image_unlock();
+    if (rc) {
         LOGE("Error reading variable into buffer\n");
         return rc;
     }
 
-    // find variable
-    copy_ansi2unicodestr(&pdata.name, name, &pdata.namesize);
-    pdata.guid = *guid;
-    efivar_iterate(rawdata, rawdatasize, efivar_setvar_cb, &pdata);
+    rc = efivar_store_build(rawdatasize);
+    if (rc) return rc;
+
+    efivar_store.loaded = 1;
+    efivar_store.dirty = 0;
+    efivar_store.owner = getpid();
+
+    if (!efivar_store.atexit_registered) {
+        atexit(efivar_atexit);
+        efivar_store.atexit_registered = 1;
+    }
 
-    if (pdata.found) {
-        // return variables
+    return 0;
+}
+
+int efivar_get(const char *name, efi_guid_t *guid,
+               uint32_t *attributes, uint32_t *datasize, void *data)
+{
+    int rc;
+    efivar_entry_t *entry;
 
-        if (data && *datasize>=pdata.datasize)
-            memcpy(data, pdata.data, pdata.datasize);
-        else rc = -ENOMEM;
+    pthread_mutex_lock(&efivar_store.lock);
 
-        if (attributes)
-            *attributes = pdata.attributes;
+    rc = efivar_store_load();
+    if (rc) goto out_unlock;
+    efivar_slot_pull();
 
-        *datasize = pdata.datasize;
-    } else {
-        free(pdata.name);
+    // find variable
+    entry = efivar_store_lookup(name, guid);
+    if (!entry || entry->deleted) {
         rc = -ENOENT;
+        goto out_unlock;
     }
 
+    // return variables
+    if (data && *datasize>=entry->datasize)
+        memcpy(data, entry->data, entry->datasize);
+    else rc = -ENOMEM;
+
+    if (attributes)
+        *attributes = entry->attributes;
+
+    *datasize = entry->datasize;
+
+out_unlock:
+    pthread_mutex_unlock(&efivar_store.lock);
+
     return rc;
 }
 
 int efivar_set(const char *name, efi_guid_t *guid,
                uint32_t attributes, uint32_t datasize, const void *data)
 {
-    void *rawdata = NULL;
-    uint32_t rawdatasize = 0;
+    int rc;
+    efivar_entry_t *entry;
+
+    pthread_mutex_lock(&efivar_store.lock);
+
+    rc = efivar_store_load();
+    if (rc) goto out_unlock;
+    efivar_slot_pull();
+
+    // the error slot keeps its place and size
+    if (efivar_is_slot_name(name, guid) && efivar_store.num_entries && efivar_is_slot(efivar_store.entries)) {
+        if (!attributes || !datasize || !strcmp(name, EFIVAR_ERROR_PAD_NAME))
+            efivar_slot_set(efivar_store.entries, EFIVAR_ERROR_PAD_NAME, "", 0);
+        else
+            efivar_slot_set(efivar_store.entries, EFIVAR_ERROR_NAME, data, datasize);
+        goto out_unlock;
+    }
+
+    entry = efivar_store_lookup(name, guid);
+
+    // delete
+    if (!attributes || !datasize) {
+        if (entry && !entry->deleted) {
+            entry->deleted = 1;
+            entry->dirty = 1;
+            efivar_store.dirty = 1;
+        }
+        goto out_unlock;
+    }
+
+    // nothing changed
+    if (entry && !entry->deleted && entry->attributes==attributes && entry->datasize==datasize &&
+            !memcmp(entry->data, data, datasize))
+        goto out_unlock;
+
+    if (entry) {
+        rc = efivar_entry_set_data(entry, data, datasize);
+        if (rc) goto out_unlock;
+
+        entry->attributes = attributes;
+        entry->deleted = 0;
+        entry->dirty = 1;
+        efivar_store.dirty = 1;
+        goto out_unlock;
+    }
+
+    uint32_t namesize = (strlen(name)+1)*sizeof(uint16_t);
+    entry = efivar_store_new_entry(namesize, datasize);
+    if (!entry) {
+        LOGE("Error allocating variable\n");
+        rc = -ENOMEM;
+        goto out_unlock;
+    }
+
+    uint32_t i;
+    for (i=0; i<namesize/sizeof(uint16_t); i++)
+        entry->name[i] = name[i];
+    memcpy(entry->data, data, datasize);
+    entry->guid = *guid;
+    entry->attributes = attributes;
+    entry->hash = efivar_hash_ansi(name, guid);
+    entry->dirty = 1;
+    efivar_store_link(entry);
+
+    efivar_store.dirty = 1;
+
+out_unlock:
+    pthread_mutex_unlock(&efivar_store.lock);
+
+    return rc;
+}
+
+int efivar_set_device(const char *device)
+{
     int rc = 0;
-    efivar_pdata_t pdata;
 
-    memset(&pdata, 0, sizeof(pdata));
+    pthread_mutex_lock(&efivar_store.lock);
 
-    // read variable data into buffer
-    rc = efivar_read_to_buf(efivar_getdev(), &rawdata, &rawdatasize);
-    if (rc || !rawdata) {
-        LOGE("Error reading variable into buffer\n");
-        return rc;
+    if (efivar_store.fd>=0) {
+        rc = -EBUSY;
+        goto out_unlock;
     }
 
-    // allocate new buffer
-    void *newdata = calloc(
-                        sizeof(efivar_hdr_t) +
-                        rawdatasize +
-                        EFIVAR_ENTRY_SIZE(name, datasize),
-                        1
-                    );
-    if (!newdata) {
-        LOGE("Error allocating new buffer\n");
-        return rc;
+    free(efivar_store.device);
+    efivar_store.device = strdup(device);
+    if (!efivar_store.device)
+        rc = -ENOMEM;
+
+out_unlock:
+    pthread_mutex_unlock(&efivar_store.lock);
+
+    return rc;
+}
+
+void efivar_print_value(const uint8_t *data, uint32_t datasize, int hex, int quote)
+{
+    uint32_t i;
+    uint32_t len = datasize;
+
+    // strings are printed as such, everything else as hex
+    if (!hex) {
+        if (len && !data[len-1])
+            len--;
+        for (i=0; i<len; i++) {
+            if (!isprint(data[i]))
+                break;
+        }
+
+        if (i==len) {
+            printf(quote ? "\"%.*s\"" : "%.*s", (int)len, (const char *)data);
+            return;
+        }
     }
 
-    // copy all unchanged variables to the new buffer
-    pdata.buf = newdata + 3*sizeof(uint32_t);
-    copy_ansi2unicodestr(&pdata.name, name, &pdata.namesize);
-    pdata.guid = *guid;
-    efivar_iterate(rawdata, rawdatasize, efivar_setvar_cb, &pdata);
+    for (i=0; i<datasize; i++)
+        printf("%02x", data[i]);
+}
+
+int efivar_dump(void)
+{
+    int i;
+    int rc;
+    uint32_t j;
+
+    pthread_mutex_lock(&efivar_store.lock);
+
+    rc = efivar_store_load();
+    if (rc) goto out_unlock;
+    efivar_slot_pull();
+
+    for (i=0; i<efivar_store.num_entries; i++) {
+        efivar_entry_t *entry = &efivar_store.entries[i];
+        efi_guid_t *guid = &entry->guid;
+
+        if (entry->deleted)
+            continue;
 
-    if (attributes && datasize) {
-        // append the new/changed variable
-        copy_ansi2unicodestr(&pdata.name, name, &pdata.namesize);
-        pdata.data = data;
-        pdata.datasize = datasize;
-        pdata.guid = *guid;
-        pdata.attributes = attributes;
-        efivar_append(&pdata.buf, pdata.name, pdata.namesize, pdata.data, pdata.datasize, pdata.guid, pdata.attributes);
+        // the unused error slot is just reserved space
+        if (efivar_is_slot(entry) && efivar_name_equals(entry, EFIVAR_ERROR_PAD_NAME))
+            continue;
+
+        printf("%08x-%04x-%04x-%02x%02x-%02x%02x%02x%02x%02x%02x ",
+               guid->Data1, guid->Data2, guid->Data3, guid->Data4[0], guid->Data4[1], guid->Data4[2],
+               guid->Data4[3], guid->Data4[4], guid->Data4[5], guid->Data4[6], guid->Data4[7]);
+
+        for (j=0; j<entry->namesize/sizeof(uint16_t) && entry->name[j]; j++)
+            putchar(entry->name[j]<0x80 && isprint(entry->name[j]) ? entry->name[j] : '?');
+
+        printf(" attributes=0x%x size=%u ", entry->attributes, entry->datasize);
+        efivar_print_value(entry->data, entry->datasize, 0, 1);
+        putchar('\n');
     }
 
-    uint32_t newdatasize = pdata.buf - (newdata + 3*sizeof(uint32_t));
-    uint32_t *newdata32 = newdata;
-    newdata32[0] = EFIVAR_MAGIC;
-    newdata32[1] = newdatasize;
-    newdata32[2] = cksum_crc32(0, newdata + 3*sizeof(uint32_t), newdatasize);
+out_unlock:
+    pthread_mutex_unlock(&efivar_store.lock);
+
+    return rc;
+}
+
+int efivar_load(void)
+{
+    int rc;
+
+    pthread_mutex_lock(&efivar_store.lock);
+    rc = efivar_store_load();
+    pthread_mutex_unlock(&efivar_store.lock);
+
+    return rc;
+}
 
-    rc = efivar_write_from_buf(efivar_getdev(), newdata, sizeof(efivar_hdr_t)+newdatasize);
+int efivar_init(void)
+{
+    int rc;
+
+    pthread_mutex_lock(&efivar_store.lock);
+
+    rc = efivar_store_load();
+    if (rc) goto out_unlock;
+
+    // the variables are usable even if this fails
+    efivar_image_trylock(-1);
+    rc = efivar_open_rw();
+    efivar_image_unlock();
+    if (rc || efivar_slot_prepare()) {
+        LOGW("Can't prepare the error slot\n");
+    }
+    rc = 0;
 
-    free(newdata);
+out_unlock:
+    pthread_mutex_unlock(&efivar_store.lock);
+
+    return rc;
+}
+
+int efivar_sync(void)
+{
+    int rc;
+
+    pthread_mutex_lock(&efivar_store.lock);
+    rc = efivar_store_flush(0);
+    pthread_mutex_unlock(&efivar_store.lock);
+
+    return rc;
+}
+
+int efivar_compact(void)
+{
+    int rc;
+
+    pthread_mutex_lock(&efivar_store.lock);
+    rc = efivar_store_load();
+    if (!rc)
+        rc = efivar_store_flush(1);
+    pthread_mutex_unlock(&efivar_store.lock);
 
     return rc;
 }
@@ -480,51 +1660,52 @@ int efivar_set_efidroid(const char *name, uint32_t datasize, const void *data)
     return efivar_set(name, &guid, EFI_VARIABLE_DEFAULT_ATTRIBUTES, datasize, data);
 }
 
+// this runs for fatal errors, possibly in a signal handler or a forked child.
+// it doesn't allocate or take the lock, and only writes the header and the slot.
 int efivars_report_error(const char *error)
 {
-    return efivar_set_efidroid("EFIDroidErrorStr", strlen(error)+1, error);
-}
+    int lockfd;
+    int rc;
 
-int efivars_set_error(const char *fmt, ...)
-{
-    int n;
-    int size = 100;
-    char *p, *np;
-    va_list ap;
+    if (!efivar_store.slot_ready)
+        return -1;
+
+    if (efivar_image_trylock(100))
+        return -EBUSY;
 
-    // alloc initial memory
-    if ((p = malloc(size)) == NULL)
+    if (!efivar_store.slot_ready) {
+        efivar_image_unlock();
         return -1;
+    }
 
-    while (1) {
-        // Try to print in the allocated space
-        va_start(ap, fmt);
-        n = vsnprintf(p, size, fmt, ap);
-        va_end(ap);
+    lockfd = efivar_flock(LOCK_EX);
+    if (lockfd<0) {
+        efivar_image_unlock();
+        return -1;
+    }
 
-        // Check error code
-        if (n < 0)
-            return -1;
+    rc = efivar_slot_write_locked(EFIVAR_ERROR_NAME, error, strnlen(error, EFIVAR_ERROR_SIZE));
+    if (!rc)
+        efivar_store.error_reported = 1;
 
-        // If that worked, we're done
-        if (n < size)
-            break;
+    efivar_funlock(lockfd);
+    efivar_image_unlock();
 
-        // Else try again with more space
-        size = n + 1;
-        if ((np = realloc (p, size)) == NULL) {
-            free(p);
-            return -1;
-        } else {
-            p = np;
-        }
-    }
+    return rc;
+}
 
-    // write error to efi variable
-    efivars_report_error(p);
+int efivars_set_error(const char *fmt, ...)
+{
+    char error[EFIVAR_ERROR_SIZE];
+    va_list ap;
+    int n;
 
-    // cleanup
-    free(p);
+    va_start(ap, fmt);
+    n = vsnprintf(error, sizeof(error), fmt, ap);
+    va_end(ap);
 
-    return 0;
+    if (n < 0)
+        return -1;
+
+    return efivars_report_error(error);
 }
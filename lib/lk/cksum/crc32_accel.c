@@ -0,0 +1,103 @@
+/*
+ * Copyright 2016, The EFIDroid Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+#include <pthread.h>
+#include <lib/cksum.h>
+
+#include "crc32_accel.h"
+
+/* sb16_table[k][n] is the CRC of byte n followed by k zero bytes */
+static uint32_t sb16_table[16][256];
+
+void crc32_sb16_init(void)
+{
+    int n, k;
+
+    /* the first table is the one of the byte wise code */
+    for (n = 0; n < 256; n++) {
+        unsigned char c = (unsigned char)n;
+        sb16_table[0][n] = (uint32_t)crc32_generic(0xffffffffUL, &c, 1) ^ 0xffffffff;
+    }
+
+    for (k = 1; k < 16; k++) {
+        for (n = 0; n < 256; n++) {
+            uint32_t c = sb16_table[k - 1][n];
+            sb16_table[k][n] = sb16_table[0][c & 0xff] ^ (c >> 8);
+        }
+    }
+}
+
+static inline uint32_t load_le32(const unsigned char *p)
+{
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+uint32_t crc32_sb16(uint32_t crc, const unsigned char *buf, size_t len)
+{
+    while (len >= 16) {
+        uint32_t a = crc ^ load_le32(buf);
+
+        crc = sb16_table[15][a & 0xff] ^ sb16_table[14][(a >> 8) & 0xff] ^
+              sb16_table[13][(a >> 16) & 0xff] ^ sb16_table[12][a >> 24] ^
+              sb16_table[11][buf[4]] ^ sb16_table[10][buf[5]] ^
+              sb16_table[9][buf[6]] ^ sb16_table[8][buf[7]] ^
+              sb16_table[7][buf[8]] ^ sb16_table[6][buf[9]] ^
+              sb16_table[5][buf[10]] ^ sb16_table[4][buf[11]] ^
+              sb16_table[3][buf[12]] ^ sb16_table[2][buf[13]] ^
+              sb16_table[1][buf[14]] ^ sb16_table[0][buf[15]];
+
+        buf += 16;
+        len -= 16;
+    }
+
+    while (len--)
+        crc = sb16_table[0][(crc ^ *buf++) & 0xff] ^ (crc >> 8);
+
+    return crc;
+}
+
+static crc32_kernel_t crc32_kernel;
+static pthread_once_t crc32_once = PTHREAD_ONCE_INIT;
+
+static void crc32_select(void)
+{
+    crc32_sb16_init();
+    crc32_kernel = crc32_sb16;
+
+#ifdef CRC32_HAVE_ARMV8
+    if (crc32_armv8_supported())
+        crc32_kernel = crc32_armv8;
+#endif
+
+#ifdef CRC32_HAVE_PCLMUL
+    if (crc32_pclmul_supported())
+        crc32_kernel = crc32_pclmul;
+#endif
+}
+
+crc32_kernel_t crc32_get_kernel(void)
+{
+    pthread_once(&crc32_once, crc32_select);
+    return crc32_kernel;
+}
+
+unsigned long cksum_crc32(unsigned long crc, const unsigned char *buf, unsigned int len)
+{
+    if (buf == NULL)
+        return 0UL;
+
+    return crc32_get_kernel()((uint32_t)crc ^ 0xffffffff, buf, len) ^ 0xffffffff;
+}
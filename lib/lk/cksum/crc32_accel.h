@@ -0,0 +1,54 @@
+/*
+ * Copyright 2016, The EFIDroid Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+#ifndef __CRC32_ACCEL_H
+#define __CRC32_ACCEL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(__aarch64__) || (defined(__arm__) && defined(__ARM_FEATURE_CRC32))
+#define CRC32_HAVE_ARMV8 1
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#define CRC32_HAVE_PCLMUL 1
+#endif
+
+/* kernels work on the shift register, cksum_crc32 does the pre and post inversion */
+typedef uint32_t (*crc32_kernel_t)(uint32_t crc, const unsigned char *buf, size_t len);
+
+/* the zlib byte table implementation, with the inversion */
+unsigned long crc32_generic(unsigned long crc, const unsigned char *buf, unsigned int len);
+
+/* slicing-by-16, usable everywhere */
+void crc32_sb16_init(void);
+uint32_t crc32_sb16(uint32_t crc, const unsigned char *buf, size_t len);
+
+#ifdef CRC32_HAVE_ARMV8
+int crc32_armv8_supported(void);
+uint32_t crc32_armv8(uint32_t crc, const unsigned char *buf, size_t len);
+#endif
+
+#ifdef CRC32_HAVE_PCLMUL
+int crc32_pclmul_supported(void);
+uint32_t crc32_pclmul(uint32_t crc, const unsigned char *buf, size_t len);
+#endif
+
+/* the kernel cksum_crc32 uses */
+crc32_kernel_t crc32_get_kernel(void);
+
+#endif
@@ -0,0 +1,100 @@
+/*
+ * Copyright 2016, The EFIDroid Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+#include "crc32_accel.h"
+
+#ifdef CRC32_HAVE_ARMV8
+
+#include <string.h>
+#include <sys/auxv.h>
+#include <arm_acle.h>
+
+#ifdef __aarch64__
+#define CRC32_TARGET __attribute__((target("+crc")))
+#ifndef HWCAP_CRC32
+#define HWCAP_CRC32 (1 << 7)
+#endif
+#else
+/* 32bit builds only get here when the CRC extension was enabled at compile time */
+#define CRC32_TARGET
+#endif
+
+int crc32_armv8_supported(void)
+{
+#ifdef __aarch64__
+    return !!(getauxval(AT_HWCAP) & HWCAP_CRC32);
+#else
+    return 1;
+#endif
+}
+
+CRC32_TARGET
+uint32_t crc32_armv8(uint32_t crc, const unsigned char *buf, size_t len)
+{
+    uint32_t w;
+    uint16_t h;
+
+    /* align to 8 bytes */
+    while (len && ((uintptr_t)buf & 7)) {
+        crc = __crc32b(crc, *buf++);
+        len--;
+    }
+
+#ifdef __aarch64__
+    uint64_t d0, d1, d2, d3;
+
+    while (len >= 32) {
+        memcpy(&d0, buf, 8);
+        memcpy(&d1, buf + 8, 8);
+        memcpy(&d2, buf + 16, 8);
+        memcpy(&d3, buf + 24, 8);
+        crc = __crc32d(crc, d0);
+        crc = __crc32d(crc, d1);
+        crc = __crc32d(crc, d2);
+        crc = __crc32d(crc, d3);
+        buf += 32;
+        len -= 32;
+    }
+
+    while (len >= 8) {
+        memcpy(&d0, buf, 8);
+        crc = __crc32d(crc, d0);
+        buf += 8;
+        len -= 8;
+    }
+#endif
+
+    while (len >= 4) {
+        memcpy(&w, buf, 4);
+        crc = __crc32w(crc, w);
+        buf += 4;
+        len -= 4;
+    }
+
+    if (len >= 2) {
+        memcpy(&h, buf, 2);
+        crc = __crc32h(crc, h);
+        buf += 2;
+        len -= 2;
+    }
+
+    if (len)
+        crc = __crc32b(crc, *buf);
+
+    return crc;
+}
+
+#endif
@@ -0,0 +1,224 @@
+/*
+ * Copyright 2016, The EFIDroid Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+/*
+ * checks every crc32 kernel the device supports against the zlib table code
+ * with random buffers, lengths, alignments and start values, then benchmarks them.
+ * usage: crc32test [ITERATIONS] [SEED]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
+#include <lib/cksum.h>
+
+#include "crc32_accel.h"
+
+#define TEST_MAXLEN (64 * 1024)
+#define TEST_PAD 64
+#define BENCH_LEN (1024 * 1024)
+#define BENCH_MS 500
+
+typedef struct {
+    const char *name;
+    crc32_kernel_t fn;
+} kernel_t;
+
+static kernel_t kernels[4];
+static size_t num_kernels;
+
+static uint64_t rng_state;
+
+/* xorshift64*, so a failing seed can be reproduced everywhere */
+static uint64_t rng_next(void)
+{
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 0x2545f4914f6cdd1dULL;
+}
+
+static uint64_t time_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void add_kernel(const char *name, crc32_kernel_t fn)
+{
+    kernels[num_kernels].name = name;
+    kernels[num_kernels].fn = fn;
+    num_kernels++;
+}
+
+static uint32_t run_kernel(crc32_kernel_t fn, uint32_t crc, const unsigned char *buf, size_t len)
+{
+    return fn(crc ^ 0xffffffff, buf, len) ^ 0xffffffff;
+}
+
+/* the dispatcher, so the selection and the inversion get tested too */
+static uint32_t dispatched(uint32_t crc, const unsigned char *buf, size_t len)
+{
+    return (uint32_t)cksum_crc32(crc ^ 0xffffffff, buf, (unsigned int)len) ^ 0xffffffff;
+}
+
+static size_t random_len(void)
+{
+    /* mostly short buffers, they hit the head and tail handling */
+    switch (rng_next() % 4) {
+        case 0:
+            return rng_next() % 16;
+        case 1:
+            return rng_next() % 256;
+        default:
+            return rng_next() % (TEST_MAXLEN + 1);
+    }
+}
+
+static int test_kernels(unsigned long iterations)
+{
+    unsigned char *buf = malloc(TEST_MAXLEN + TEST_PAD);
+    unsigned long i;
+    size_t k, n;
+    int failed = 0;
+
+    if (!buf) {
+        fprintf(stderr, "can't allocate test buffer\n");
+        return -1;
+    }
+
+    for (i = 0; i < iterations; i++) {
+        size_t len = random_len();
+        size_t align = rng_next() % TEST_PAD;
+        size_t split = len ? rng_next() % (len + 1) : 0;
+        uint32_t crc = (uint32_t)rng_next();
+        const unsigned char *p = buf + align;
+
+        for (n = 0; n < len + align; n++)
+            buf[n] = (unsigned char)rng_next();
+
+        uint32_t expected = (uint32_t)crc32_generic(crc, p, (unsigned int)len);
+
+        for (k = 0; k < num_kernels; k++) {
+            uint32_t whole = run_kernel(kernels[k].fn, crc, p, len);
+
+            /* continuing a crc has to give the same result as one call */
+            uint32_t chained = run_kernel(kernels[k].fn, crc, p, split);
+            chained = run_kernel(kernels[k].fn, chained, p + split, len - split);
+
+            if (whole != expected || chained != expected) {
+                fprintf(stderr, "%s: mismatch at iteration %lu: len=%zu align=%zu split=%zu crc=0x%08x: "
+                        "expected 0x%08x, got 0x%08x/0x%08x\n", kernels[k].name, i, len, align, split,
+                        crc, expected, whole, chained);
+                failed = 1;
+            }
+        }
+
+        if (failed)
+            break;
+    }
+
+    free(buf);
+    return failed ? -1 : 0;
+}
+
+static void bench_one(const char *name, crc32_kernel_t fn, const unsigned char *buf)
+{
+    uint64_t start = time_ns();
+    uint64_t elapsed;
+    uint64_t bytes = 0;
+    uint32_t crc = 0;
+
+    do {
+        crc = fn(crc, buf, BENCH_LEN);
+        bytes += BENCH_LEN;
+        elapsed = time_ns() - start;
+    } while (elapsed < BENCH_MS * 1000000ULL);
+
+    uint64_t mibs = bytes * 1000 / (elapsed / 1000000) / (1024 * 1024);
+    printf("%-10s %8" PRIu64 " MiB/s (0x%08x)\n", name, mibs, crc);
+}
+
+static uint32_t generic_kernel(uint32_t crc, const unsigned char *buf, size_t len)
+{
+    return (uint32_t)crc32_generic(crc ^ 0xffffffff, buf, (unsigned int)len) ^ 0xffffffff;
+}
+
+static void bench_kernels(void)
+{
+    unsigned char *buf = malloc(BENCH_LEN);
+    size_t k, n;
+
+    if (!buf) {
+        fprintf(stderr, "can't allocate benchmark buffer\n");
+        return;
+    }
+
+    for (n = 0; n < BENCH_LEN; n++)
+        buf[n] = (unsigned char)rng_next();
+
+    bench_one("table", generic_kernel, buf);
+    for (k = 0; k < num_kernels; k++)
+        bench_one(kernels[k].name, kernels[k].fn, buf);
+
+    free(buf);
+}
+
+int main(int argc, char **argv)
+{
+    unsigned long iterations = 100000;
+    uint64_t seed = time_ns();
+    size_t k;
+
+    if (argc > 1)
+        iterations = strtoul(argv[1], NULL, 0);
+    if (argc > 2)
+        seed = strtoull(argv[2], NULL, 0);
+    rng_state = seed ? seed : 1;
+
+    /* this also fills the slicing tables */
+    crc32_kernel_t selected = crc32_get_kernel();
+
+    add_kernel("sb16", crc32_sb16);
+#ifdef CRC32_HAVE_ARMV8
+    if (crc32_armv8_supported())
+        add_kernel("armv8", crc32_armv8);
+#endif
+#ifdef CRC32_HAVE_PCLMUL
+    if (crc32_pclmul_supported())
+        add_kernel("pclmul", crc32_pclmul);
+#endif
+    add_kernel("dispatch", dispatched);
+
+    for (k = 0; k < num_kernels - 1; k++) {
+        if (kernels[k].fn == selected)
+            printf("selected kernel: %s\n", kernels[k].name);
+    }
+
+    printf("testing %lu buffers, seed %" PRIu64 "\n", iterations, seed);
+    if (test_kernels(iterations)) {
+        printf("FAILED, rerun with: %s %lu %" PRIu64 "\n", argv[0], iterations, seed);
+        return 1;
+    }
+    printf("all kernels match\n");
+
+    bench_kernels();
+
+    return 0;
+}
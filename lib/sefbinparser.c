@@ -5,6 +5,10 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <stdint.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/param.h>
+#include <sys/stat.h>
 
 #include <common.h>
 #include <util.h>
@@ -15,56 +19,94 @@
 
 #define SELINUX_MAGIC_COMPILED_FCONTEXT 0xf97cff8a
 
-static void safe_read(int fildes, void *buf, size_t nbyte)
+typedef struct {
+    const char *filename;
+    const char *start;
+    const char *pos;
+    const char *end;
+} sefbin_cursor_t;
+
+static const void *cursor_get(sefbin_cursor_t *cur, size_t size)
 {
-    ssize_t bytes = read(fildes, buf, nbyte);
-    if (bytes<0 || (size_t)bytes!=nbyte) {
-        MBABORT("can't read: %s\n", strerror(errno));
+    const char *p = cur->pos;
+
+    if (size > (size_t)(cur->end - cur->pos)) {
+        MBABORT("%s is truncated at offset %u\n", cur->filename, (unsigned)(cur->pos - cur->start));
     }
+
+    cur->pos += size;
+    return p;
 }
 
-static void safe_write(int fildes, const void *buf, size_t nbyte)
+static uint32_t cursor_get_u32(sefbin_cursor_t *cur)
 {
-    ssize_t bytes = write(fildes, buf, nbyte);
-    if (bytes<0 || (size_t)bytes!=nbyte) {
-        MBABORT("can't write: %s\n", strerror(errno));
-    }
+    uint32_t value;
+    memcpy(&value, cursor_get(cur, sizeof(value)), sizeof(value));
+    return value;
 }
 
-static char *read_str(int fd, int nullinlen)
+// returns a slice of the mapping, the NUL is part of it
+static char *cursor_get_str(sefbin_cursor_t *cur, int nullinlen)
 {
-    uint32_t len;
+    uint32_t len = cursor_get_u32(cur);
 
-    safe_read(fd, &len, sizeof(len));
     if (!nullinlen) len++;
-    char *s = safe_malloc(len);
-    safe_read(fd, s, len);
+    if (len==0) {
+        MBABORT("%s: empty string\n", cur->filename);
+    }
+
+    char *s = (char *)cursor_get(cur, len);
+    if (s[len-1]!='\0') {
+        MBABORT("%s: unterminated string\n", cur->filename);
+    }
 
     return s;
 }
 
-static void write_str(int fd, int nullinlen, const char *s)
+typedef struct {
+    char *data;
+    size_t pos;
+} sefbin_buf_t;
+
+static void buf_put(sefbin_buf_t *buf, const void *data, size_t size)
+{
+    memcpy(buf->data + buf->pos, data, size);
+    buf->pos += size;
+}
+
+static void buf_put_u32(sefbin_buf_t *buf, uint32_t value)
+{
+    buf_put(buf, &value, sizeof(value));
+}
+
+static void buf_put_str(sefbin_buf_t *buf, int nullinlen, const char *s)
 {
     uint32_t len = strlen(s);
-    uint32_t len_write = len;
 
-    if (nullinlen)
-        len_write++;
+    buf_put_u32(buf, nullinlen ? len+1 : len);
+    buf_put(buf, s, len+1);
+}
 
-    safe_write(fd, &len_write, sizeof(len_write));
-    safe_write(fd, s, len+1);
+// FNV-1a
+static uint32_t str_hash(const char *s)
+{
+    uint32_t hash = 2166136261u;
+
+    for (; *s; s++) {
+        hash ^= (uint8_t)*s;
+        hash *= 16777619u;
+    }
+
+    return hash;
 }
 
 static int32_t sefbin_get_stemid(sefbin_file_t *seffile, const char *name)
 {
-    int32_t i = 0;
-
     sefbin_stem_t *sefstem;
-    list_for_every_entry(&seffile->stems, sefstem, sefbin_stem_t, node) {
-        if (!strcmp(sefstem->name, name))
-            return i;
 
-        i++;
+    for (sefstem=seffile->stem_buckets[str_hash(name) % SEFBIN_STEM_BUCKETS]; sefstem; sefstem=sefstem->hash_next) {
+        if (!strcmp(sefstem->name, name))
+            return sefstem->id;
     }
 
     return -1;
@@ -72,177 +114,237 @@ static int32_t sefbin_get_stemid(sefbin_file_t *seffile, const char *name)
 
 static const char *sefbin_get_stemname(sefbin_file_t *seffile, int32_t id)
 {
-    int32_t i = 0;
+    if (id<0 || (uint32_t)id>=seffile->num_stems)
+        return NULL;
 
-    sefbin_stem_t *sefstem;
-    list_for_every_entry(&seffile->stems, sefstem, sefbin_stem_t, node) {
-        if (id==i)
-            return sefstem->name;
+    return seffile->stem_array[id]->name;
+}
 
-        i++;
+// stems are referenced by their index, so they can only be appended
+static int32_t sefbin_add_stem(sefbin_file_t *seffile, sefbin_stem_t *sefstem)
+{
+    if (seffile->num_stems==seffile->stem_array_size) {
+        seffile->stem_array_size = MAX(16u, seffile->stem_array_size*2);
+        seffile->stem_array = realloc(seffile->stem_array, seffile->stem_array_size*sizeof(*seffile->stem_array));
+        if (!seffile->stem_array) {
+            MBABORT("Can't allocate stem array\n");
+        }
     }
 
-    return NULL;
-}
+    sefstem->id = seffile->num_stems++;
+    seffile->stem_array[sefstem->id] = sefstem;
 
-static void *datadup(void *data, size_t sz)
-{
-    void *ndata = safe_malloc(sz);
-    memcpy(ndata, data, sz);
-    return ndata;
+    sefbin_stem_t **bucket = &seffile->stem_buckets[str_hash(sefstem->name) % SEFBIN_STEM_BUCKETS];
+    sefstem->hash_next = *bucket;
+    *bucket = sefstem;
+
+    list_add_tail(&seffile->stems, &sefstem->node);
+
+    return sefstem->id;
 }
 
 sefbin_file_t *sefbin_parse(const char *filename, int allow_magicerror)
 {
+    struct stat sb;
     uint32_t magic;
     uint32_t num_stems;
     uint32_t nspec;
     uint32_t i;
 
-    sefbin_file_t *seffile = safe_malloc(sizeof(sefbin_file_t));
-    list_initialize(&seffile->stems);
-    list_initialize(&seffile->specs);
-
     int fd = open(filename, O_RDONLY);
     if (fd<0) {
         MBABORT("Can't open file '%s': %s\n", filename, strerror(errno));
         return NULL;
     }
 
+    if (fstat(fd, &sb)) {
+        MBABORT("Can't stat file '%s': %s\n", filename, strerror(errno));
+    }
+
+    // strings and pcre data are used in place. the mapping is private and writable,
+    // so the few things that get modified are copied by the kernel.
+    void *map = sb.st_size ? mmap(NULL, sb.st_size, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0) : NULL;
+    close(fd);
+    if (map==MAP_FAILED) {
+        MBABORT("Can't map file '%s': %s\n", filename, strerror(errno));
+    }
+
+    sefbin_cursor_t cur = {filename, map, map, (const char *)map + sb.st_size};
+
     // magic
-    safe_read(fd, &magic, sizeof(magic));
-    if (magic!=SELINUX_MAGIC_COMPILED_FCONTEXT) {
+    if ((size_t)sb.st_size<sizeof(magic) || (magic = cursor_get_u32(&cur))!=SELINUX_MAGIC_COMPILED_FCONTEXT) {
         if (allow_magicerror)
-            LOGE("invalid magic: 0x%08x\n", magic);
+            LOGE("invalid magic in %s\n", filename);
         else
-            MBABORT("invalid magic: 0x%08x\n", magic);
+            MBABORT("invalid magic in %s\n", filename);
+
+        if (map)
+            munmap(map, sb.st_size);
         return NULL;
     }
 
+    sefbin_file_t *seffile = safe_calloc(1, sizeof(sefbin_file_t));
+    list_initialize(&seffile->stems);
+    list_initialize(&seffile->specs);
+    seffile->map = map;
+    seffile->map_size = sb.st_size;
+
     // version
-    safe_read(fd, &seffile->version, sizeof(seffile->version));
+    seffile->version = cursor_get_u32(&cur);
 
     // pcre version
-    safe_read(fd, &seffile->pcre_version_size, sizeof(seffile->pcre_version_size));
-    seffile->pcre_version = safe_malloc(seffile->pcre_version_size);
-    safe_read(fd, seffile->pcre_version, seffile->pcre_version_size);
+    seffile->pcre_version_size = cursor_get_u32(&cur);
+    seffile->pcre_version = (void *)cursor_get(&cur, seffile->pcre_version_size);
 
-    // stems
-    safe_read(fd, &num_stems, sizeof(num_stems));
+    // stems, all in one allocation
+    num_stems = cursor_get_u32(&cur);
+    if (num_stems > (size_t)(cur.end - cur.pos) / sizeof(uint32_t)) {
+        MBABORT("%s: invalid number of stems: %u\n", filename, num_stems);
+    }
+    sefbin_stem_t *stems = safe_calloc(num_stems ?: 1, sizeof(sefbin_stem_t));
     for (i=0; i<num_stems; i++) {
-        uint32_t len;
+        sefbin_stem_t *sefstem = &stems[i];
 
-        sefbin_stem_t *sefstem = safe_malloc(sizeof(sefbin_stem_t));
+        sefstem->name = cursor_get_str(&cur, 0);
 
-        safe_read(fd, &len, sizeof(len));
-        sefstem->name = safe_malloc(len+1);
-        safe_read(fd, sefstem->name, len+1);
-
-        list_add_tail(&seffile->stems, &sefstem->node);
+        sefbin_add_stem(seffile, sefstem);
     }
 
-    // specs
-    safe_read(fd, &nspec, sizeof(nspec));
+    // specs, all in one allocation
+    nspec = cursor_get_u32(&cur);
+    if (nspec > (size_t)(cur.end - cur.pos) / (sizeof(uint32_t)*8)) {
+        MBABORT("%s: invalid number of specs: %u\n", filename, nspec);
+    }
+    sefbin_spec_t *specs = safe_calloc(nspec ?: 1, sizeof(sefbin_spec_t));
     for (i=0; i<nspec; i++) {
-        sefbin_spec_t *sefspec = safe_malloc(sizeof(sefbin_spec_t));
+        sefbin_spec_t *sefspec = &specs[i];
 
-        sefspec->context = read_str(fd, 1);
-        sefspec->regex = read_str(fd, 1);
-        safe_read(fd, &sefspec->mode, sizeof(sefspec->mode));
-        safe_read(fd, &sefspec->stem_id, sizeof(sefspec->stem_id));
-        safe_read(fd, &sefspec->hasMetaChars, sizeof(sefspec->hasMetaChars));
-        safe_read(fd, &sefspec->prefix_len, sizeof(sefspec->prefix_len));
+        sefspec->context = cursor_get_str(&cur, 1);
+        sefspec->regex = cursor_get_str(&cur, 1);
+        sefspec->mode = cursor_get_u32(&cur);
+        sefspec->stem_id = cursor_get_u32(&cur);
+        sefspec->hasMetaChars = cursor_get_u32(&cur);
+        sefspec->prefix_len = cursor_get_u32(&cur);
 
-        safe_read(fd, &sefspec->pcre_data_size, sizeof(sefspec->pcre_data_size));
-        sefspec->pcre_data = safe_malloc(sefspec->pcre_data_size);
-        safe_read(fd, sefspec->pcre_data, sefspec->pcre_data_size);
+        sefspec->pcre_data_size = cursor_get_u32(&cur);
+        sefspec->pcre_data = (pcre *)cursor_get(&cur, sefspec->pcre_data_size);
 
-        safe_read(fd, &sefspec->pcre_studydata_size, sizeof(sefspec->pcre_studydata_size));
-        sefspec->pcre_studydata = safe_malloc(sefspec->pcre_studydata_size);
-        safe_read(fd, sefspec->pcre_studydata, sefspec->pcre_studydata_size);
+        sefspec->pcre_studydata_size = cursor_get_u32(&cur);
+        sefspec->pcre_studydata = (void *)cursor_get(&cur, sefspec->pcre_studydata_size);
 
         list_add_tail(&seffile->specs, &sefspec->node);
     }
 
-    close(fd);
-
     return seffile;
 }
 
 int sefbin_write(sefbin_file_t *seffile, const char *filename)
 {
-    uint32_t magic = SELINUX_MAGIC_COMPILED_FCONTEXT;
+    char tmpfilename[PATH_MAX];
+    sefbin_buf_t buf;
+    size_t size;
+    int rc;
 
-    int fd = open(filename, O_WRONLY|O_TRUNC|O_CREAT, 0644);
-    if (fd<0) {
-        MBABORT("Can't open file '%s': %s\n", filename, strerror(errno));
-        return -1;
+    // calculate the size, so we can build the file in one buffer
+    uint32_t num_stems = 0;
+    size = sizeof(uint32_t)*4 + seffile->pcre_version_size;
+
+    sefbin_stem_t *sefstem;
+    list_for_every_entry(&seffile->stems, sefstem, sefbin_stem_t, node) {
+        size += sizeof(uint32_t) + strlen(sefstem->name) + 1;
+        num_stems++;
+    }
+
+    uint32_t num_specs = 0;
+    sefbin_spec_t *sefspec;
+    list_for_every_entry(&seffile->specs, sefspec, sefbin_spec_t, node) {
+        size += sizeof(uint32_t)*8 + strlen(sefspec->context) + 1 + strlen(sefspec->regex) + 1;
+        size += sefspec->pcre_data_size + sefspec->pcre_studydata_size;
+        num_specs++;
     }
 
+    buf.data = safe_malloc(size);
+    buf.pos = 0;
+
     // magic
-    safe_write(fd, &magic, sizeof(magic));
+    buf_put_u32(&buf, SELINUX_MAGIC_COMPILED_FCONTEXT);
 
     // version
-    safe_write(fd, &seffile->version, sizeof(seffile->version));
+    buf_put_u32(&buf, seffile->version);
 
     // pcre version
-    safe_write(fd, &seffile->pcre_version_size, sizeof(seffile->pcre_version_size));
-    safe_write(fd, seffile->pcre_version, seffile->pcre_version_size);
-
-    // stems-count
-    uint32_t num_stems = list_length(&seffile->stems);
-    safe_write(fd, &num_stems, sizeof(num_stems));
+    buf_put_u32(&buf, seffile->pcre_version_size);
+    buf_put(&buf, seffile->pcre_version, seffile->pcre_version_size);
 
     // stems
-    sefbin_stem_t *sefstem;
+    buf_put_u32(&buf, num_stems);
     list_for_every_entry(&seffile->stems, sefstem, sefbin_stem_t, node) {
-        write_str(fd, 0, sefstem->name);
+        buf_put_str(&buf, 0, sefstem->name);
     }
 
-    // specs-count
-    uint32_t num_specs = list_length(&seffile->specs);
-    safe_write(fd, &num_specs, sizeof(num_specs));
-
     // specs
-    sefbin_spec_t *sefspec;
+    buf_put_u32(&buf, num_specs);
     list_for_every_entry(&seffile->specs, sefspec, sefbin_spec_t, node) {
-        write_str(fd, 1, sefspec->context);
-        write_str(fd, 1, sefspec->regex);
-        safe_write(fd, &sefspec->mode, sizeof(sefspec->mode));
-        safe_write(fd, &sefspec->stem_id, sizeof(sefspec->stem_id));
-        safe_write(fd, &sefspec->hasMetaChars, sizeof(sefspec->hasMetaChars));
-        safe_write(fd, &sefspec->prefix_len, sizeof(sefspec->prefix_len));
-
-        safe_write(fd, &sefspec->pcre_data_size, sizeof(sefspec->pcre_data_size));
-        safe_write(fd, sefspec->pcre_data, sefspec->pcre_data_size);
-
-        safe_write(fd, &sefspec->pcre_studydata_size, sizeof(sefspec->pcre_studydata_size));
-        safe_write(fd, sefspec->pcre_studydata, sefspec->pcre_studydata_size);
+        buf_put_str(&buf, 1, sefspec->context);
+        buf_put_str(&buf, 1, sefspec->regex);
+        buf_put_u32(&buf, sefspec->mode);
+        buf_put_u32(&buf, sefspec->stem_id);
+        buf_put_u32(&buf, sefspec->hasMetaChars);
+        buf_put_u32(&buf, sefspec->prefix_len);
+
+        buf_put_u32(&buf, sefspec->pcre_data_size);
+        buf_put(&buf, sefspec->pcre_data, sefspec->pcre_data_size);
+
+        buf_put_u32(&buf, sefspec->pcre_studydata_size);
+        buf_put(&buf, sefspec->pcre_studydata, sefspec->pcre_studydata_size);
     }
 
+    // the parsed file may still be mapped, so replace it instead of truncating it
+    SAFE_SNPRINTF_RET(MBABORT, -1, tmpfilename, sizeof(tmpfilename), "%s.tmp", filename);
+
+    int fd = open(tmpfilename, O_WRONLY|O_TRUNC|O_CREAT, 0644);
+    if (fd<0) {
+        MBABORT("Can't open file '%s': %s\n", tmpfilename, strerror(errno));
+        return -1;
+    }
+
+    ssize_t bytes = write(fd, buf.data, buf.pos);
+    if (bytes<0 || (size_t)bytes!=buf.pos) {
+        MBABORT("can't write: %s\n", strerror(errno));
+    }
     close(fd);
+    free(buf.data);
+
+    rc = rename(tmpfilename, filename);
+    if (rc) {
+        MBABORT("Can't rename '%s' to '%s': %s\n", tmpfilename, filename, strerror(errno));
+    }
 
     return 0;
 }
 
 int sefbin_append(sefbin_file_t *dst, sefbin_file_t *src)
 {
+    // nothing gets modified, so the new entries share the data of src
 
     // stems
     sefbin_stem_t *sefstem;
     list_for_every_entry(&src->stems, sefstem, sefbin_stem_t, node) {
         if (sefbin_get_stemid(dst, sefstem->name)<0) {
             // add new stem
-            sefbin_stem_t *nsefstem = safe_malloc(sizeof(sefbin_stem_t));
-            nsefstem->name = safe_strdup(sefstem->name);
-            list_add_tail(&dst->stems, &nsefstem->node);
+            sefbin_stem_t *nsefstem = safe_calloc(1, sizeof(sefbin_stem_t));
+            nsefstem->name = sefstem->name;
+            sefbin_add_stem(dst, nsefstem);
         }
     }
 
     // specs
+    size_t num_specs = list_length(&src->specs);
+    sefbin_spec_t *nsefspecs = safe_calloc(num_specs ?: 1, sizeof(sefbin_spec_t));
+
     sefbin_spec_t *sefspec;
     list_for_every_entry(&src->specs, sefspec, sefbin_spec_t, node) {
-        sefbin_spec_t *nsefspec = safe_malloc(sizeof(sefbin_spec_t));
+        sefbin_spec_t *nsefspec = nsefspecs++;
 
         int32_t stem_id = sefspec->stem_id;
         if (stem_id>=0) {
@@ -250,18 +352,8 @@ int sefbin_append(sefbin_file_t *dst, sefbin_file_t *src)
             stem_id = sefbin_get_stemid(dst, stem_name);
         }
 
-        nsefspec->context = safe_strdup(sefspec->context);
-        nsefspec->regex = safe_strdup(sefspec->regex);
-        nsefspec->mode = sefspec->mode;
+        *nsefspec = *sefspec;
         nsefspec->stem_id = stem_id;
-        nsefspec->hasMetaChars = sefspec->hasMetaChars;
-        nsefspec->prefix_len = sefspec->prefix_len;
-
-        nsefspec->pcre_data_size = sefspec->pcre_data_size;
-        nsefspec->pcre_data = datadup(sefspec->pcre_data, sefspec->pcre_data_size);
-
-        nsefspec->pcre_studydata_size = sefspec->pcre_studydata_size;
-        nsefspec->pcre_studydata = datadup(sefspec->pcre_studydata, sefspec->pcre_studydata_size);
 
         list_add_tail(&dst->specs, &nsefspec->node);
     }
@@ -269,30 +361,21 @@ int sefbin_append(sefbin_file_t *dst, sefbin_file_t *src)
     return 0;
 }
 
-static char *add_prefix(const char *prefix, const char *s)
-{
-    size_t len = strlen(prefix) + strlen(s) + 1;
+typedef struct regex_cache_entry {
+    struct regex_cache_entry *next;
 
-    char *s2 = safe_malloc(len);
-    SAFE_SNPRINTF_RET(LOGE, NULL, s2, len, "%s%s", prefix, s);
+    char *regex;
+    pcre *pcre_data;
+    pcre_extra *pcre_extra;
+} regex_cache_entry_t;
 
-    return s2;
-}
+#define REGEX_CACHE_BUCKETS 256
+static regex_cache_entry_t *regex_cache[REGEX_CACHE_BUCKETS];
 
-static void compile_regex(sefbin_file_t *specfile, sefbin_spec_t *spec)
+static char *anchor_regex(const char *reg_buf)
 {
-    const char *tmperrbuf;
-    char *reg_buf, *anchored_regex, *cp;
+    char *anchored_regex, *cp;
     size_t len;
-    int erroff;
-
-    /* Skip the fixed stem. */
-    reg_buf = spec->regex;
-    if (spec->stem_id >= 0) {
-        const char *stem_name = sefbin_get_stemname(specfile, spec->stem_id);
-
-        reg_buf += strlen(stem_name);
-    }
 
     /* Anchor the regular expression. */
     len = strlen(reg_buf);
@@ -305,90 +388,94 @@ static void compile_regex(sefbin_file_t *specfile, sefbin_spec_t *spec)
     *cp++ = '$';
     *cp = '\0';
 
+    return anchored_regex;
+}
+
+// every regex gets compiled once. takes ownership of anchored_regex.
+static regex_cache_entry_t *regex_cache_get(char *anchored_regex)
+{
+    const char *tmperrbuf;
+    int erroff;
+
+    regex_cache_entry_t **bucket = &regex_cache[str_hash(anchored_regex) % REGEX_CACHE_BUCKETS];
+    regex_cache_entry_t *entry;
+    for (entry=*bucket; entry; entry=entry->next) {
+        if (!strcmp(entry->regex, anchored_regex)) {
+            free(anchored_regex);
+            return entry;
+        }
+    }
+
+    entry = safe_calloc(1, sizeof(regex_cache_entry_t));
+    entry->regex = anchored_regex;
+
     /* Compile the regular expression. */
-    spec->pcre_data = pcre_compile(anchored_regex, PCRE_DOTALL, &tmperrbuf,
-                                   &erroff, NULL);
-    free(anchored_regex);
-    if (!spec->pcre_data) {
+    entry->pcre_data = pcre_compile(anchored_regex, PCRE_DOTALL, &tmperrbuf,
+                                    &erroff, NULL);
+    if (!entry->pcre_data) {
         MBABORT("regex error: %s\n", tmperrbuf);
     }
 
-    spec->pcre_extra = pcre_study(spec->pcre_data, 0, &tmperrbuf);
-    if (!spec->pcre_studydata && tmperrbuf) {
+    entry->pcre_extra = pcre_study(entry->pcre_data, 0, &tmperrbuf);
+    if (!entry->pcre_extra && tmperrbuf) {
         MBABORT("regex error: %s\n", tmperrbuf);
     }
+
+    entry->next = *bucket;
+    *bucket = entry;
+
+    return entry;
 }
 
-int sefbin_append_multiboot_rules(sefbin_file_t *dst)
+static int spec_matches(const sefbin_spec_t *spec, const char *path)
 {
-    int rc;
-    size_t size;
+    size_t prefix_len = strlen(spec->regex);
+
+    if (spec->hasMetaChars)
+        prefix_len = MIN(prefix_len, spec->prefix_len);
 
-    // get /dev stem id
-    int32_t dev_stem_id = sefbin_get_stemid(dst, "/dev");
-    if (dev_stem_id<0) {
+    // the literal prefix rules out most specs without running the regex
+    if (strncmp(path, spec->regex, prefix_len))
         return 0;
-    }
 
-    // get /multiboot stem id
-    int32_t multiboot_stem_id = sefbin_get_stemid(dst, "/multiboot");
-    if (multiboot_stem_id<0) {
-        // add new stem for /multiboot
-        sefbin_stem_t *nsefstem = safe_malloc(sizeof(sefbin_stem_t));
-        nsefstem->name = safe_strdup("/multiboot");
-        list_add_tail(&dst->stems, &nsefstem->node);
-
-        multiboot_stem_id = sefbin_get_stemid(dst, "/multiboot");
-        if (multiboot_stem_id<0) {
-            MBABORT("can't find multiboot stem\n");
-        }
-    }
+    if (!spec->hasMetaChars)
+        return !strcmp(path, spec->regex);
 
-    // specs
-    sefbin_spec_t *sefspec;
-    sefbin_spec_t *tmpentry;
-    list_for_every_entry_safe(&dst->specs, sefspec, tmpentry, sefbin_spec_t, node) {
-        if (!util_startswith(sefspec->regex, "/dev"))
-            continue;
+    // the bytecode in the file may come from a different pcre version, so compile our own
+    regex_cache_entry_t *entry = regex_cache_get(anchor_regex(spec->regex));
 
-        sefbin_spec_t *nsefspec = safe_malloc(sizeof(sefbin_spec_t));
+    return pcre_exec(entry->pcre_data, entry->pcre_extra, path, strlen(path), 0, 0, NULL, 0)>=0;
+}
 
-        // check is the id is correct
-        int32_t stem_id = sefspec->stem_id;
-        if (stem_id>=0) {
-            if (stem_id != dev_stem_id) {
-                MBABORT("%s has invalid stem id %d\n", sefspec->context, stem_id);
-            }
-        }
-        stem_id = multiboot_stem_id;
+static const char *lookup_pass(sefbin_file_t *seffile, const char *path, uint32_t mode, uint32_t hasMetaChars)
+{
+    sefbin_spec_t *sefspec;
 
-        nsefspec->context = safe_strdup(sefspec->context);
-        nsefspec->regex = add_prefix("/multiboot", sefspec->regex);
-        nsefspec->mode = sefspec->mode;
-        nsefspec->stem_id = stem_id;
-        nsefspec->hasMetaChars = sefspec->hasMetaChars;
-        nsefspec->prefix_len = sefspec->prefix_len + 10;
+    // the last matching spec wins
+    for (sefspec = list_peek_tail_type(&seffile->specs, sefbin_spec_t, node); sefspec;
+         sefspec = list_prev_type(&seffile->specs, &sefspec->node, sefbin_spec_t, node)) {
+        if (!!sefspec->hasMetaChars != hasMetaChars)
+            continue;
+        if (sefspec->mode && sefspec->mode!=mode)
+            continue;
+        if (!spec_matches(sefspec, path))
+            continue;
 
-        // compile regex
-        compile_regex(dst, nsefspec);
+        return sefspec->context;
+    }
 
-        // get pcre data size
-        rc = pcre_fullinfo(nsefspec->pcre_data, NULL, PCRE_INFO_SIZE, &size);
-        if (rc < 0) {
-            MBABORT("PCRE_INFO_SIZE error: %d\n", rc);
-        }
-        nsefspec->pcre_data_size = size;
+    return NULL;
+}
 
-        // get pcre study data size
-        rc = pcre_fullinfo(nsefspec->pcre_data, nsefspec->pcre_extra, PCRE_INFO_STUDYSIZE, &size);
-        if (rc < 0) {
-            MBABORT("PCRE_INFO_STUDYSIZE error: %d\n", rc);
-        }
-        nsefspec->pcre_studydata = nsefspec->pcre_extra->study_data;
-        nsefspec->pcre_studydata_size = size;
+const char *sefbin_lookup(sefbin_file_t *seffile, const char *path, uint32_t mode)
+{
+    // like libselinux, specs without meta chars take precedence
+    const char *context = lookup_pass(seffile, path, mode & S_IFMT, 0);
+    if (!context)
+        context = lookup_pass(seffile, path, mode & S_IFMT, 1);
 
-        list_add_tail(&dst->specs, &nsefspec->node);
-    }
+    if (context && !strcmp(context, "<<none>>"))
+        return NULL;
 
-    return 0;
+    return context;
 }
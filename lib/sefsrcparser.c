@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <ctype.h>
 #include <stdlib.h>
@@ -6,80 +7,110 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include <common.h>
 #include <util.h>
 #include <lib/sefsrcparser.h>
-#include <lib/list.h>
 
 #define LOG_TAG "SEFSRCPARSER"
 #include <lib/log.h>
 
-typedef struct {
-    list_node_t node;
+#define MULTIBOOT_PREFIX "/multiboot"
 
-    char *line;
-    size_t line_len;
-} sefsrc_item_t;
+typedef struct {
+    char *data;
+    size_t len;
+    size_t size;
+} sefsrc_buf_t;
 
-static int sefsrc_read_dev_rules(list_node_t *list, const char *filename)
+static void buf_reserve(sefsrc_buf_t *b, size_t len)
 {
-    char *line_buf = NULL;
-    size_t line_len = 0;
-    FILE *context_file;
-    ssize_t rc;
+    if (b->len + len <= b->size)
+        return;
 
-    // open file
-    context_file = fopen(filename, "r");
-    if (!context_file) {
-        MBABORT("Error opening %s: %s\n", filename, strerror(errno));
+    while (b->len + len > b->size)
+        b->size = b->size ? b->size*2 : 4096;
+
+    b->data = realloc(b->data, b->size);
+    if (!b->data) {
+        MBABORT("Can't allocate rule buffer\n");
     }
+}
 
-    // read dev lines
-    while ((rc=getline(&line_buf, &line_len, context_file)) > 0) {
-        if (!util_startswith(line_buf, "/dev"))
-            continue;
+static void buf_put(sefsrc_buf_t *b, const void *data, size_t len)
+{
+    buf_reserve(b, len);
+    memcpy(b->data + b->len, data, len);
+    b->len += len;
+}
 
-        sefsrc_item_t *item = safe_malloc(sizeof(sefsrc_item_t));
-        item->line = safe_strdup(line_buf);
-        item->line_len = (size_t)rc;
+// appends a /multiboot copy of every /dev line in data
+static void clone_dev_rules(sefsrc_buf_t *b, const char *data, size_t size)
+{
+    const char *end = data + size;
+    const char *line = data;
 
-        list_add_tail(list, &item->node);
+    // the first line doesn't follow a newline
+    if (size<4 || memcmp(line, "/dev", 4)) {
+        line = memmem(data, size, "\n/dev", 5);
+        if (line) line++;
     }
 
-    // free buffer
-    free(line_buf);
+    while (line) {
+        const char *eol = memchr(line, '\n', end - line);
+        size_t line_len = eol ? (size_t)(eol - line) : (size_t)(end - line);
 
-    // close file
-    fclose(context_file);
+        buf_put(b, MULTIBOOT_PREFIX, sizeof(MULTIBOOT_PREFIX)-1);
+        buf_put(b, line, line_len);
+        buf_put(b, "\n", 1);
 
-    return 0;
+        if (!eol)
+            break;
+        line = memmem(eol, end - eol, "\n/dev", 5);
+        if (line) line++;
+    }
 }
 
-int sefsrc_append_multiboot_rules(const char *filename)
+int sefsrc_append_multiboot_rules(const char *filename, const void *payload, size_t payload_size)
 {
-    list_node_t list;
-
-    // read dev rules
-    list_initialize(&list);
-    sefsrc_read_dev_rules(&list, filename);
+    sefsrc_buf_t b = {0};
+    struct stat sb;
+    void *map = NULL;
 
     // open file
-    int fd = open(filename, O_WRONLY|O_APPEND);
+    int fd = open(filename, O_RDWR|O_APPEND);
     if (fd<0) {
         MBABORT("Can't open file '%s': %s\n", filename, strerror(errno));
     }
 
-    write(fd, "\n", 1);
+    if (fstat(fd, &sb)) {
+        MBABORT("Can't stat file '%s': %s\n", filename, strerror(errno));
+    }
+
+    if (sb.st_size>0) {
+        map = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map==MAP_FAILED) {
+            MBABORT("Can't mmap file '%s': %s\n", filename, strerror(errno));
+        }
+    }
+
+    // the payload goes first, followed by the clones of all /dev rules
+    buf_put(&b, payload, payload_size);
+    buf_put(&b, "\n", 1);
+    if (map)
+        clone_dev_rules(&b, map, sb.st_size);
+    clone_dev_rules(&b, payload, payload_size);
 
-    sefsrc_item_t *item;
-    list_for_every_entry(&list, item, sefsrc_item_t, node) {
-        write(fd, "/multiboot", 10);
-        write(fd, item->line, item->line_len);
+    if (write(fd, b.data, b.len)!=(ssize_t)b.len) {
+        MBABORT("Can't write file '%s': %s\n", filename, strerror(errno));
     }
 
-    // close file
+    if (map)
+        munmap(map, sb.st_size);
     close(fd);
+    free(b.data);
 
     return 0;
 }
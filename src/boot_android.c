@@ -14,6 +14,7 @@
  * limitations under the License.
 */
 
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <errno.h>
 #include <string.h>
@@ -22,9 +23,15 @@
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <sys/mount.h>
+#include <sys/xattr.h>
 #include <stdio.h>
 #include <ctype.h>
 #include <dirent.h>
+#include <stdarg.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/param.h>
+#include <sys/uio.h>
 
 #include <lib/mounts.h>
 
@@ -51,12 +58,52 @@ static list_node_t remount_entries = LIST_INITIAL_VALUE(remount_entries);
         LOGE(fmt, ##__VA_ARGS__); \
 }while(0)
 
+// applies the labels which were resolved by multiboot_init
+static void apply_dev_labels(void)
+{
+    int fd = open(MBPATH_DEV_LABELS, O_RDONLY|O_CLOEXEC);
+    if (fd<0)
+        return;
+
+    struct stat sb;
+    if (fstat(fd, &sb) || sb.st_size==0) {
+        close(fd);
+        return;
+    }
+
+    char *labels = safe_malloc(sb.st_size + 1);
+    ssize_t len = read(fd, labels, sb.st_size);
+    close(fd);
+    if (len<0) {
+        LOGE("Can't read %s: %s\n", MBPATH_DEV_LABELS, strerror(errno));
+        free(labels);
+        return;
+    }
+    labels[len] = 0;
+
+    char *line, *saveptr = NULL;
+    for (line=strtok_r(labels, "\n", &saveptr); line; line=strtok_r(NULL, "\n", &saveptr)) {
+        char *context = strchr(line, '\t');
+        if (!context)
+            continue;
+        *context++ = 0;
+
+        if (lsetxattr(line, "security.selinux", context, strlen(context)+1, 0)) {
+            LOGE("Can't label %s as %s: %s\n", line, context, strerror(errno));
+        }
+    }
+
+    free(labels);
+}
+
 static void handle_on_early_init(void)
 {
     int rc;
     char buf[PATH_MAX];
     char buf2[PATH_MAX];
 
+    apply_dev_labels();
+
     part_replacement_t *replacement;
     list_for_every_entry(&multiboot_data->replacements, replacement, part_replacement_t, node) {
         struct stat sb_orig;
@@ -139,17 +186,27 @@ finish:
 static void handle_on_post_fs_data(void)
 {
     int rc;
-    mounts_state_t mounts_state = LIST_INITIAL_VALUE(mounts_state);
+    char esp_mount_point[PATH_MAX];
 
-    // scan mounted volumes
-    rc = scan_mounted_volumes(&mounts_state);
-    if (rc) {
+    // find ESP volume
+    mounts_state_t *mounts_state = mounts_cache_get();
+    if (!mounts_state) {
         MBABORT_IF_MB("Can't scan mounted volumes: %s\n", strerror(errno));
+        rc = -1;
         goto finish;
     }
+    const mounted_volume_t *volume = find_mounted_volume_by_majmin(mounts_state, multiboot_data->espdev->major, multiboot_data->espdev->minor, 0);
+    if (volume) {
+        rc = snprintf(esp_mount_point, sizeof(esp_mount_point), "%s", volume->mount_point);
+        if (SNPRINTF_ERROR(rc, sizeof(esp_mount_point))) {
+            mounts_cache_put();
+            MBABORT_IF_MB("Can't copy ESP mount point\n");
+            rc = -1;
+            goto finish;
+        }
+    }
+    mounts_cache_put();
 
-    // find ESP volume
-    const mounted_volume_t *volume = find_mounted_volume_by_majmin(&mounts_state, multiboot_data->espdev->major, multiboot_data->espdev->minor, 0);
     if (!volume) {
         LOGI("ESP is not mounted. do this now.\n");
 
@@ -163,16 +220,13 @@ static void handle_on_post_fs_data(void)
         LOGI("bind-mount ESP to %s\n", MBPATH_ESP);
 
         // bind-mount ESP to our dir
-        rc = util_mount(volume->mount_point, MBPATH_ESP, NULL, MS_BIND, NULL);
+        rc = util_mount(esp_mount_point, MBPATH_ESP, NULL, MS_BIND, NULL);
         if (rc) {
             MBABORT_IF_MB("can't bind-mount ESP to %s: %s\n", MBPATH_ESP, strerror(errno));
             goto finish;
         }
     }
 
-    // free mount state
-    free_mounts_state(&mounts_state);
-
     part_replacement_t *replacement;
     list_for_every_entry(&multiboot_data->replacements, replacement, part_replacement_t, node) {
         if (!replacement->losetup_done && replacement->loopdevice) {
@@ -181,9 +235,18 @@ static void handle_on_post_fs_data(void)
                 goto finish;
             }
 
+            // chunkfs needs the ESP, which we just mounted
+            if (replacement->chunkstore_image) {
+                rc = util_chunkfs(replacement->chunkstore_image, replacement->loopfile);
+                if (rc) {
+                    MBABORT_IF_MB("Can't serve %s from the chunk store\n", replacement->chunkstore_image);
+                    goto finish;
+                }
+            }
+
             // setup loop device
             LOGD("losetup %s with %s\n", replacement->loopdevice, replacement->loopfile);
-            rc = util_losetup(replacement->loopdevice, replacement->loopfile, false);
+            rc = util_losetup_ex(replacement->loopdevice, replacement->loopfile, 0, &replacement->loop_tuning);
             if (rc) {
                 MBABORT_IF_MB("Can't setup loop device at %s for %s\n", replacement->loopdevice, replacement->loopfile);
                 goto finish;
@@ -264,167 +327,508 @@ static int fstab_append(int fd, const char *blk_device, const char *mount_point,
 #define FIRST_WORD(p) NEXT_WORD_INTERNAL((p), (p))
 #define NEXT_WORD(p) NEXT_WORD_INTERNAL(NULL, (p))
 
-static int process_file(FILE *fp_orig, FILE *fp_out)
+typedef struct {
+    // generated spans live in the output buffer, the others in the mapping
+    int generated;
+    size_t offset;
+    size_t len;
+} rc_span_t;
+
+typedef struct {
+    const char *map;
+    size_t map_size;
+
+    char *out;
+    size_t out_len;
+    size_t out_size;
+
+    rc_span_t *spans;
+    size_t num_spans;
+    size_t spans_size;
+} rc_patch_t;
+
+typedef struct {
+    char *filename;
+    char **imports;
+    size_t num_imports;
+    int rc;
+} rc_job_t;
+
+typedef struct {
+    pthread_mutex_t lock;
+    rc_job_t *jobs;
+    uint32_t num_jobs;
+    uint32_t next_job;
+} rc_pool_t;
+
+static void rc_add_span(rc_patch_t *patch, int generated, size_t offset, size_t len)
+{
+    if (len==0)
+        return;
+
+    if (patch->num_spans==patch->spans_size) {
+        patch->spans_size = MAX(16u, patch->spans_size*2);
+        patch->spans = realloc(patch->spans, patch->spans_size*sizeof(*patch->spans));
+        if (!patch->spans) {
+            MBABORT("Can't allocate rc spans\n");
+        }
+    }
+
+    rc_span_t *span = &patch->spans[patch->num_spans++];
+    span->generated = generated;
+    span->offset = offset;
+    span->len = len;
+}
+
+static void rc_printf(rc_patch_t *patch, const char *fmt, ...)
+{
+    va_list ap;
+    int len;
+
+    va_start(ap, fmt);
+    len = vsnprintf(NULL, 0, fmt, ap);
+    va_end(ap);
+    if (len<0) {
+        MBABORT("Can't format rc line\n");
+    }
+
+    while (patch->out_len + len + 1 > patch->out_size) {
+        patch->out_size = MAX(4096u, patch->out_size*2);
+        patch->out = realloc(patch->out, patch->out_size);
+        if (!patch->out) {
+            MBABORT("Can't allocate rc buffer\n");
+        }
+    }
+
+    va_start(ap, fmt);
+    vsnprintf(patch->out + patch->out_len, len + 1, fmt, ap);
+    va_end(ap);
+
+    rc_add_span(patch, 1, patch->out_len, len);
+    patch->out_len += len;
+}
+
+// finds the next line whose first word starts with cmd
+static const char *rc_find_command(const char *start, const char *end, const char *cmd, const char **pline)
+{
+    size_t cmd_len = strlen(cmd);
+    const char *p = start;
+
+    while ((p = memmem(p, end - p, cmd, cmd_len))) {
+        const char *line = p;
+        while (line>start && line[-1]!='\n' && isspace(line[-1]))
+            line--;
+
+        if (line==start || line[-1]=='\n') {
+            *pline = line;
+            return p;
+        }
+
+        p += cmd_len;
+    }
+
+    return NULL;
+}
+
+// returns 1 if the command got replaced, 0 if the line has to be kept
+static int rc_patch_mount(rc_patch_t *patch, const char *cmd, size_t cmd_len)
 {
     char line[PATH_MAX];
-    char *save_ptr;
     char buf[PATH_MAX];
-    const char *pcmd;
+    char *save_ptr;
+    char *p = line;
+
+    /* mount <type> <device> <path> <flags ...> <options> */
+
+    if (cmd_len>=sizeof(line))
+        return 0;
+    memcpy(line, cmd, cmd_len);
+    line[cmd_len] = 0;
+
+    // 'mount'
+    if (!FIRST_WORD(p)) return 0;
+
+    // type
+    if (!NEXT_WORD(p)) return 0;
+    const char *type = p;
+
+    // device
+    if (!NEXT_WORD(p)) return 0;
+    const char *device = p;
+
+    // path
+    if (!NEXT_WORD(p)) return 0;
+    const char *path = p;
+
+    // flags and options, bionic's strtok_r leaves save_ptr NULL at the end of the line
+    const char *rest = save_ptr ? save_ptr : "";
+    SKIP_WHITESPACE(rest);
+
+    // get uevent block for this device
+    uevent_block_t *uevent_block = get_blockinfo_for_path(multiboot_data->blockinfo, device);
+    if (!uevent_block) return 0;
+
+    // get replacement for this device
+    part_replacement_t *replacement = util_get_replacement(uevent_block->major, uevent_block->minor);
+    if (!replacement) return 0;
+
+    const char *blk_device;
+    const char *mnt_flags = rest;
+    // determine mount args
+    if (replacement->mountmode==PART_REPLACEMENT_MOUNTMODE_BIND) {
+        blk_device = replacement->bindsource;
+        mnt_flags = "bind";
+    } else if (replacement->mountmode==PART_REPLACEMENT_MOUNTMODE_LOOP) {
+        blk_device = replacement->loopdevice;
+    } else if (replacement->mountmode==PART_REPLACEMENT_MOUNTMODE_DENY) {
+        // drop the command
+        return 1;
+    } else if (replacement->mountmode==PART_REPLACEMENT_MOUNTMODE_ALLOW) {
+        return 0;
+    } else {
+        LOGE("invalid mountmode %d\n", replacement->mountmode);
+        return 0;
+    }
 
-    while (fgets(line, sizeof(line), fp_orig)) {
-        size_t len = strlen(line);
-        pcmd = NULL;
+    // write modified command
+    rc_printf(patch, "    mount %s %s %s %s\n", type, blk_device, path, mnt_flags);
 
-        // skip incomplete lines
-        if (len && (line[len - 1] != '\n')) {
-            goto write_unmodified;
+    // remount to apply requested mount-flags
+    if (replacement->mountmode==PART_REPLACEMENT_MOUNTMODE_BIND) {
+        SAFE_SNPRINTF_RET(LOGE, 1, buf, sizeof(buf), "remount,bind%s%s", rest[0] ? "," : "", rest);
+        rc_printf(patch, "    mount %s %s %s %s\n", type, blk_device, path, buf);
+    }
+
+    // bind mount datamedia
+    if (!strcmp(path, "/data")) {
+        SAFE_SNPRINTF_RET(LOGE, 1, buf, sizeof(buf), "%s%s", path, multiboot_data->datamedia_target);
+
+        LOGI("bind-mount %s to %s\n", multiboot_data->datamedia_source, buf);
+        rc_printf(patch, "    mount %s %s %s %s\n", type, multiboot_data->datamedia_source, buf, "bind");
+    }
+
+    return 1;
+}
+
+static void rc_add_import(rc_job_t *job, const char *path, size_t len)
+{
+    job->imports = realloc(job->imports, (job->num_imports + 1)*sizeof(*job->imports));
+    if (!job->imports) {
+        MBABORT("Can't allocate rc import list\n");
+    }
+
+    char *import = safe_malloc(len + 1);
+    memcpy(import, path, len);
+    import[len] = 0;
+    job->imports[job->num_imports++] = import;
+}
+
+static void rc_collect_imports(rc_job_t *job, const char *data, size_t size)
+{
+    const char *end = data + size;
+    const char *line;
+    const char *cmd = data;
+
+    while ((cmd = rc_find_command(cmd, end, "import", &line))) {
+        const char *p = cmd + 6;
+        if (p>=end || !isspace(*p)) {
+            cmd = p;
+            continue;
+        }
+        while (p<end && (*p==' ' || *p=='\t'))
+            p++;
+
+        const char *path = p;
+        while (p<end && !isspace(*p))
+            p++;
+
+        // property expansions are resolved by init, files in / get patched anyway
+        if (p>path && !memchr(path, '$', p - path))
+            rc_add_import(job, path, p - path);
+
+        cmd = p;
+    }
+}
+
+static int rc_write_file(const char *filename, rc_patch_t *patch)
+{
+    char tmpfile[PATH_MAX];
+    struct iovec iov[64];
+    size_t i;
+    int rc = 0;
+
+    SAFE_SNPRINTF_RET(LOGE, -1, tmpfile, sizeof(tmpfile), "%s.tmp", filename);
+
+    int fd = open(tmpfile, O_WRONLY|O_CREAT|O_TRUNC, 0750);
+    if (fd<0) {
+        LOGE("can't open %s: %s\n", tmpfile, strerror(errno));
+        return -1;
+    }
+
+    for (i=0; i<patch->num_spans && !rc; ) {
+        size_t num_iov = 0;
+        size_t len = 0;
+
+        for (; i<patch->num_spans && num_iov<ARRAY_SIZE(iov); i++, num_iov++) {
+            rc_span_t *span = &patch->spans[i];
+            iov[num_iov].iov_base = (char *)(span->generated ? patch->out : patch->map) + span->offset;
+            iov[num_iov].iov_len = span->len;
+            len += span->len;
         }
 
-        // skip over leading whitespace
-        pcmd = line;
-        SKIP_WHITESPACE(pcmd);
+        if (writev(fd, iov, num_iov)!=(ssize_t)len) {
+            LOGE("can't write %s: %s\n", tmpfile, strerror(errno));
+            rc = -1;
+        }
+    }
 
-        // we want mount commands only
-        if (strstr(pcmd, "mount")==pcmd && isspace(pcmd[5])) {
-            /* mount <type> <device> <path> <flags ...> <options> */
+    // set permissions for patched file
+    if (!rc && fchmod(fd, 0750)) {
+        LOGE("can't chmod %s: %s\n", tmpfile, strerror(errno));
+        rc = -1;
+    }
+    close(fd);
 
-            // create a copy, and keep a pointer to the start
-            char *p_start = safe_strdup(pcmd);
-            char *p = p_start;
+    if (!rc && rename(tmpfile, filename)) {
+        LOGE("can't rename %s: %s\n", tmpfile, strerror(errno));
+        rc = -1;
+    }
 
-            // remove newline
-            p_start[strlen(p_start) - 1] = 0;
+    if (rc)
+        unlink(tmpfile);
 
-            // 'mount'
-            if (!FIRST_WORD(p)) goto write_unmodified;
+    return rc;
+}
 
-            // type
-            if (!NEXT_WORD(p)) goto write_unmodified;
-            char *type = safe_strdup(p);
+static int rc_patch_file(rc_job_t *job)
+{
+    rc_patch_t patch = {0};
+    struct stat sb;
+    int rc = 0;
 
-            // device
-            if (!NEXT_WORD(p)) goto write_unmodified;
-            UNUSED char *device = safe_strdup(p);
+    int fd = open(job->filename, O_RDONLY|O_CLOEXEC);
+    if (fd<0) {
+        LOGE("can't open %s: %s\n", job->filename, strerror(errno));
+        return -1;
+    }
 
-            // path
-            if (!NEXT_WORD(p)) goto write_unmodified;
-            char *path = safe_strdup(p);
+    if (fstat(fd, &sb)) {
+        LOGE("can't stat %s: %s\n", job->filename, strerror(errno));
+        close(fd);
+        return -1;
+    }
 
-            // flags and options
-            const char *rest = pcmd + (save_ptr-p_start);
-            SKIP_WHITESPACE(rest);
+    if (sb.st_size==0) {
+        close(fd);
+        return 0;
+    }
 
-            // get uevent block for this device
-            uevent_block_t *uevent_block = get_blockinfo_for_path(multiboot_data->blockinfo, device);
-            if (!uevent_block) goto write_unmodified;
+    patch.map_size = sb.st_size;
+    patch.map = mmap(NULL, patch.map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (patch.map==MAP_FAILED) {
+        LOGE("can't mmap %s: %s\n", job->filename, strerror(errno));
+        return -1;
+    }
 
-            // get replacement for this device
-            part_replacement_t *replacement = util_get_replacement(uevent_block->major, uevent_block->minor);
-            if (!replacement) goto write_unmodified;
+    const char *start = patch.map;
+    const char *end = start + patch.map_size;
+    const char *pos = start;
+    const char *cmd = start;
+    const char *line;
+    int modified = 0;
 
-            const char *blk_device;
-            const char *mnt_flags = rest;
-            // determine mount args
-            if (replacement->mountmode==PART_REPLACEMENT_MOUNTMODE_BIND) {
-                blk_device = replacement->bindsource;
-                mnt_flags = "bind";
-            } else if (replacement->mountmode==PART_REPLACEMENT_MOUNTMODE_LOOP) {
-                blk_device = replacement->loopdevice;
-            } else if (replacement->mountmode==PART_REPLACEMENT_MOUNTMODE_DENY) {
-                // next entry
-                continue;
-            } else if (replacement->mountmode==PART_REPLACEMENT_MOUNTMODE_ALLOW) {
-                goto write_unmodified;
+    rc_collect_imports(job, start, patch.map_size);
+
+    // this finds mount_all, too
+    while ((cmd = rc_find_command(cmd, end, "mount", &line))) {
+        const char *eol = memchr(cmd, '\n', end - cmd);
+
+        // skip incomplete lines
+        if (!eol)
+            break;
+
+        if (isspace(cmd[5])) {
+            size_t num_spans = patch.num_spans;
+
+            // replace the whole line
+            rc_add_span(&patch, 0, pos - start, line - pos);
+            if (rc_patch_mount(&patch, cmd, eol - cmd)) {
+                pos = eol + 1;
+                modified = 1;
             } else {
-                LOGE("invalid mountmode %d\n", replacement->mountmode);
-                return -1;
+                patch.num_spans = num_spans;
             }
+        }
+        else if (!strncmp(cmd, "mount_all", 9) && isspace(cmd[9])) {
+            rc_add_span(&patch, 0, pos - start, eol + 1 - pos);
+            rc_printf(&patch, "\n"
+                      // start mbtrigger
+                      "    write "MBPATH_TRIGGER_CMD" post-fstab\n"
+                      "    start mbtrigger\n"
+                      "    wait "MBPATH_TRIGGER_WAIT_FILE"\n"
+
+                      // mbtrigger cleanup
+                      "    rm "MBPATH_TRIGGER_WAIT_FILE"\n"
+                     );
+            pos = eol + 1;
+            modified = 1;
+        }
 
-            // write modified command
-            fprintf(fp_out, "    mount %s %s %s %s\n", type, blk_device, path, mnt_flags);
+        cmd = eol + 1;
+    }
 
-            // remount to apply requested mount-flags
-            if (replacement->mountmode==PART_REPLACEMENT_MOUNTMODE_BIND) {
-                SAFE_SNPRINTF_RET(LOGE, -1, buf, sizeof(buf), "remount,bind,%s", rest);
-                fprintf(fp_out, "    mount %s %s %s %s\n", type, blk_device, path, buf);
-            }
+    // leave files without mount commands alone
+    if (modified) {
+        LOGV("patch: %s\n", job->filename);
+        rc_add_span(&patch, 0, pos - start, end - pos);
+        rc = rc_write_file(job->filename, &patch);
+    }
 
-            // bind mount datamedia
-            if (!strcmp(path, "/data")) {
-                SAFE_SNPRINTF_RET(LOGE, -1, buf, sizeof(buf), "%s%s", path, multiboot_data->datamedia_target);
+    munmap((void *)patch.map, patch.map_size);
+    free(patch.out);
+    free(patch.spans);
 
-                LOGI("bind-mount %s to %s\n", multiboot_data->datamedia_source, buf);
-                fprintf(fp_out, "    mount %s %s %s %s\n", type, multiboot_data->datamedia_source, buf, "bind");
-            }
+    return rc;
+}
 
-            // next entry
-            continue;
+static void *rc_worker(void *arg)
+{
+    rc_pool_t *pool = arg;
+
+    for (;;) {
+        rc_job_t *job;
+
+        // get the next pending file
+        pthread_mutex_lock(&pool->lock);
+        if (pool->next_job>=pool->num_jobs) {
+            pthread_mutex_unlock(&pool->lock);
+            break;
         }
+        job = &pool->jobs[pool->next_job++];
+        pthread_mutex_unlock(&pool->lock);
 
-        // write unmodified command
-write_unmodified:
-        fputs(line, fp_out);
+        job->rc = rc_patch_file(job);
+    }
 
-        if (pcmd && strstr(pcmd, "mount_all")==pcmd && isspace(pcmd[9])) {
-            fputs("\n"
-                  // start mbtrigger
-                  "    write "MBPATH_TRIGGER_CMD" post-fstab\n"
-                  "    start mbtrigger\n"
-                  "    wait "MBPATH_TRIGGER_WAIT_FILE"\n"
+    return NULL;
+}
 
-                  // mbtrigger cleanup
-                  "    rm "MBPATH_TRIGGER_WAIT_FILE"\n"
-                  , fp_out);
-        }
+static void rc_queue_file(rc_pool_t *pool, const char *filename)
+{
+    uint32_t i;
+
+    for (i=0; i<pool->num_jobs; i++) {
+        if (!strcmp(pool->jobs[i].filename, filename))
+            return;
     }
 
-    return 0;
+    pool->jobs = realloc(pool->jobs, (pool->num_jobs + 1)*sizeof(*pool->jobs));
+    if (!pool->jobs) {
+        MBABORT("Can't allocate rc job list\n");
+    }
+
+    rc_job_t *job = &pool->jobs[pool->num_jobs++];
+    memset(job, 0, sizeof(*job));
+    job->filename = safe_strdup(filename);
 }
 
-static int patch_rc_files(void)
+// queues all rc files in dir
+static void rc_queue_dir(rc_pool_t *pool, const char *dir)
 {
-    DIR *dp;
-    struct dirent *ep;
     char buf[PATH_MAX];
+    struct dirent *ep;
 
-    dp = opendir("/");
-    if (dp != NULL) {
-        while ((ep=readdir (dp))) {
-            if (!strcmp(ep->d_name, ".") || !strcmp(ep->d_name, ".."))
-                continue;
+    DIR *dp = opendir(dir);
+    if (!dp) {
+        MBABORT("Can't open directory %s: %s\n", dir, strerror(errno));
+    }
 
-            if (strcmp(util_get_file_extension(ep->d_name), "rc"))
-                continue;
+    while ((ep=readdir(dp))) {
+        if (!strcmp(ep->d_name, ".") || !strcmp(ep->d_name, ".."))
+            continue;
 
-            // rename original file
-            SAFE_SNPRINTF_RET(MBABORT, -1, buf, sizeof(buf), "%s.orig", ep->d_name);
-            rename(ep->d_name, buf);
+        if (strcmp(util_get_file_extension(ep->d_name), "rc"))
+            continue;
 
-            // open original file
-            FILE *fp_orig = fopen(buf, "r");
-            if (!fp_orig) MBABORT("can't open %s: %s\n", buf, strerror(errno));
+        SAFE_SNPRINTF_RET(MBABORT, , buf, sizeof(buf), "%s%s%s", dir, strcmp(dir, "/") ? "/" : "", ep->d_name);
+        rc_queue_file(pool, buf);
+    }
+    closedir(dp);
+}
 
-            // open output file
-            FILE *fp_out = fopen(ep->d_name, "w");
-            if (!fp_out) MBABORT("can't open %s: %s\n", ep->d_name, strerror(errno));
+static void rc_queue_import(rc_pool_t *pool, const char *path)
+{
+    struct stat sb;
 
-            // process file
-            LOGV("process: %s\n", ep->d_name);
-            process_file(fp_orig, fp_out);
+    // imports from partitions which aren't mounted yet can't be patched anyway
+    if (path[0]!='/' || stat(path, &sb))
+        return;
 
-            // close files
-            fclose(fp_out);
-            fclose(fp_orig);
+    if (S_ISDIR(sb.st_mode))
+        rc_queue_dir(pool, path);
+    else if (S_ISREG(sb.st_mode))
+        rc_queue_file(pool, path);
+}
 
-            // set permissions for patched file
-            chmod(ep->d_name, 0750);
+static int patch_rc_files(void)
+{
+    rc_pool_t pool = {0};
+    pthread_t threads[8];
+    uint32_t num_threads;
+    uint32_t start;
+    uint32_t i, j;
+    int errors = 0;
+
+    pthread_mutex_init(&pool.lock, NULL);
+    rc_queue_dir(&pool, "/");
+
+    // every pass patches the files which got imported by the previous one
+    for (start=0; start<pool.num_jobs; start=pool.next_job) {
+        long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+        num_threads = MIN(pool.num_jobs - start, (uint32_t)MAX(ncpus, 1));
+        num_threads = MIN(num_threads, ARRAY_SIZE(threads));
+
+        // the calling thread is a worker, too
+        for (i=1; i<num_threads; i++) {
+            int rc = pthread_create(&threads[i], NULL, rc_worker, &pool);
+            if (rc) {
+                LOGW("can't create worker thread: %s\n", strerror(rc));
+                break;
+            }
+        }
+        num_threads = i;
 
-            // delete original file
-            unlink(buf);
+        rc_worker(&pool);
+        for (i=1; i<num_threads; i++) {
+            pthread_join(threads[i], NULL);
         }
-        closedir (dp);
-    } else {
-        MBABORT("Can't open root directory: %s\n", strerror(errno));
+
+        // the job list may move while queueing imports
+        uint32_t end = pool.num_jobs;
+        for (i=start; i<end; i++) {
+            for (j=0; j<pool.jobs[i].num_imports; j++) {
+                rc_queue_import(&pool, pool.jobs[i].imports[j]);
+                free(pool.jobs[i].imports[j]);
+            }
+            free(pool.jobs[i].imports);
+            pool.jobs[i].imports = NULL;
+            pool.jobs[i].num_imports = 0;
+        }
+    }
+
+    for (i=0; i<pool.num_jobs; i++) {
+        if (pool.jobs[i].rc) {
+            LOGE("can't patch %s\n", pool.jobs[i].filename);
+            errors++;
+        }
+        free(pool.jobs[i].filename);
+    }
+    free(pool.jobs);
+    pthread_mutex_destroy(&pool.lock);
+
+    if (errors) {
+        MBABORT("Can't patch %d rc file(s)\n", errors);
     }
 
     return 0;
@@ -0,0 +1,456 @@
+/*
+ * Copyright 2016, The EFIDroid Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <lib/cksum.h>
+#include <lib/fs_mgr.h>
+
+#include <util.h>
+#include <common.h>
+
+#define LOG_TAG "BOOTPLAN"
+#include <lib/log.h>
+
+#define BOOTPLAN_MAGIC 0x6e6c7062 // "bpln"
+#define BOOTPLAN_VERSION 2
+#define BOOTPLAN_FILENAME ".bootplan"
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t key;
+    uint32_t size;
+    uint32_t crc;
+} bootplan_header_t;
+
+typedef struct {
+    char *data;
+    size_t size;
+    size_t pos;
+} bootplan_buf_t;
+
+static void buf_put(bootplan_buf_t *b, const void *data, size_t size)
+{
+    if (b->pos + size > b->size) {
+        b->size = (b->pos + size) * 2;
+        b->data = realloc(b->data, b->size);
+        if (!b->data) {
+            MBABORT("Can't allocate memory for boot plan\n");
+        }
+    }
+
+    memcpy(b->data + b->pos, data, size);
+    b->pos += size;
+}
+
+static void buf_put_u32(bootplan_buf_t *b, uint32_t value)
+{
+    buf_put(b, &value, sizeof(value));
+}
+
+static void buf_put_str(bootplan_buf_t *b, const char *str)
+{
+    uint32_t len = str ? strlen(str)+1 : 0;
+
+    buf_put_u32(b, len);
+    if (len)
+        buf_put(b, str, len);
+}
+
+static int buf_get(bootplan_buf_t *b, void *data, size_t size)
+{
+    if (b->pos + size > b->size)
+        return -1;
+
+    memcpy(data, b->data + b->pos, size);
+    b->pos += size;
+    return 0;
+}
+
+static int buf_get_u32(bootplan_buf_t *b, uint32_t *value)
+{
+    return buf_get(b, value, sizeof(*value));
+}
+
+static int buf_get_str(bootplan_buf_t *b, char **str)
+{
+    uint32_t len;
+
+    if (buf_get_u32(b, &len))
+        return -1;
+
+    if (len==0) {
+        *str = NULL;
+        return 0;
+    }
+
+    if (b->pos + len > b->size || b->data[b->pos + len - 1]!='\0')
+        return -1;
+
+    *str = safe_strdup(b->data + b->pos);
+    b->pos += len;
+    return 0;
+}
+
+static void buf_put_loop_tuning(bootplan_buf_t *b, const loop_tuning_t *tuning)
+{
+    buf_put_u32(b, tuning->direct_io);
+    buf_put_u32(b, tuning->block_size);
+    buf_put_u32(b, tuning->nr_requests);
+    buf_put_u32(b, tuning->read_ahead_kb);
+    buf_put_str(b, tuning->scheduler);
+}
+
+static int buf_get_loop_tuning(bootplan_buf_t *b, loop_tuning_t *tuning)
+{
+    if (buf_get_u32(b, (uint32_t *)&tuning->direct_io)) return -1;
+    if (buf_get_u32(b, (uint32_t *)&tuning->block_size)) return -1;
+    if (buf_get_u32(b, (uint32_t *)&tuning->nr_requests)) return -1;
+    if (buf_get_u32(b, (uint32_t *)&tuning->read_ahead_kb)) return -1;
+    if (buf_get_str(b, &tuning->scheduler)) return -1;
+    return 0;
+}
+
+static uint32_t hash_file(uint32_t crc, const char *filename)
+{
+    size_t size = 0;
+    char *data = util_get_file_contents_ex(filename, &size);
+
+    // a missing file is part of the configuration, too
+    if (!data) {
+        return cksum_crc32(crc, (const unsigned char *)"\0", 1);
+    }
+
+    crc = cksum_crc32(crc, (const unsigned char *)data, size);
+    free(data);
+
+    return crc;
+}
+
+// the plan only depends on what a path is, not on what the ROM wrote into it.
+// writable images and bind directories change on every boot, so the mtime
+// only counts where the contents matter and nobody writes on a normal boot.
+static uint32_t hash_stat(uint32_t crc, const char *path, int with_mtime)
+{
+    struct stat sb;
+    uint64_t values[5] = {0};
+
+    if (!stat(path, &sb)) {
+        values[0] = 1;
+        values[1] = sb.st_mode & S_IFMT;
+        // directory sizes change with their contents
+        if (!S_ISDIR(sb.st_mode))
+            values[2] = sb.st_size;
+        if (with_mtime) {
+            values[3] = sb.st_mtim.tv_sec;
+            values[4] = sb.st_mtim.tv_nsec;
+        }
+    }
+
+    return cksum_crc32(crc, (const unsigned char *)values, sizeof(values));
+}
+
+static uint32_t hash_str(uint32_t crc, const char *str)
+{
+    if (!str)
+        str = "";
+
+    return cksum_crc32(crc, (const unsigned char *)str, strlen(str)+1);
+}
+
+static int bootplan_get_paths(char *planfile, char *basedir, size_t bufsz)
+{
+    multiboot_data_t *multiboot_data = multiboot_get_data();
+    int rc;
+
+    char *dir = util_dirname(multiboot_data->path);
+    if (!dir) {
+        return -1;
+    }
+
+    rc = snprintf(basedir, bufsz, MBPATH_BOOTDEV"%s", dir);
+    free(dir);
+    if (SNPRINTF_ERROR(rc, bufsz)) {
+        return -1;
+    }
+
+    rc = snprintf(planfile, bufsz, "%s/"BOOTPLAN_FILENAME, basedir);
+    if (SNPRINTF_ERROR(rc, bufsz)) {
+        return -1;
+    }
+
+    return 0;
+}
+
+static uint32_t bootplan_compute_key(const char *basedir)
+{
+    multiboot_data_t *multiboot_data = multiboot_get_data();
+    uevent_block_t *event;
+    uint32_t crc = 0;
+    uint32_t i;
+    char buf[PATH_MAX];
+
+    // multiboot.ini and both fstabs
+    SAFE_SNPRINTF_RET(LOGE, 0, buf, sizeof(buf), MBPATH_BOOTDEV"%s", multiboot_data->path);
+    crc = hash_file(crc, buf);
+    crc = hash_file(crc, MBPATH_FSTAB);
+    crc = hash_file(crc, multiboot_data->romfstabpath);
+
+    // the datamedia source comes from the native data layout
+    crc = cksum_crc32(crc, (const unsigned char *)&multiboot_data->native_data_layout_version,
+                      sizeof(multiboot_data->native_data_layout_version));
+
+    // device map
+    list_for_every_entry(multiboot_data->blockinfo, event, uevent_block_t, node) {
+        uint32_t ids[2] = {event->major, event->minor};
+
+        crc = hash_str(crc, event->devname);
+        crc = hash_str(crc, event->partname);
+        crc = cksum_crc32(crc, (const unsigned char *)ids, sizeof(ids));
+    }
+
+    // partition images
+    for (i=0; i<multiboot_data->num_mbparts; i++) {
+        multiboot_partition_t *part = &multiboot_data->mbparts[i];
+
+        // the ROM writes to data on every boot and the plan doesn't depend
+        // on its contents, the layout version gets re-applied anyway
+        if (!strcmp(part->name, "data"))
+            continue;
+
+        // the sdk version comes from the build.prop inside the system image,
+        // which gets mounted read-only for that
+        SAFE_SNPRINTF_RET(LOGE, 0, buf, sizeof(buf), "%s/%s", basedir, part->path);
+        crc = hash_stat(crc, buf, part->type==MBPART_TYPE_LOOP && !strcmp(part->name, "system"));
+
+        // or from this file
+        if (part->type==MBPART_TYPE_BIND && !strcmp(part->name, "system")) {
+            SAFE_SNPRINTF_RET(LOGE, 0, buf, sizeof(buf), "%s/%s/build.prop", basedir, part->path);
+            crc = hash_file(crc, buf);
+        }
+    }
+
+    return crc;
+}
+
+static void bootplan_free_parts(multiboot_partition_t *mbparts, uint32_t num_mbparts)
+{
+    uint32_t i;
+
+    if (!mbparts)
+        return;
+
+    for (i=0; i<num_mbparts; i++) {
+        free(mbparts[i].name);
+        free(mbparts[i].path);
+        free(mbparts[i].loop_tuning.scheduler);
+    }
+    free(mbparts);
+}
+
+int bootplan_load(void)
+{
+    multiboot_data_t *multiboot_data = multiboot_get_data();
+    bootplan_header_t hdr;
+    bootplan_buf_t b = {0};
+    char planfile[PATH_MAX];
+    char basedir[PATH_MAX];
+    multiboot_partition_t *mbparts = NULL;
+    uint32_t num_mbparts = 0;
+    uint32_t sdk_version, layout_version;
+    char *datamedia_source = NULL;
+    char *datamedia_target = NULL;
+    loop_tuning_t loop_tuning = {0};
+    uint32_t i;
+    int rc;
+
+    rc = bootplan_get_paths(planfile, basedir, sizeof(planfile));
+    if (rc) {
+        return -1;
+    }
+
+    b.data = util_get_file_contents_ex(planfile, &b.size);
+    if (!b.data) {
+        LOGD("no boot plan at %s\n", planfile);
+        return -1;
+    }
+
+    // validate header
+    rc = buf_get(&b, &hdr, sizeof(hdr));
+    if (rc || hdr.magic!=BOOTPLAN_MAGIC || hdr.version!=BOOTPLAN_VERSION || hdr.size!=b.size-b.pos
+        || hdr.crc!=cksum_crc32(0, (const unsigned char *)b.data + b.pos, hdr.size))
+    {
+        LOGW("ignore invalid boot plan %s\n", planfile);
+        goto err;
+    }
+
+    // partitions
+    if (buf_get_u32(&b, &num_mbparts) || num_mbparts>hdr.size) goto err_parse;
+    mbparts = safe_calloc(sizeof(multiboot_partition_t), num_mbparts);
+    for (i=0; i<num_mbparts; i++) {
+        multiboot_partition_t *part = &mbparts[i];
+        uint32_t type;
+        char *devname = NULL;
+
+        if (buf_get_str(&b, &part->name)) goto err_parse;
+        if (buf_get_str(&b, &part->path)) goto err_parse;
+        if (buf_get_u32(&b, &type)) goto err_parse;
+        if (buf_get_str(&b, &devname)) goto err_parse;
+        if (buf_get_loop_tuning(&b, &part->loop_tuning)) goto err_parse;
+        part->type = type;
+
+        if (!part->name || !part->path || !devname) {
+            free(devname);
+            goto err_parse;
+        }
+
+        part->uevent_block = get_blockinfo_for_devname(multiboot_data->blockinfo, devname);
+        free(devname);
+        if (!part->uevent_block) {
+            goto err_parse;
+        }
+
+        // the bootdev filesystem may have changed
+        if (part->type==MBPART_TYPE_BIND && !multiboot_data->bootdev_supports_bindmount) {
+            goto err_parse;
+        }
+    }
+
+    if (buf_get_loop_tuning(&b, &loop_tuning)) goto err_parse;
+
+    // datamedia
+    if (buf_get_u32(&b, &sdk_version)) goto err_parse;
+    if (buf_get_u32(&b, &layout_version)) goto err_parse;
+    if (buf_get_str(&b, &datamedia_source)) goto err_parse;
+    if (buf_get_str(&b, &datamedia_target)) goto err_parse;
+
+    // check if anything changed since this plan was created
+    multiboot_data->mbparts = mbparts;
+    multiboot_data->num_mbparts = num_mbparts;
+    if (bootplan_compute_key(basedir)!=hdr.key) {
+        LOGD("boot plan %s is outdated\n", planfile);
+        multiboot_data->mbparts = NULL;
+        multiboot_data->num_mbparts = 0;
+        goto err;
+    }
+
+    multiboot_data->loop_tuning = loop_tuning;
+    multiboot_data->mb_sdk_version = sdk_version;
+    multiboot_data->mb_layout_version = layout_version;
+    multiboot_data->datamedia_source = datamedia_source;
+    multiboot_data->datamedia_target = datamedia_target;
+
+    free(b.data);
+
+    LOGI("using boot plan %s\n", planfile);
+    return 0;
+
+err_parse:
+    LOGW("can't parse boot plan %s\n", planfile);
+err:
+    bootplan_free_parts(mbparts, num_mbparts);
+    free(datamedia_source);
+    free(datamedia_target);
+    free(loop_tuning.scheduler);
+    free(b.data);
+    return -1;
+}
+
+int bootplan_save(void)
+{
+    multiboot_data_t *multiboot_data = multiboot_get_data();
+    bootplan_header_t hdr;
+    bootplan_buf_t b = {0};
+    char planfile[PATH_MAX];
+    char basedir[PATH_MAX];
+    char tmpfile[PATH_MAX];
+    uint32_t i;
+    int rc;
+
+    rc = bootplan_get_paths(planfile, basedir, sizeof(planfile));
+    if (rc) {
+        return -1;
+    }
+
+    // partitions
+    buf_put_u32(&b, multiboot_data->num_mbparts);
+    for (i=0; i<multiboot_data->num_mbparts; i++) {
+        multiboot_partition_t *part = &multiboot_data->mbparts[i];
+
+        buf_put_str(&b, part->name);
+        buf_put_str(&b, part->path);
+        buf_put_u32(&b, part->type);
+        buf_put_str(&b, part->uevent_block->devname);
+        buf_put_loop_tuning(&b, &part->loop_tuning);
+    }
+    buf_put_loop_tuning(&b, &multiboot_data->loop_tuning);
+
+    // datamedia
+    buf_put_u32(&b, multiboot_data->mb_sdk_version);
+    buf_put_u32(&b, multiboot_data->mb_layout_version);
+    buf_put_str(&b, multiboot_data->datamedia_source);
+    buf_put_str(&b, multiboot_data->datamedia_target);
+
+    hdr.magic = BOOTPLAN_MAGIC;
+    hdr.version = BOOTPLAN_VERSION;
+    hdr.key = bootplan_compute_key(basedir);
+    hdr.size = b.pos;
+    hdr.crc = cksum_crc32(0, (const unsigned char *)b.data, b.pos);
+
+    // write to a temporary file first so we never leave a truncated plan behind
+    rc = snprintf(tmpfile, sizeof(tmpfile), "%s.tmp", planfile);
+    if (SNPRINTF_ERROR(rc, sizeof(tmpfile))) {
+        rc = -1;
+        goto out;
+    }
+
+    int fd = open(tmpfile, O_WRONLY|O_CREAT|O_TRUNC, 0600);
+    if (fd<0) {
+        LOGE("can't open %s: %s\n", tmpfile, strerror(errno));
+        rc = -1;
+        goto out;
+    }
+
+    if (write(fd, &hdr, sizeof(hdr))!=sizeof(hdr) || write(fd, b.data, b.pos)!=(ssize_t)b.pos) {
+        LOGE("can't write %s: %s\n", tmpfile, strerror(errno));
+        close(fd);
+        unlink(tmpfile);
+        rc = -1;
+        goto out;
+    }
+    close(fd);
+
+    rc = rename(tmpfile, planfile);
+    if (rc) {
+        LOGE("can't rename %s: %s\n", tmpfile, strerror(errno));
+        unlink(tmpfile);
+        goto out;
+    }
+
+    LOGD("saved boot plan to %s\n", planfile);
+
+out:
+    free(b.data);
+    return rc;
+}
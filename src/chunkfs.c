@@ -0,0 +1,372 @@
+/*
+ * Copyright 2016, The EFIDroid Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+#define _GNU_SOURCE
+#define FUSE_USE_VERSION 26
+
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/param.h>
+#include <linux/falloc.h>
+#include <fuse.h>
+
+#include <chunkstore.h>
+#include <util.h>
+#include <common.h>
+
+#define LOG_TAG "CHUNKFS"
+#include <lib/log.h>
+
+#define CHUNKFS_FILENAME "/loop.fs"
+// written chunks live in RAM until they're committed, so don't let them pile up
+#define CHUNKFS_MAX_DIRTY 256
+
+static struct {
+    pthread_mutex_t lock;
+    chunkstore_t store;
+
+    // written chunks, at their offset in the image
+    int overlay_fd;
+    uint8_t *dirty;
+    uint32_t num_dirty;
+
+    // the last clean chunk we read, reads are much smaller than a chunk
+    int64_t cached;
+    uint8_t *cache;
+    uint8_t *buf;
+} chunkfs = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .overlay_fd = -1,
+    .cached = -1,
+};
+
+static const uint8_t *chunkfs_clean_chunk(uint32_t index)
+{
+    if (chunkfs.cached==index)
+        return chunkfs.cache;
+
+    chunkfs.cached = -1;
+    if (chunkstore_read_chunk(&chunkfs.store, index, chunkfs.cache))
+        return NULL;
+    chunkfs.cached = index;
+
+    return chunkfs.cache;
+}
+
+// moves all written chunks into the store and replaces the manifest
+static int chunkfs_commit(void)
+{
+    uint32_t i;
+
+    if (!chunkfs.num_dirty)
+        return 0;
+
+    for (i=0; i<chunkfs.store.num_chunks; i++) {
+        size_t len = chunkstore_chunk_len(&chunkfs.store, i);
+
+        if (!chunkfs.dirty[i])
+            continue;
+
+        if (pread(chunkfs.overlay_fd, chunkfs.buf, len, (off_t)i*CHUNKSTORE_CHUNKSZ)!=(ssize_t)len) {
+            LOGE("can't read overlay: %s\n", strerror(errno));
+            return -EIO;
+        }
+
+        if (chunkstore_put_chunk(&chunkfs.store, i, chunkfs.buf))
+            return -EIO;
+    }
+
+    if (chunkstore_write_manifest(&chunkfs.store))
+        return -EIO;
+
+    // the store has them now, give the memory back
+    for (i=0; i<chunkfs.store.num_chunks; i++) {
+        if (!chunkfs.dirty[i])
+            continue;
+
+        fallocate(chunkfs.overlay_fd, FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE, (off_t)i*CHUNKSTORE_CHUNKSZ,
+                  chunkstore_chunk_len(&chunkfs.store, i));
+        chunkfs.dirty[i] = 0;
+    }
+    chunkfs.num_dirty = 0;
+
+    return 0;
+}
+
+static int chunkfs_getattr(const char *path, struct stat *st)
+{
+    memset(st, 0, sizeof(*st));
+
+    if (!strcmp(path, "/")) {
+        st->st_mode = S_IFDIR | 0755;
+        st->st_nlink = 2;
+        return 0;
+    }
+
+    if (!strcmp(path, CHUNKFS_FILENAME)) {
+        st->st_mode = S_IFREG | 0600;
+        st->st_nlink = 1;
+        st->st_size = chunkfs.store.size;
+        st->st_blocks = (chunkfs.store.size + 511) / 512;
+        return 0;
+    }
+
+    return -ENOENT;
+}
+
+static int chunkfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi)
+{
+    (void)offset;
+    (void)fi;
+
+    if (strcmp(path, "/"))
+        return -ENOENT;
+
+    filler(buf, ".", NULL, 0);
+    filler(buf, "..", NULL, 0);
+    filler(buf, CHUNKFS_FILENAME+1, NULL, 0);
+
+    return 0;
+}
+
+static int chunkfs_open(const char *path, struct fuse_file_info *fi)
+{
+    (void)fi;
+
+    if (strcmp(path, CHUNKFS_FILENAME))
+        return -ENOENT;
+
+    return 0;
+}
+
+static int chunkfs_truncate(const char *path, off_t size)
+{
+    if (strcmp(path, CHUNKFS_FILENAME))
+        return -ENOENT;
+
+    // it's a partition, the size is fixed
+    return (uint64_t)size==chunkfs.store.size ? 0 : -EPERM;
+}
+
+static int chunkfs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+{
+    uint64_t pos = offset;
+    size_t done = 0;
+    int rc = 0;
+
+    (void)path;
+    (void)fi;
+
+    if (pos>=chunkfs.store.size)
+        return 0;
+    size = MIN((uint64_t)size, chunkfs.store.size - pos);
+
+    pthread_mutex_lock(&chunkfs.lock);
+    while (done<size) {
+        uint32_t index = pos / CHUNKSTORE_CHUNKSZ;
+        size_t chunkoff = pos % CHUNKSTORE_CHUNKSZ;
+        size_t len = MIN(size - done, chunkstore_chunk_len(&chunkfs.store, index) - chunkoff);
+
+        if (chunkfs.dirty[index]) {
+            if (pread(chunkfs.overlay_fd, buf + done, len, pos)!=(ssize_t)len) {
+                LOGE("can't read overlay: %s\n", strerror(errno));
+                rc = -EIO;
+                break;
+            }
+        }
+        else {
+            const uint8_t *data = chunkfs_clean_chunk(index);
+            if (!data) {
+                rc = -EIO;
+                break;
+            }
+            memcpy(buf + done, data + chunkoff, len);
+        }
+
+        done += len;
+        pos += len;
+    }
+    pthread_mutex_unlock(&chunkfs.lock);
+
+    return rc ?: (int)done;
+}
+
+static int chunkfs_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+{
+    uint64_t pos = offset;
+    size_t done = 0;
+    int rc = 0;
+
+    (void)path;
+    (void)fi;
+
+    if (pos>=chunkfs.store.size)
+        return -ENOSPC;
+    size = MIN((uint64_t)size, chunkfs.store.size - pos);
+
+    pthread_mutex_lock(&chunkfs.lock);
+    while (done<size) {
+        uint32_t index = pos / CHUNKSTORE_CHUNKSZ;
+        size_t chunkoff = pos % CHUNKSTORE_CHUNKSZ;
+        size_t chunklen = chunkstore_chunk_len(&chunkfs.store, index);
+        size_t len = MIN(size - done, chunklen - chunkoff);
+
+        // the chunk gets materialized in the overlay on its first write
+        if (!chunkfs.dirty[index]) {
+            const uint8_t *data = chunkfs_clean_chunk(index);
+            if (!data) {
+                rc = -EIO;
+                break;
+            }
+
+            if (pwrite(chunkfs.overlay_fd, data, chunklen, (off_t)index*CHUNKSTORE_CHUNKSZ)!=(ssize_t)chunklen) {
+                LOGE("can't write overlay: %s\n", strerror(errno));
+                rc = -EIO;
+                break;
+            }
+
+            chunkfs.dirty[index] = 1;
+            chunkfs.num_dirty++;
+            chunkfs.cached = -1;
+        }
+
+        if (pwrite(chunkfs.overlay_fd, buf + done, len, pos)!=(ssize_t)len) {
+            LOGE("can't write overlay: %s\n", strerror(errno));
+            rc = -EIO;
+            break;
+        }
+
+        done += len;
+        pos += len;
+    }
+
+    if (!rc && chunkfs.num_dirty>=CHUNKFS_MAX_DIRTY)
+        rc = chunkfs_commit();
+    pthread_mutex_unlock(&chunkfs.lock);
+
+    return rc ?: (int)done;
+}
+
+// the loop driver turns flushes into fsyncs, that's when the store gets updated
+static int chunkfs_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+{
+    int rc;
+
+    (void)path;
+    (void)datasync;
+    (void)fi;
+
+    pthread_mutex_lock(&chunkfs.lock);
+    rc = chunkfs_commit();
+    pthread_mutex_unlock(&chunkfs.lock);
+
+    return rc;
+}
+
+static int chunkfs_flush(const char *path, struct fuse_file_info *fi)
+{
+    return chunkfs_fsync(path, 0, fi);
+}
+
+static void chunkfs_destroy(void *data)
+{
+    (void)data;
+
+    pthread_mutex_lock(&chunkfs.lock);
+    if (chunkfs_commit())
+        LOGE("can't commit %s, the last changes are lost\n", chunkfs.store.manifest);
+    pthread_mutex_unlock(&chunkfs.lock);
+}
+
+static struct fuse_operations chunkfs_ops = {
+    .getattr = chunkfs_getattr,
+    .readdir = chunkfs_readdir,
+    .open = chunkfs_open,
+    .truncate = chunkfs_truncate,
+    .read = chunkfs_read,
+    .write = chunkfs_write,
+    .fsync = chunkfs_fsync,
+    .flush = chunkfs_flush,
+    .destroy = chunkfs_destroy,
+};
+
+static void chunkfs_usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-o OPTIONS] IMAGE OVERLAY MOUNTPOINT\n", name);
+}
+
+int chunkfs_main(int argc, char **argv)
+{
+    const char *options = NULL;
+    char *fuse_argv[5];
+    int fuse_argc = 0;
+    int opt;
+
+    optind = 1;
+    while ((opt = getopt(argc, argv, "o:")) != -1) {
+        switch (opt) {
+            case 'o':
+                options = optarg;
+                break;
+            default:
+                chunkfs_usage(argv[0]);
+                return 1;
+        }
+    }
+
+    if (argc-optind!=3) {
+        chunkfs_usage(argv[0]);
+        return 1;
+    }
+
+    const char *image = argv[optind];
+    const char *overlay = argv[optind+1];
+    char *mountpoint = argv[optind+2];
+
+    // fail here, the daemon can't report errors anymore
+    if (chunkstore_open(&chunkfs.store, image)) {
+        LOGE("can't open the chunk store of %s\n", image);
+        return 1;
+    }
+
+    chunkfs.overlay_fd = open(overlay, O_RDWR|O_CREAT|O_TRUNC|O_CLOEXEC, 0600);
+    if (chunkfs.overlay_fd<0) {
+        LOGE("can't open %s: %s\n", overlay, strerror(errno));
+        chunkstore_close(&chunkfs.store);
+        return 1;
+    }
+
+    chunkfs.dirty = safe_calloc(chunkfs.store.num_chunks ?: 1, 1);
+    chunkfs.cache = safe_malloc(CHUNKSTORE_CHUNKSZ);
+    chunkfs.buf = safe_malloc(CHUNKSTORE_CHUNKSZ);
+
+    fuse_argv[fuse_argc++] = argv[0];
+    if (options) {
+        fuse_argv[fuse_argc++] = "-o";
+        fuse_argv[fuse_argc++] = (char *)options;
+    }
+    fuse_argv[fuse_argc++] = mountpoint;
+    fuse_argv[fuse_argc] = NULL;
+
+    return fuse_main(fuse_argc, fuse_argv, &chunkfs_ops, NULL);
+}
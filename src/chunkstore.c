@@ -0,0 +1,560 @@
+/*
+ * Copyright 2016, The EFIDroid Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/param.h>
+#include <linux/fs.h>
+
+#include <lib/cksum.h>
+#include <lib/sha256.h>
+
+#include <chunkstore.h>
+#include <util.h>
+#include <common.h>
+
+#define LOG_TAG "CHUNKSTORE"
+#include <lib/log.h>
+
+#define CHUNKSTORE_MAGIC 0x6d63626d // "mbcm"
+#define CHUNKSTORE_VERSION 1
+#define CHUNKSTORE_MANIFEST_EXT ".manifest"
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t chunk_size;
+    uint32_t num_chunks;
+    uint64_t size;
+    uint32_t crc;
+    uint32_t reserved;
+} chunkstore_header_t;
+
+static const uint8_t zero_hash[SHA256_DIGEST_SIZE] = {0};
+
+// the store lives next to the image, the manifest is partition_<name>.manifest
+static int chunkstore_get_paths(const char *image, char *storedir, char *manifest)
+{
+    char buf[PATH_MAX];
+    char *dir;
+    size_t len;
+
+    dir = util_dirname(image);
+    if (!dir)
+        return -1;
+    int rc = snprintf(storedir, PATH_MAX, "%s/"CHUNKSTORE_DIRNAME, dir);
+    free(dir);
+    if (SNPRINTF_ERROR(rc, PATH_MAX)) {
+        LOGE("snprintf error\n");
+        return -1;
+    }
+
+    SAFE_SNPRINTF_RET(LOGE, -1, buf, sizeof(buf), "%s", image);
+    len = strlen(buf);
+    if (len>4 && !strcmp(buf+len-4, ".img"))
+        buf[len-4] = '\0';
+    SAFE_SNPRINTF_RET(LOGE, -1, manifest, PATH_MAX, "%s"CHUNKSTORE_MANIFEST_EXT, buf);
+
+    return 0;
+}
+
+static int chunkstore_get_chunkpath(const char *storedir, const uint8_t *hash, char *buf, size_t bufsz, int mkdirs)
+{
+    char hex[SHA256_DIGEST_SIZE*2 + 1];
+    char dir[PATH_MAX];
+    int i;
+
+    for (i=0; i<SHA256_DIGEST_SIZE; i++) {
+        sprintf(hex + i*2, "%02x", hash[i]);
+    }
+
+    // fan out by the first byte to keep the directories small on FAT
+    SAFE_SNPRINTF_RET(LOGE, -1, dir, sizeof(dir), "%s/%.2s", storedir, hex);
+    SAFE_SNPRINTF_RET(LOGE, -1, buf, bufsz, "%s/%s", dir, hex+2);
+
+    if (mkdirs && !util_exists(dir, false)) {
+        if (mkdir(dir, 0770) && errno!=EEXIST) {
+            LOGE("can't create %s: %s\n", dir, strerror(errno));
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static int chunkstore_write_file(const char *path, const void *data, size_t size)
+{
+    char tmp[PATH_MAX];
+    int rc = -1;
+
+    // every chunkfs instance writes to the store, so the temp file has to be ours
+    SAFE_SNPRINTF_RET(LOGE, -1, tmp, sizeof(tmp), "%s.%d.tmp", path, getpid());
+
+    int fd = open(tmp, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0660);
+    if (fd<0) {
+        LOGE("can't open %s: %s\n", tmp, strerror(errno));
+        return -1;
+    }
+
+    if (write(fd, data, size)!=(ssize_t)size || fsync(fd)) {
+        LOGE("can't write %s: %s\n", tmp, strerror(errno));
+        close(fd);
+        goto out;
+    }
+    close(fd);
+
+    // the file is either complete or not there at all
+    if (rename(tmp, path)) {
+        LOGE("can't rename %s to %s: %s\n", tmp, path, strerror(errno));
+        goto out;
+    }
+
+    rc = 0;
+
+out:
+    if (rc)
+        unlink(tmp);
+    return rc;
+}
+
+static void chunkstore_init(chunkstore_t *store, uint64_t size)
+{
+    store->size = size;
+    store->num_chunks = (size + CHUNKSTORE_CHUNKSZ - 1) / CHUNKSTORE_CHUNKSZ;
+    store->hashes = safe_calloc(store->num_chunks ?: 1, SHA256_DIGEST_SIZE);
+}
+
+static int chunkstore_load(chunkstore_t *store, const char *manifest)
+{
+    chunkstore_header_t *hdr;
+    size_t size;
+
+    char *data = util_get_file_contents_ex(manifest, &size);
+    if (!data) {
+        if (errno!=ENOENT)
+            LOGE("can't read %s: %s\n", manifest, strerror(errno));
+        return -1;
+    }
+
+    hdr = (chunkstore_header_t *)data;
+    if (size<sizeof(*hdr) || hdr->magic!=CHUNKSTORE_MAGIC || hdr->version!=CHUNKSTORE_VERSION
+        || hdr->chunk_size!=CHUNKSTORE_CHUNKSZ || hdr->num_chunks!=(hdr->size + CHUNKSTORE_CHUNKSZ - 1) / CHUNKSTORE_CHUNKSZ
+        || size!=sizeof(*hdr) + (uint64_t)hdr->num_chunks*SHA256_DIGEST_SIZE
+        || cksum_crc32(0, (const unsigned char *)data + sizeof(*hdr), hdr->num_chunks*SHA256_DIGEST_SIZE)!=hdr->crc)
+    {
+        LOGE("invalid manifest %s\n", manifest);
+        free(data);
+        return -1;
+    }
+
+    chunkstore_init(store, hdr->size);
+    memcpy(store->hashes, data + sizeof(*hdr), store->num_chunks*SHA256_DIGEST_SIZE);
+    free(data);
+
+    return 0;
+}
+
+int chunkstore_enabled(const char *image)
+{
+    char storedir[PATH_MAX];
+    char manifest[PATH_MAX];
+
+    if (chunkstore_get_paths(image, storedir, manifest))
+        return 0;
+
+    return util_exists(storedir, true);
+}
+
+int chunkstore_has_manifest(const char *image)
+{
+    char storedir[PATH_MAX];
+    char manifest[PATH_MAX];
+
+    if (chunkstore_get_paths(image, storedir, manifest))
+        return 0;
+
+    return util_exists(manifest, false);
+}
+
+int chunkstore_open(chunkstore_t *store, const char *image)
+{
+    memset(store, 0, sizeof(*store));
+
+    if (chunkstore_get_paths(image, store->storedir, store->manifest))
+        return -1;
+
+    return chunkstore_load(store, store->manifest);
+}
+
+void chunkstore_close(chunkstore_t *store)
+{
+    free(store->hashes);
+    store->hashes = NULL;
+}
+
+size_t chunkstore_chunk_len(const chunkstore_t *store, uint32_t index)
+{
+    return MIN((uint64_t)CHUNKSTORE_CHUNKSZ, store->size - (uint64_t)index*CHUNKSTORE_CHUNKSZ);
+}
+
+int chunkstore_read_chunk(const chunkstore_t *store, uint32_t index, void *buf)
+{
+    const uint8_t *expected = store->hashes + index*SHA256_DIGEST_SIZE;
+    size_t len = chunkstore_chunk_len(store, index);
+    uint8_t hash[SHA256_DIGEST_SIZE];
+    char chunkpath[PATH_MAX];
+
+    if (!memcmp(expected, zero_hash, SHA256_DIGEST_SIZE)) {
+        memset(buf, 0, len);
+        return 0;
+    }
+
+    if (chunkstore_get_chunkpath(store->storedir, expected, chunkpath, sizeof(chunkpath), 0))
+        return -1;
+
+    int fd = open(chunkpath, O_RDONLY|O_CLOEXEC);
+    if (fd<0) {
+        LOGE("missing chunk %s: %s\n", chunkpath, strerror(errno));
+        return -1;
+    }
+    ssize_t nbytes = read(fd, buf, len);
+    close(fd);
+
+    // never hand out data that doesn't match the manifest
+    if (nbytes==(ssize_t)len)
+        sha256(buf, len, hash);
+    if (nbytes!=(ssize_t)len || memcmp(hash, expected, SHA256_DIGEST_SIZE)) {
+        LOGE("corrupted chunk %s\n", chunkpath);
+        errno = EIO;
+        return -1;
+    }
+
+    return 0;
+}
+
+int chunkstore_put_chunk(chunkstore_t *store, uint32_t index, const void *buf)
+{
+    uint8_t *hash = store->hashes + index*SHA256_DIGEST_SIZE;
+    size_t len = chunkstore_chunk_len(store, index);
+    char chunkpath[PATH_MAX];
+
+    // zero chunks aren't stored
+    if (util_buf_is_zero(buf, len)) {
+        memset(hash, 0, SHA256_DIGEST_SIZE);
+        return 0;
+    }
+
+    sha256(buf, len, hash);
+
+    // identical chunks of other images are already there
+    if (chunkstore_get_chunkpath(store->storedir, hash, chunkpath, sizeof(chunkpath), 1))
+        return -1;
+    if (util_exists(chunkpath, false))
+        return 0;
+
+    return chunkstore_write_file(chunkpath, buf, len);
+}
+
+int chunkstore_write_manifest(const chunkstore_t *store)
+{
+    chunkstore_header_t hdr;
+    size_t hashes_size = store->num_chunks*SHA256_DIGEST_SIZE;
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = CHUNKSTORE_MAGIC;
+    hdr.version = CHUNKSTORE_VERSION;
+    hdr.chunk_size = CHUNKSTORE_CHUNKSZ;
+    hdr.num_chunks = store->num_chunks;
+    hdr.size = store->size;
+    hdr.crc = cksum_crc32(0, store->hashes, hashes_size);
+
+    // the manifest is the header followed by one hash per chunk
+    uint8_t *buf = safe_malloc(sizeof(hdr) + hashes_size);
+    memcpy(buf, &hdr, sizeof(hdr));
+    memcpy(buf + sizeof(hdr), store->hashes, hashes_size);
+
+    int rc = chunkstore_write_file(store->manifest, buf, sizeof(hdr) + hashes_size);
+    free(buf);
+
+    return rc;
+}
+
+int chunkstore_import(const char *source, const char *image)
+{
+    chunkstore_t store;
+    struct stat sb;
+    uint64_t size;
+    uint8_t *buf = NULL;
+    uint32_t i;
+    int rc = -1;
+
+    memset(&store, 0, sizeof(store));
+    if (chunkstore_get_paths(image, store.storedir, store.manifest))
+        return -1;
+
+    int fd = open(source, O_RDONLY|O_CLOEXEC);
+    if (fd<0) {
+        LOGE("can't open %s: %s\n", source, strerror(errno));
+        return -1;
+    }
+    if (fstat(fd, &sb)) {
+        LOGE("can't stat %s: %s\n", source, strerror(errno));
+        goto out;
+    }
+
+    size = sb.st_size;
+    if (S_ISBLK(sb.st_mode) && ioctl(fd, BLKGETSIZE64, &size)) {
+        LOGE("can't get size of %s: %s\n", source, strerror(errno));
+        goto out;
+    }
+
+    chunkstore_init(&store, size);
+    buf = safe_malloc(CHUNKSTORE_CHUNKSZ);
+
+    for (i=0; i<store.num_chunks; i++) {
+        size_t len = chunkstore_chunk_len(&store, i);
+
+        ssize_t nbytes = pread(fd, buf, len, (off_t)i*CHUNKSTORE_CHUNKSZ);
+        if (nbytes!=(ssize_t)len) {
+            LOGE("can't read %s: %s\n", source, nbytes<0 ? strerror(errno) : "EOF");
+            goto out;
+        }
+
+        if (chunkstore_put_chunk(&store, i, buf))
+            goto out;
+    }
+
+    if (chunkstore_write_manifest(&store))
+        goto out;
+
+    LOGI("imported %s into %s: %u chunks\n", source, store.manifest, store.num_chunks);
+    rc = 0;
+
+out:
+    free(buf);
+    chunkstore_close(&store);
+    close(fd);
+
+    return rc;
+}
+
+int chunkstore_materialize(const char *image, const char *target)
+{
+    chunkstore_t store;
+    uint8_t *buf = NULL;
+    uint32_t i;
+    int rc = -1;
+
+    if (chunkstore_open(&store, image))
+        return -1;
+
+    int fd = open(target, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0600);
+    if (fd<0) {
+        LOGE("can't open %s: %s\n", target, strerror(errno));
+        goto out;
+    }
+
+    buf = safe_malloc(CHUNKSTORE_CHUNKSZ);
+
+    for (i=0; i<store.num_chunks; i++) {
+        size_t len = chunkstore_chunk_len(&store, i);
+
+        // zero chunks stay holes
+        if (!memcmp(store.hashes + i*SHA256_DIGEST_SIZE, zero_hash, SHA256_DIGEST_SIZE))
+            continue;
+
+        if (chunkstore_read_chunk(&store, i, buf))
+            goto out;
+
+        if (pwrite(fd, buf, len, (off_t)i*CHUNKSTORE_CHUNKSZ)!=(ssize_t)len) {
+            LOGE("can't write %s: %s\n", target, strerror(errno));
+            goto out;
+        }
+    }
+
+    if (ftruncate(fd, store.size)) {
+        LOGE("can't resize %s: %s\n", target, strerror(errno));
+        goto out;
+    }
+
+    rc = 0;
+
+out:
+    if (fd>=0)
+        close(fd);
+    if (rc && fd>=0)
+        unlink(target);
+    free(buf);
+    chunkstore_close(&store);
+
+    return rc;
+}
+
+static int hash_cmp(const void *a, const void *b)
+{
+    return memcmp(a, b, SHA256_DIGEST_SIZE);
+}
+
+static int hex_to_hash(const char *hex, uint8_t *hash)
+{
+    int i;
+
+    if (strlen(hex)!=SHA256_DIGEST_SIZE*2)
+        return -1;
+
+    for (i=0; i<SHA256_DIGEST_SIZE; i++) {
+        unsigned int byte;
+        if (sscanf(hex + i*2, "%2x", &byte)!=1)
+            return -1;
+        hash[i] = byte;
+    }
+
+    return 0;
+}
+
+// removes the chunks no manifest in 'dir' refers to anymore. must not run while chunkfs is.
+int chunkstore_gc(const char *dir)
+{
+    char storedir[PATH_MAX];
+    char path[PATH_MAX];
+    char hex[SHA256_DIGEST_SIZE*2 + 1];
+    uint8_t *refs = NULL;
+    size_t num_refs = 0;
+    uint32_t num_freed = 0;
+    struct dirent *de;
+    int rc = -1;
+
+    SAFE_SNPRINTF_RET(LOGE, -1, storedir, sizeof(storedir), "%s/"CHUNKSTORE_DIRNAME, dir);
+    if (!util_exists(storedir, true))
+        return 0;
+
+    DIR *d = opendir(dir);
+    if (!d) {
+        LOGE("can't open %s: %s\n", dir, strerror(errno));
+        return -1;
+    }
+
+    // collect every chunk that's still in use
+    while ((de = readdir(d))) {
+        chunkstore_t store;
+        size_t len = strlen(de->d_name);
+
+        if (len<=strlen(CHUNKSTORE_MANIFEST_EXT) || strcmp(de->d_name + len - strlen(CHUNKSTORE_MANIFEST_EXT), CHUNKSTORE_MANIFEST_EXT))
+            continue;
+
+        rc = snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+        if (SNPRINTF_ERROR(rc, sizeof(path))) {
+            LOGE("snprintf error\n");
+            rc = -1;
+            goto out;
+        }
+
+        // a manifest we can't read may still need its chunks
+        memset(&store, 0, sizeof(store));
+        rc = chunkstore_load(&store, path);
+        if (rc) {
+            LOGW("can't load %s, skipping garbage collection\n", path);
+            goto out;
+        }
+
+        refs = realloc(refs, (num_refs + store.num_chunks) * SHA256_DIGEST_SIZE);
+        if (!refs && num_refs + store.num_chunks) {
+            MBABORT("can't allocate chunk list\n");
+        }
+        memcpy(refs + num_refs*SHA256_DIGEST_SIZE, store.hashes, store.num_chunks*SHA256_DIGEST_SIZE);
+        num_refs += store.num_chunks;
+        chunkstore_close(&store);
+    }
+    closedir(d);
+    d = NULL;
+
+    qsort(refs, num_refs, SHA256_DIGEST_SIZE, hash_cmp);
+
+    DIR *sd = opendir(storedir);
+    if (!sd) {
+        LOGE("can't open %s: %s\n", storedir, strerror(errno));
+        rc = -1;
+        goto out;
+    }
+
+    while ((de = readdir(sd))) {
+        char subdir[PATH_MAX];
+        struct dirent *cde;
+
+        if (strlen(de->d_name)!=2)
+            continue;
+
+        rc = snprintf(subdir, sizeof(subdir), "%s/%s", storedir, de->d_name);
+        if (SNPRINTF_ERROR(rc, sizeof(subdir)))
+            continue;
+
+        DIR *cd = opendir(subdir);
+        if (!cd)
+            continue;
+
+        while ((cde = readdir(cd))) {
+            uint8_t hash[SHA256_DIGEST_SIZE];
+            size_t len = strlen(cde->d_name);
+
+            if (cde->d_name[0]=='.')
+                continue;
+
+            rc = snprintf(path, sizeof(path), "%s/%s", subdir, cde->d_name);
+            if (SNPRINTF_ERROR(rc, sizeof(path)))
+                continue;
+
+            // leftovers of an interrupted write
+            if (len>4 && !strcmp(cde->d_name + len - 4, ".tmp")) {
+                unlink(path);
+                continue;
+            }
+
+            rc = snprintf(hex, sizeof(hex), "%s%s", de->d_name, cde->d_name);
+            if (SNPRINTF_ERROR(rc, sizeof(hex)) || hex_to_hash(hex, hash))
+                continue;
+
+            if (num_refs && bsearch(hash, refs, num_refs, SHA256_DIGEST_SIZE, hash_cmp))
+                continue;
+
+            if (unlink(path)) {
+                LOGW("can't remove %s: %s\n", path, strerror(errno));
+                continue;
+            }
+            num_freed++;
+        }
+        closedir(cd);
+    }
+    closedir(sd);
+
+    if (num_freed)
+        LOGI("removed %u unused chunks from %s\n", num_freed, storedir);
+    rc = 0;
+
+out:
+    if (d)
+        closedir(d);
+    free(refs);
+
+    return rc;
+}
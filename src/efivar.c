@@ -0,0 +1,416 @@
+/*
+ * Copyright 2016, The EFIDroid Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+#include <stdio.h>
+#include <errno.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include <lib/efivars.h>
+#include <common.h>
+#include <util.h>
+
+#define LOG_TAG "EFIVAR"
+#include <lib/log.h>
+
+// no variable can be larger than the NV area
+#define EFIVAR_MAX_SIZE 0x10000
+
+typedef enum {
+    EFIVAR_OP_GET,
+    EFIVAR_OP_GETHEX,
+    EFIVAR_OP_SET,
+    EFIVAR_OP_SETHEX,
+    EFIVAR_OP_DELETE,
+} efivar_op_type_t;
+
+typedef struct {
+    efivar_op_type_t type;
+    efi_guid_t guid;
+    char *name;
+    uint8_t *data;
+    uint32_t datasize;
+} efivar_op_t;
+
+static const struct {
+    const char *name;
+    efivar_op_type_t type;
+    int has_value;
+} efivar_commands[] = {
+    {"get", EFIVAR_OP_GET, 0},
+    {"gethex", EFIVAR_OP_GETHEX, 0},
+    {"set", EFIVAR_OP_SET, 1},
+    {"sethex", EFIVAR_OP_SETHEX, 1},
+    {"delete", EFIVAR_OP_DELETE, 0},
+};
+
+static void efivar_usage(const char *progname)
+{
+    fprintf(stderr,
+            "usage: %s [-d DEVICE] [-g GUID] COMMAND [ARGS]\n"
+            "\n"
+            "commands:\n"
+            "  get NAME            print the value\n"
+            "  gethex NAME         print the value as hex\n"
+            "  set NAME VALUE      set a string, including the terminating zero\n"
+            "  sethex NAME HEX     set raw bytes\n"
+            "  delete NAME         delete the variable\n"
+            "  dump                print all variables\n"
+            "  compact             fold the update log into the image the firmware reads\n"
+            "  batch               read commands from stdin, one per line, and write\n"
+            "                      all changes at once. 'guid GUID' switches the GUID\n"
+            "                      for the following lines.\n"
+            "\n"
+            "GUID is 'efidroid' (default), 'global' or xxxxxxxx-xxxx-xxxx-xxxx-xxxxxxxxxxxx\n"
+            "DEVICE defaults to the nvvars partition of the multiboot fstab\n",
+            progname);
+}
+
+static int efivar_parse_guid(const char *str, efi_guid_t *guid)
+{
+    static const efi_guid_t guid_efidroid = EFI_EFIDROID_VARIABLE;
+    static const efi_guid_t guid_global = EFI_GLOBAL_VARIABLE;
+    unsigned int d1, d2, d3, d4[8];
+    int n = 0;
+    int i;
+
+    if (!strcmp(str, "efidroid")) {
+        *guid = guid_efidroid;
+        return 0;
+    }
+    if (!strcmp(str, "global")) {
+        *guid = guid_global;
+        return 0;
+    }
+
+    if (sscanf(str, "%8x-%4x-%4x-%2x%2x-%2x%2x%2x%2x%2x%2x%n", &d1, &d2, &d3, &d4[0], &d4[1],
+               &d4[2], &d4[3], &d4[4], &d4[5], &d4[6], &d4[7], &n)!=11 || n!=36 || str[n]) {
+        return -1;
+    }
+
+    guid->Data1 = d1;
+    guid->Data2 = d2;
+    guid->Data3 = d3;
+    for (i=0; i<8; i++)
+        guid->Data4[i] = d4[i];
+
+    return 0;
+}
+
+static int efivar_parse_hex(const char *str, uint8_t **pdata, uint32_t *pdatasize)
+{
+    size_t len = strlen(str);
+    size_t i;
+
+    if (!len || len%2 || len/2>EFIVAR_MAX_SIZE)
+        return -1;
+
+    uint8_t *data = safe_malloc(len/2);
+    for (i=0; i<len; i+=2) {
+        unsigned int byte;
+        if (!isxdigit(str[i]) || !isxdigit(str[i+1]) || sscanf(str+i, "%2x", &byte)!=1) {
+            free(data);
+            return -1;
+        }
+        data[i/2] = byte;
+    }
+
+    *pdata = data;
+    *pdatasize = len/2;
+
+    return 0;
+}
+
+static int efivar_parse_op(efivar_op_t *op, const efi_guid_t *guid, const char *cmd, const char *name, const char *value)
+{
+    uint32_t i;
+
+    memset(op, 0, sizeof(*op));
+
+    for (i=0; i<ARRAY_SIZE(efivar_commands); i++) {
+        if (!strcmp(efivar_commands[i].name, cmd))
+            break;
+    }
+    if (i==ARRAY_SIZE(efivar_commands)) {
+        fprintf(stderr, "unknown command '%s'\n", cmd);
+        return -1;
+    }
+
+    if (!name || !name[0] || (efivar_commands[i].has_value && !value) || (!efivar_commands[i].has_value && value)) {
+        fprintf(stderr, "wrong arguments for '%s'\n", cmd);
+        return -1;
+    }
+
+    op->type = efivar_commands[i].type;
+    op->guid = *guid;
+    op->name = safe_strdup(name);
+
+    if (op->type==EFIVAR_OP_SET) {
+        op->datasize = strlen(value)+1;
+        if (op->datasize>EFIVAR_MAX_SIZE) {
+            fprintf(stderr, "value of '%s' is too large\n", name);
+            return -1;
+        }
+        op->data = (uint8_t *)safe_strdup(value);
+    } else if (op->type==EFIVAR_OP_SETHEX) {
+        if (efivar_parse_hex(value, &op->data, &op->datasize)) {
+            fprintf(stderr, "invalid hex value for '%s'\n", name);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static int efivar_apply_op(const efivar_op_t *op)
+{
+    static uint8_t data[EFIVAR_MAX_SIZE];
+    uint32_t datasize = sizeof(data);
+    efi_guid_t guid = op->guid;
+    int rc;
+
+    switch (op->type) {
+        case EFIVAR_OP_GET:
+        case EFIVAR_OP_GETHEX:
+            rc = efivar_get(op->name, &guid, NULL, &datasize, data);
+            if (rc) break;
+            efivar_print_value(data, datasize, op->type==EFIVAR_OP_GETHEX, 0);
+            putchar('\n');
+            break;
+
+        case EFIVAR_OP_SET:
+        case EFIVAR_OP_SETHEX:
+            rc = efivar_set(op->name, &guid, EFI_VARIABLE_DEFAULT_ATTRIBUTES, op->datasize, op->data);
+            break;
+
+        case EFIVAR_OP_DELETE:
+            rc = efivar_set(op->name, &guid, 0, 0, NULL);
+            break;
+
+        default:
+            rc = -EINVAL;
+    }
+
+    if (rc) {
+        fprintf(stderr, "can't access '%s': %s\n", op->name, strerror(rc<0 ? -rc : rc));
+    }
+
+    return rc;
+}
+
+static int efivar_is_write_op(const efivar_op_t *op)
+{
+    return op->type==EFIVAR_OP_SET || op->type==EFIVAR_OP_SETHEX || op->type==EFIVAR_OP_DELETE;
+}
+
+// the firmware only reads the compacted image
+static int efivar_write(void)
+{
+    int rc = efivar_compact();
+    if (rc) {
+        fprintf(stderr, "can't write variables: %s\n", strerror(rc<0 ? -rc : rc));
+    }
+
+    return rc;
+}
+
+static void efivar_free_op(efivar_op_t *op)
+{
+    free(op->name);
+    free(op->data);
+}
+
+// everything gets parsed first, so a bad line doesn't leave half of the changes behind
+static int efivar_batch(const efi_guid_t *default_guid)
+{
+    efi_guid_t guid = *default_guid;
+    efivar_op_t *ops = NULL;
+    size_t num_ops = 0;
+    char *line = NULL;
+    size_t linesize = 0;
+    ssize_t len;
+    int lineno = 0;
+    int writes = 0;
+    int rc = 0;
+    size_t i;
+
+    while ((len = getline(&line, &linesize, stdin))>=0) {
+        lineno++;
+
+        if (len && line[len-1]=='\n')
+            line[--len] = 0;
+
+        // command, name and everything else as the value
+        char *cmd = line + strspn(line, " \t");
+        if (!cmd[0] || cmd[0]=='#')
+            continue;
+
+        char *name = cmd + strcspn(cmd, " \t");
+        if (*name) *name++ = 0;
+        name += strspn(name, " \t");
+
+        char *value = name + strcspn(name, " \t");
+        if (*value) *value++ = 0;
+        value += strspn(value, " \t");
+
+        if (!strcmp(cmd, "guid")) {
+            if (*value || efivar_parse_guid(name, &guid)) {
+                fprintf(stderr, "line %d: invalid GUID\n", lineno);
+                rc = -1;
+                break;
+            }
+            continue;
+        }
+
+        efivar_op_t *newops = realloc(ops, (num_ops+1)*sizeof(*ops));
+        if (!newops) {
+            fprintf(stderr, "can't allocate memory\n");
+            rc = -1;
+            break;
+        }
+        ops = newops;
+
+        if (efivar_parse_op(&ops[num_ops], &guid, cmd, name, *value ? value : NULL)) {
+            fprintf(stderr, "line %d: invalid command\n", lineno);
+            efivar_free_op(&ops[num_ops]);
+            rc = -1;
+            break;
+        }
+        num_ops++;
+    }
+    free(line);
+
+    // one read of the NV area for all commands. a failing command, e.g. a
+    // get of a missing variable, doesn't stop the others.
+    if (!rc) {
+        for (i=0; i<num_ops; i++) {
+            if (efivar_apply_op(&ops[i]))
+                rc = -1;
+            writes |= efivar_is_write_op(&ops[i]);
+        }
+
+        // and one write
+        if (writes && efivar_write())
+            rc = -1;
+    }
+
+    for (i=0; i<num_ops; i++) {
+        efivar_free_op(&ops[i]);
+    }
+    free(ops);
+
+    return rc;
+}
+
+// the library looks the partition up in the multiboot fstab and the block devices
+static int efivar_find_nvvars(void)
+{
+    multiboot_data_t *multiboot_data = multiboot_get_data();
+
+    if (!state_restore())
+        return 0;
+
+    // recovery doesn't save a state, but it has the fstab and the same block devices
+    multiboot_data->mbfstab = fs_mgr_read_fstab(MBPATH_FSTAB);
+    if (!multiboot_data->mbfstab)
+        return -1;
+
+    multiboot_data->blockinfo = get_block_devices();
+    if (!multiboot_data->blockinfo)
+        return -1;
+
+    return 0;
+}
+
+int efivar_main(int argc, char **argv)
+{
+    efi_guid_t guid = EFI_EFIDROID_VARIABLE;
+    const char *device = NULL;
+    const char *cmd;
+    efivar_op_t op;
+    int opt;
+    int rc;
+
+    while ((opt = getopt(argc, argv, "d:g:h")) != -1) {
+        switch (opt) {
+            case 'd':
+                device = optarg;
+                break;
+
+            case 'g':
+                if (efivar_parse_guid(optarg, &guid)) {
+                    fprintf(stderr, "invalid GUID '%s'\n", optarg);
+                    return 1;
+                }
+                break;
+
+            default:
+                efivar_usage(argv[0]);
+                return 1;
+        }
+    }
+
+    if (optind>=argc) {
+        efivar_usage(argv[0]);
+        return 1;
+    }
+    cmd = argv[optind++];
+
+    // without a device we need the multiboot fstab of this boot
+    if (device) {
+        if (efivar_set_device(device)) {
+            fprintf(stderr, "can't use %s\n", device);
+            return 1;
+        }
+    } else if (efivar_find_nvvars()) {
+        fprintf(stderr, "can't find the nvvars partition, use -d\n");
+        return 1;
+    }
+
+    // read-only commands must not change the area, e.g. by preparing the error slot
+    if (efivar_load()) {
+        fprintf(stderr, "can't load variables\n");
+        return 1;
+    }
+
+    if (!strcmp(cmd, "dump")) {
+        return efivar_dump() ? 1 : 0;
+    } else if (!strcmp(cmd, "compact")) {
+        return efivar_compact() ? 1 : 0;
+    } else if (!strcmp(cmd, "batch")) {
+        return efivar_batch(&guid) ? 1 : 0;
+    }
+
+    if (argc-optind<1 || argc-optind>2) {
+        efivar_usage(argv[0]);
+        return 1;
+    }
+
+    if (efivar_parse_op(&op, &guid, cmd, argv[optind], argc-optind>1 ? argv[optind+1] : NULL)) {
+        efivar_free_op(&op);
+        return 1;
+    }
+
+    rc = efivar_apply_op(&op);
+    if (!rc && efivar_is_write_op(&op))
+        rc = efivar_write();
+    efivar_free_op(&op);
+
+    return rc ? 1 : 0;
+}
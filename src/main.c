@@ -20,19 +20,56 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <sys/inotify.h>
 
 #include <util.h>
 #include <common.h>
+#include <chunkstore.h>
 
 #define LOG_TAG "MAIN"
 #include <lib/log.h>
 
 #include <lib/dynfilefs.h>
 
+static void trigger_signal_done(void)
+{
+    // tell init to continue (it waits for this file)
+    int fd = open(MBPATH_TRIGGER_WAIT_FILE, O_RDWR|O_CREAT, 0600);
+    if (fd>=0) close(fd);
+}
+
+// returns 1 if there was a command
+static int trigger_run_cmdfile(int *plast)
+{
+    // get command
+    char *cmd = util_get_file_contents(MBPATH_TRIGGER_CMD);
+    if (!cmd) {
+        return 0;
+    }
+    unlink(MBPATH_TRIGGER_CMD);
+
+    // run trigger handler
+    handle_trigger(cmd);
+
+    // post-fs-data is the last trigger during boot
+    *plast = !strcmp(cmd, "post-fs-data");
+
+    // cleanup
+    free(cmd);
+
+    trigger_signal_done();
+
+    return 1;
+}
+
 static int trigger_main(void)
 {
     int rc;
-    int fd;
+    int last = 0;
+    char buf[sizeof(struct inotify_event) + NAME_MAX + 1] __attribute__((aligned(__alignof__(struct inotify_event))));
+    const char *cmdname = util_basename(MBPATH_TRIGGER_CMD);
 
     // init logging
     log_init();
@@ -41,29 +78,82 @@ static int trigger_main(void)
     rc = state_restore();
     if (rc) {
         LOGE("can't restore state\n");
-        goto done;
+        trigger_signal_done();
+        return rc;
     }
 
-    // get command
-    char *cmd = util_get_file_contents(MBPATH_TRIGGER_CMD);
-    unlink(MBPATH_TRIGGER_CMD);
-    if (!cmd) {
+    // so fatal errors can be reported
+    if (efivar_init()) {
+        LOGW("Can't load NV variables\n");
+    }
+
+    // init writes the next command to the same file and then runs 'start mbtrigger',
+    // which does nothing while we're still running. so stay around and watch for it,
+    // that keeps the state restored and saves a process launch per trigger.
+    int ifd = inotify_init1(IN_CLOEXEC);
+    if (ifd>=0 && inotify_add_watch(ifd, MBPATH_ROOT, IN_CLOSE_WRITE|IN_MOVED_TO)<0) {
+        close(ifd);
+        ifd = -1;
+    }
+    if (ifd<0) {
+        LOGW("can't watch for trigger commands: %s\n", strerror(errno));
+    }
+
+    // the command which started us
+    if (!trigger_run_cmdfile(&last)) {
         LOGE("can't read trigger command\n");
-        goto done;
+        trigger_signal_done();
     }
 
-    // run trigger handler
-    rc = handle_trigger(cmd);
+    // init will start us again if we're not there anymore
+    while (ifd>=0 && !last) {
+        ssize_t len = read(ifd, buf, sizeof(buf));
+        if (len<0 && errno==EINTR)
+            continue;
+        if (len<=0)
+            break;
+
+        ssize_t pos;
+        for (pos=0; pos<len; ) {
+            struct inotify_event *event = (struct inotify_event *)(buf + pos);
+            pos += sizeof(*event) + event->len;
+
+            if (event->len && !strcmp(event->name, cmdname))
+                trigger_run_cmdfile(&last);
+        }
+    }
 
-    // cleanup
-    free(cmd);
+    if (ifd>=0)
+        close(ifd);
+    free((void *)cmdname);
 
-done:
-    // tell init to continue (it waits for this file)
-    fd = open(MBPATH_TRIGGER_WAIT_FILE, O_RDWR|O_CREAT);
-    if (fd) close(fd);
+    return 0;
+}
+
+static int resparsify_main(int argc, char **argv)
+{
+    int i;
+    int ret = 0;
+
+    if (argc<2) {
+        fprintf(stderr, "usage: %s FILE...\n", argv[0]);
+        return 1;
+    }
 
-    return rc;
+    for (i=1; i<argc; i++) {
+        uint64_t freed = 0;
+
+        int rc = util_resparsify(argv[i], &freed);
+        if (rc) {
+            fprintf(stderr, "can't resparsify %s: %s\n", argv[i], strerror(-rc));
+            ret = 1;
+            continue;
+        }
+
+        printf("%s: freed %"PRIu64" KiB\n", argv[i], freed/1024);
+    }
+
+    return ret;
 }
 
 int main(int argc, char **argv)
@@ -86,6 +176,13 @@ int main(int argc, char **argv)
             } else if (!strcmp(argv[1], "dynfilefs")) {
                 log_init();
                 return dynfilefs_main(argc-1, argv+1);
+            } else if (!strcmp(argv[1], "chunkfs")) {
+                log_init();
+                return chunkfs_main(argc-1, argv+1);
+            } else if (!strcmp(argv[1], "resparsify")) {
+                return resparsify_main(argc-1, argv+1);
+            } else if (!strcmp(argv[1], "efivar")) {
+                return efivar_main(argc-1, argv+1);
             }
         } else {
             multiboot_main(argc, argv);
@@ -99,6 +196,12 @@ int main(int argc, char **argv)
         return busybox_main(argc, argv);
     } else if (!strcmp(progname, "dynfilefs")) {
         return dynfilefs_main(argc, argv);
+    } else if (!strcmp(progname, "chunkfs")) {
+        return chunkfs_main(argc, argv);
+    } else if (!strcmp(progname, "resparsify")) {
+        return resparsify_main(argc, argv);
+    } else if (!strcmp(progname, "efivar")) {
+        return efivar_main(argc, argv);
     }
 
     fprintf(stderr, "invalid arguments\n");
@@ -23,6 +23,8 @@
 #include <unistd.h>
 #include <ctype.h>
 #include <inttypes.h>
+#include <pthread.h>
+#include <dirent.h>
 #include <sys/mount.h>
 #include <sys/wait.h>
 #include <sys/poll.h>
@@ -30,6 +32,7 @@
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/param.h>
+#include <sys/uio.h>
 #include <linux/netlink.h>
 
 #include <lib/cmdline.h>
@@ -38,12 +41,14 @@
 #include <lib/sefbinparser.h>
 #include <lib/sefsrcparser.h>
 #include <lib/dmcrypt.h>
+#include <lib/sha256.h>
 #include <blkid/blkid.h>
 #include <ini.h>
 #include <sepolicy_inject.h>
 
 #include <util.h>
 #include <common.h>
+#include <chunkstore.h>
 
 #define LOG_TAG "INIT"
 #include <lib/log.h>
@@ -51,6 +56,9 @@
 PAYLOAD_IMPORT(file_contexts);
 PAYLOAD_IMPORT(file_contexts_bin);
 static multiboot_data_t multiboot_data = {0};
+static int bootplan_dirty = 0;
+// merged file_contexts.bin, used to label our nodes
+static sefbin_file_t *dev_contexts = NULL;
 
 multiboot_data_t *multiboot_get_data(void)
 {
@@ -222,6 +230,9 @@ int run_init(int trace)
     // cancel watchdog timer
     alarm(0);
 
+    // exec doesn't run atexit handlers, and the firmware only reads the compacted image
+    efivar_compact();
+
     // build args
     par[i++] = "/init";
     par[i++] = (char *)0;
@@ -246,6 +257,419 @@ int run_init(int trace)
     return 0;
 }
 
+static void add_dev_node(char ***pnodes, size_t *pnum, const char *name)
+{
+    *pnodes = realloc(*pnodes, (*pnum + 1) * sizeof(**pnodes));
+    if (!*pnodes) {
+        MBABORT("Can't allocate node list\n");
+    }
+
+    (*pnodes)[(*pnum)++] = safe_strdup(name);
+}
+
+// lists the nodes in MBPATH_DEV as /dev paths
+static char **get_multiboot_dev_nodes(size_t *pnum)
+{
+    static const char *dirs[] = {"", "/block"};
+    char buf[PATH_MAX];
+    char **nodes = NULL;
+    uint32_t i;
+
+    *pnum = 0;
+    for (i=0; i<ARRAY_SIZE(dirs); i++) {
+        SAFE_SNPRINTF_RET(LOGE, nodes, buf, sizeof(buf), "/dev%s", dirs[i]);
+        add_dev_node(&nodes, pnum, buf);
+
+        SAFE_SNPRINTF_RET(LOGE, nodes, buf, sizeof(buf), MBPATH_DEV"%s", dirs[i]);
+        DIR *d = opendir(buf);
+        if (!d) continue;
+
+        struct dirent *dt;
+        while ((dt = readdir(d))) {
+            if (!strcmp(dt->d_name, ".") || !strcmp(dt->d_name, ".."))
+                continue;
+
+            SAFE_SNPRINTF_RET(LOGE, nodes, buf, sizeof(buf), "/dev%s/%s", dirs[i], dt->d_name);
+            add_dev_node(&nodes, pnum, buf);
+        }
+        closedir(d);
+    }
+
+    return nodes;
+}
+
+typedef struct {
+    const char *source;
+    const char *target;
+    const char *cls;
+    const char *perms;
+} sepolicy_rule_t;
+
+// init_multiboot is free to do anything it wants :)
+// also, this has to be first so our context gets created
+#define SEPOLICY_PERMISSIVE_TYPE "init_multiboot"
+
+static const sepolicy_rule_t sepolicy_rules[] = {
+    // for some reason our binary needs execmem
+    {"init", "init", "process", "execmem"},
+    {"kernel", "kernel", "process", "execmem"},
+
+    // init has to change our label
+    {"init", "init_multiboot", "file", "relabelto"},
+
+    // init wants to exec /file_contexts for some reason
+    {"kernel", "rootfs", "file", "execute"},
+
+    // init seems to use logging after giving us our context
+    {"logd", "init_multiboot", "dir", "search"},
+    {"logd", "init_multiboot", "file", "read,open,getattr"},
+
+    // for our restorecon injections
+    {"init", "rootfs", "dir", "relabelto"},
+    {"init", "tmpfs", "chr_file", "relabelfrom"},
+    {"init", "tmpfs", "blk_file", "getattr,relabelfrom"},
+    {"init", "null_device", "chr_file", "relabelto"},
+    {"init", "zero_device", "chr_file", "relabelto"},
+    {"init", "block_device", "blk_file", "relabelto"},
+    {"init", "block_device", "dir", "relabelto"},
+    {"init", "device", "dir", "relabelto"},
+
+    // let init run our trigger
+    {"init", "rootfs", "file", "create,write,unlink"},
+    {"init", "init_multiboot", "file", "getattr,execute,read,open"},
+    {"init", "init_multiboot", "process", "transition,rlimitinh,siginh,noatsecure"},
+    {"rootfs", "tmpfs", "filesystem", "associate"},
+
+    // we still try to solve all the denials to keep dmesg clean
+    {"init_multiboot", "rootfs", "filesystem", "associate"},
+    {"init_multiboot", "rootfs", "file", "read,open,getattr,unlink,create,write,entrypoint"},
+    {"init_multiboot", "rootfs", "dir", "write,remove_name,add_name"},
+    {"init_multiboot", "device", "chr_file", "create,write,open,unlink"},
+    {"init_multiboot", "device", "dir", "write,add_name,remove_name"},
+    {"init_multiboot", "device", "blk_file", "create"},
+    {"init_multiboot", "tmpfs", "file", "read,open,create,write"},
+    {"init_multiboot", "tmpfs", "dir", "getattr,mounton,write,remove_name,add_name"},
+    {"init_multiboot", "tmpfs", "blk_file", "getattr,create,read,open,ioctl,write"},
+    {"init_multiboot", "init", "dir", "search"},
+    {"init_multiboot", "init", "file", "read,open,getattr"},
+    {"init_multiboot", "init", "process", "sigchld"},
+    {"init_multiboot", "init_tmpfs", "file", "read,open,getattr,unlink"},
+    {"init_multiboot", "init_multiboot", "process", "fork,sigchld"},
+    {"init_multiboot", "init_multiboot", "capability", "dac_override,mknod"},
+    {"init_multiboot", "init_multiboot", "file", "entrypoint"},
+    {"init_multiboot", "init_multiboot", "dir", "search"},
+    {"init_multiboot", "init_multiboot", "lnk_file", "read"},
+    {"init_multiboot", "media_rw_data_file", "dir", "search"},
+    {"init_multiboot", "media_rw_data_file", "file", "read,open,write"},
+    {"init_multiboot", "boot_block_device", "blk_file", "getattr,unlink"},
+    {"init_multiboot", "recovery_block_device", "blk_file", "getattr,unlink"},
+    {"init_multiboot", "cache_block_device", "blk_file", "getattr,unlink"},
+    {"init_multiboot", "userdata_block_device", "blk_file", "getattr,unlink"},
+    {"init_multiboot", "block_device", "blk_file", "read,open,ioctl,write,getattr,create,unlink"},
+    {"init_multiboot", "block_device", "dir", "write,remove_name,add_name"},
+    {"init_multiboot", "debugfs", "dir", "search"},
+    {"init_multiboot", "init", "fd", "use"},
+    {"init_multiboot", "null_device", "chr_file", "read,write"},
+    {"init_multiboot", "properties_device", "file", "read"},
+    {"init_multiboot", "proc", "dir", "search"},
+    {"init_multiboot", "proc", "lnk_file", "read"},
+
+    // relabel rules for /multiboot/dev
+    {"init", "ram_device", "blk_file", "relabelto"},
+    {"init", "loop_device", "blk_file", "relabelto"},
+    {"init", "swap_block_device", "blk_file", "relabelto"},
+    {"init", "sd_device", "blk_file", "relabelto"},
+    {"init", "dm_device", "chr_file", "relabelto"},
+    {"init", "frp_block_device", "blk_file", "relabelto"},
+    {"init", "oem_block_device", "blk_file", "relabelto"},
+    {"init", "root_block_device", "blk_file", "relabelto"},
+    {"init", "rpmb_device", "blk_file", "relabelto"},
+
+    // the kernel thread for loop images is checked by selinux too
+    {"kernel", "unlabeled", "file", "read"},
+    {"kernel", "media_rw_data_file", "file", "read"},
+};
+
+static const sepolicy_rule_t sepolicy_rules_multiboot[] = {
+    // this is for the datamedia bind-mount
+    {"init", "media_rw_data_file", "dir", "mounton"},
+};
+
+#define SEPOLICY_CACHE_MAGIC 0x7073626d // "mbsp"
+#define SEPOLICY_CACHE_FILENAME "sepolicy.cache"
+
+typedef struct {
+    uint32_t magic;
+    uint32_t size;
+    uint8_t key[SHA256_DIGEST_SIZE];
+    uint8_t digest[SHA256_DIGEST_SIZE];
+} sepolicy_cache_hdr_t;
+
+static void sepolicy_hash_rules(sha256_ctx_t *ctx, const sepolicy_rule_t *rules, size_t num_rules)
+{
+    size_t i;
+
+    for (i=0; i<num_rules; i++) {
+        sha256_update(ctx, rules[i].source, strlen(rules[i].source)+1);
+        sha256_update(ctx, rules[i].target, strlen(rules[i].target)+1);
+        sha256_update(ctx, rules[i].cls, strlen(rules[i].cls)+1);
+        sha256_update(ctx, rules[i].perms, strlen(rules[i].perms)+1);
+    }
+}
+
+// the patched policy only depends on the source policy and the rules we inject
+static void sepolicy_compute_key(const void *policy, size_t size, uint8_t key[SHA256_DIGEST_SIZE])
+{
+    sha256_ctx_t ctx;
+    uint32_t is_multiboot = !!multiboot_data.is_multiboot;
+
+    sha256_init(&ctx);
+    sha256_update(&ctx, policy, size);
+    sha256_update(&ctx, SEPOLICY_PERMISSIVE_TYPE, sizeof(SEPOLICY_PERMISSIVE_TYPE));
+    sepolicy_hash_rules(&ctx, sepolicy_rules, ARRAY_SIZE(sepolicy_rules));
+    sha256_update(&ctx, &is_multiboot, sizeof(is_multiboot));
+    if (is_multiboot)
+        sepolicy_hash_rules(&ctx, sepolicy_rules_multiboot, ARRAY_SIZE(sepolicy_rules_multiboot));
+    sha256_final(&ctx, key);
+}
+
+// returns 0 if /sepolicy got replaced with the cached policy
+static int sepolicy_cache_load(const char *cachefile, const uint8_t key[SHA256_DIGEST_SIZE])
+{
+    int rc = -1;
+    size_t size;
+    uint8_t digest[SHA256_DIGEST_SIZE];
+
+    char *data = util_get_file_contents_ex(cachefile, &size);
+    if (!data)
+        return -1;
+
+    sepolicy_cache_hdr_t *hdr = (sepolicy_cache_hdr_t *)data;
+    if (size<sizeof(*hdr) || hdr->magic!=SEPOLICY_CACHE_MAGIC || hdr->size!=size-sizeof(*hdr)
+        || memcmp(hdr->key, key, SHA256_DIGEST_SIZE))
+    {
+        goto out;
+    }
+
+    sha256(data + sizeof(*hdr), hdr->size, digest);
+    if (memcmp(hdr->digest, digest, SHA256_DIGEST_SIZE)) {
+        LOGE("cached sepolicy is corrupted\n");
+        goto out;
+    }
+
+    // a partial write would leave us without a usable policy
+    int fd = open("/sepolicy.tmp", O_WRONLY|O_CREAT|O_TRUNC, 0644);
+    if (fd<0) {
+        LOGE("can't open /sepolicy.tmp: %s\n", strerror(errno));
+        goto out;
+    }
+
+    if (write(fd, data + sizeof(*hdr), hdr->size)!=(ssize_t)hdr->size) {
+        LOGE("can't write /sepolicy.tmp: %s\n", strerror(errno));
+        close(fd);
+        unlink("/sepolicy.tmp");
+        goto out;
+    }
+    close(fd);
+
+    rc = rename("/sepolicy.tmp", "/sepolicy");
+    if (rc) {
+        LOGE("can't rename /sepolicy.tmp: %s\n", strerror(errno));
+        unlink("/sepolicy.tmp");
+    }
+
+out:
+    free(data);
+    return rc;
+}
+
+static int sepolicy_cache_store(const char *cachefile, const uint8_t key[SHA256_DIGEST_SIZE],
+                                const uint8_t srcdigest[SHA256_DIGEST_SIZE])
+{
+    int rc;
+    char tmpfile[PATH_MAX];
+    sepolicy_cache_hdr_t hdr;
+    size_t size;
+
+    char *data = util_get_file_contents_ex("/sepolicy", &size);
+    if (!data)
+        return -1;
+
+    hdr.magic = SEPOLICY_CACHE_MAGIC;
+    hdr.size = size;
+    memcpy(hdr.key, key, SHA256_DIGEST_SIZE);
+    sha256(data, size, hdr.digest);
+
+    // caching the unpatched policy would skip patching on every following boot
+    if (!memcmp(hdr.digest, srcdigest, SHA256_DIGEST_SIZE)) {
+        LOGW("sepolicy didn't change, not caching it\n");
+        rc = -1;
+        goto out;
+    }
+
+    rc = snprintf(tmpfile, sizeof(tmpfile), "%s.tmp", cachefile);
+    if (SNPRINTF_ERROR(rc, sizeof(tmpfile))) {
+        rc = -1;
+        goto out;
+    }
+
+    int fd = open(tmpfile, O_WRONLY|O_CREAT|O_TRUNC, 0600);
+    if (fd<0) {
+        LOGE("can't open %s: %s\n", tmpfile, strerror(errno));
+        rc = -1;
+        goto out;
+    }
+
+    struct iovec iov[2] = {
+        {.iov_base = &hdr, .iov_len = sizeof(hdr)},
+        {.iov_base = data, .iov_len = size},
+    };
+    if (writev(fd, iov, ARRAY_SIZE(iov))!=(ssize_t)(sizeof(hdr)+size)) {
+        LOGE("can't write %s: %s\n", tmpfile, strerror(errno));
+        close(fd);
+        unlink(tmpfile);
+        rc = -1;
+        goto out;
+    }
+    close(fd);
+
+    rc = rename(tmpfile, cachefile);
+    if (rc) {
+        LOGE("can't rename %s: %s\n", tmpfile, strerror(errno));
+        unlink(tmpfile);
+    }
+
+out:
+    free(data);
+    return rc;
+}
+
+static int sepolicy_patch(void)
+{
+    int rc;
+    size_t i;
+
+    void *handle = sepolicy_inject_open("/sepolicy");
+    if (!handle)
+        return -1;
+
+    sepolicy_inject_set_permissive(handle, SEPOLICY_PERMISSIVE_TYPE, 1);
+
+    for (i=0; i<ARRAY_SIZE(sepolicy_rules); i++) {
+        const sepolicy_rule_t *rule = &sepolicy_rules[i];
+        sepolicy_inject_add_rule(handle, rule->source, rule->target, rule->cls, rule->perms);
+    }
+
+    if (multiboot_data.is_multiboot) {
+        for (i=0; i<ARRAY_SIZE(sepolicy_rules_multiboot); i++) {
+            const sepolicy_rule_t *rule = &sepolicy_rules_multiboot[i];
+            sepolicy_inject_add_rule(handle, rule->source, rule->target, rule->cls, rule->perms);
+        }
+    }
+
+    // write new policy
+    rc = sepolicy_inject_write(handle, "/sepolicy");
+    if (rc) {
+        LOGE("can't write patched sepolicy\n");
+    }
+    sepolicy_inject_close(handle);
+
+    return rc;
+}
+
+// patches /sepolicy, or uses the result of a previous boot if nothing changed
+// the cache lives in espdir, so the ESP has to be mounted already
+static void sepolicy_patch_cached(const char *espdir)
+{
+    char cachefile[PATH_MAX];
+    uint8_t key[SHA256_DIGEST_SIZE];
+    uint8_t srcdigest[SHA256_DIGEST_SIZE];
+    size_t size;
+    int rc;
+
+    char *policy = util_get_file_contents_ex("/sepolicy", &size);
+    if (!policy)
+        return;
+    sepolicy_compute_key(policy, size, key);
+    sha256(policy, size, srcdigest);
+    free(policy);
+
+    rc = snprintf(cachefile, sizeof(cachefile), "%s/"SEPOLICY_CACHE_FILENAME, espdir);
+    if (SNPRINTF_ERROR(rc, sizeof(cachefile))) {
+        sepolicy_patch();
+        return;
+    }
+
+    if (sepolicy_cache_load(cachefile, key)==0) {
+        LOGD("using cached sepolicy\n");
+    }
+    else if (sepolicy_patch()==0) {
+        sepolicy_cache_store(cachefile, key, srcdigest);
+    }
+}
+
+// resolves the labels of all nodes in MBPATH_DEV so the trigger can apply them
+static int selinux_resolve_dev_labels(void)
+{
+    int rc = 0;
+    char buf[PATH_MAX];
+    char *labels = NULL;
+    size_t labels_len = 0;
+    size_t num_nodes;
+    size_t i;
+
+    if (!dev_contexts)
+        return 0;
+
+    char **nodes = get_multiboot_dev_nodes(&num_nodes);
+    for (i=0; i<num_nodes; i++) {
+        struct stat sb;
+
+        // a node we can't label isn't worth failing the others for
+        int n = snprintf(buf, sizeof(buf), MBPATH_ROOT"%s", nodes[i]);
+        if (SNPRINTF_ERROR(n, sizeof(buf))) {
+            LOGE("snprintf error\n");
+            continue;
+        }
+        if (lstat(buf, &sb))
+            continue;
+
+        const char *context = sefbin_lookup(dev_contexts, nodes[i], sb.st_mode);
+        if (!context)
+            continue;
+
+        size_t len = strlen(buf) + 1 + strlen(context) + 1;
+        labels = realloc(labels, labels_len + len + 1);
+        if (!labels) {
+            MBABORT("Can't allocate label list\n");
+        }
+        labels_len += sprintf(labels + labels_len, "%s\t%s\n", buf, context);
+    }
+
+    for (i=0; i<num_nodes; i++) {
+        free(nodes[i]);
+    }
+    free(nodes);
+
+    int fd = open(MBPATH_DEV_LABELS, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0600);
+    if (fd<0) {
+        LOGE("Can't open %s: %s\n", MBPATH_DEV_LABELS, strerror(errno));
+        rc = -1;
+        goto out;
+    }
+
+    if (labels_len && write(fd, labels, labels_len)!=(ssize_t)labels_len) {
+        LOGE("Can't write %s: %s\n", MBPATH_DEV_LABELS, strerror(errno));
+        rc = -1;
+    }
+    close(fd);
+
+out:
+    free(labels);
+
+    return rc;
+}
+
 static int selinux_fixup(void)
 {
     int rc = 0;
@@ -265,100 +689,7 @@ static int selinux_fixup(void)
         return 0;
     }
 
-    void *handle = sepolicy_inject_open("/sepolicy");
-    if (handle) {
-        // init_multiboot is free to do anything it wants :)
-        // also, this has to be first so our context gets created
-        sepolicy_inject_set_permissive(handle, "init_multiboot", 1);
-
-        // for some reason our binary needs execmem
-        sepolicy_inject_add_rule(handle, "init", "init", "process", "execmem");
-        sepolicy_inject_add_rule(handle, "kernel", "kernel", "process", "execmem");
-
-        // init has to change our label
-        sepolicy_inject_add_rule(handle, "init", "init_multiboot", "file", "relabelto");
-
-        // init wants to exec /file_contexts for some reason
-        sepolicy_inject_add_rule(handle, "kernel", "rootfs", "file", "execute");
-
-        // init seems to use logging after giving us our context
-        sepolicy_inject_add_rule(handle, "logd", "init_multiboot", "dir", "search");
-        sepolicy_inject_add_rule(handle, "logd", "init_multiboot", "file", "read,open,getattr");
-
-        // for our restorecon injections
-        sepolicy_inject_add_rule(handle, "init", "rootfs", "dir", "relabelto");
-        sepolicy_inject_add_rule(handle, "init", "tmpfs", "chr_file", "relabelfrom");
-        sepolicy_inject_add_rule(handle, "init", "tmpfs", "blk_file", "getattr,relabelfrom");
-        sepolicy_inject_add_rule(handle, "init", "null_device", "chr_file", "relabelto");
-        sepolicy_inject_add_rule(handle, "init", "zero_device", "chr_file", "relabelto");
-        sepolicy_inject_add_rule(handle, "init", "block_device", "blk_file", "relabelto");
-        sepolicy_inject_add_rule(handle, "init", "block_device", "dir", "relabelto");
-        sepolicy_inject_add_rule(handle, "init", "device", "dir", "relabelto");
-
-        // let init run our trigger
-        sepolicy_inject_add_rule(handle, "init", "rootfs", "file", "create,write,unlink");
-        sepolicy_inject_add_rule(handle, "init", "init_multiboot", "file", "getattr,execute,read,open");
-        sepolicy_inject_add_rule(handle, "init", "init_multiboot", "process", "transition,rlimitinh,siginh,noatsecure");
-        sepolicy_inject_add_rule(handle, "rootfs", "tmpfs", "filesystem", "associate");
-
-        // we still try to solve all the denials to keep dmesg clean
-        sepolicy_inject_add_rule(handle, "init_multiboot", "rootfs", "filesystem", "associate");
-        sepolicy_inject_add_rule(handle, "init_multiboot", "rootfs", "file", "read,open,getattr,unlink,create,write,entrypoint");
-        sepolicy_inject_add_rule(handle, "init_multiboot", "rootfs", "dir", "write,remove_name,add_name");
-        sepolicy_inject_add_rule(handle, "init_multiboot", "device", "chr_file", "create,write,open,unlink");
-        sepolicy_inject_add_rule(handle, "init_multiboot", "device", "dir", "write,add_name,remove_name");
-        sepolicy_inject_add_rule(handle, "init_multiboot", "device", "blk_file", "create");
-        sepolicy_inject_add_rule(handle, "init_multiboot", "tmpfs", "file", "read,open,create,write");
-        sepolicy_inject_add_rule(handle, "init_multiboot", "tmpfs", "dir", "getattr,mounton,write,remove_name,add_name");
-        sepolicy_inject_add_rule(handle, "init_multiboot", "tmpfs", "blk_file", "getattr,create,read,open,ioctl,write");
-        sepolicy_inject_add_rule(handle, "init_multiboot", "init", "dir", "search");
-        sepolicy_inject_add_rule(handle, "init_multiboot", "init", "file", "read,open,getattr");
-        sepolicy_inject_add_rule(handle, "init_multiboot", "init", "process", "sigchld");
-        sepolicy_inject_add_rule(handle, "init_multiboot", "init_tmpfs", "file", "read,open,getattr,unlink");
-        sepolicy_inject_add_rule(handle, "init_multiboot", "init_multiboot", "process", "fork,sigchld");
-        sepolicy_inject_add_rule(handle, "init_multiboot", "init_multiboot", "capability", "dac_override,mknod");
-        sepolicy_inject_add_rule(handle, "init_multiboot", "init_multiboot", "file", "entrypoint");
-        sepolicy_inject_add_rule(handle, "init_multiboot", "init_multiboot", "dir", "search");
-        sepolicy_inject_add_rule(handle, "init_multiboot", "init_multiboot", "lnk_file", "read");
-        sepolicy_inject_add_rule(handle, "init_multiboot", "media_rw_data_file", "dir", "search");
-        sepolicy_inject_add_rule(handle, "init_multiboot", "media_rw_data_file", "file", "read,open,write");
-        sepolicy_inject_add_rule(handle, "init_multiboot", "boot_block_device", "blk_file", "getattr,unlink");
-        sepolicy_inject_add_rule(handle, "init_multiboot", "recovery_block_device", "blk_file", "getattr,unlink");
-        sepolicy_inject_add_rule(handle, "init_multiboot", "cache_block_device", "blk_file", "getattr,unlink");
-        sepolicy_inject_add_rule(handle, "init_multiboot", "userdata_block_device", "blk_file", "getattr,unlink");
-        sepolicy_inject_add_rule(handle, "init_multiboot", "block_device", "blk_file", "read,open,ioctl,write,getattr,create,unlink");
-        sepolicy_inject_add_rule(handle, "init_multiboot", "block_device", "dir", "write,remove_name,add_name");
-        sepolicy_inject_add_rule(handle, "init_multiboot", "debugfs", "dir", "search");
-        sepolicy_inject_add_rule(handle, "init_multiboot", "init", "fd", "use");
-        sepolicy_inject_add_rule(handle, "init_multiboot", "null_device", "chr_file", "read,write");
-        sepolicy_inject_add_rule(handle, "init_multiboot", "properties_device", "file", "read");
-        sepolicy_inject_add_rule(handle, "init_multiboot", "proc", "dir", "search");
-        sepolicy_inject_add_rule(handle, "init_multiboot", "proc", "lnk_file", "read");
-
-        // relabel rules for /multiboot/dev
-        sepolicy_inject_add_rule(handle, "init", "ram_device", "blk_file", "relabelto");
-        sepolicy_inject_add_rule(handle, "init", "loop_device", "blk_file", "relabelto");
-        sepolicy_inject_add_rule(handle, "init", "swap_block_device", "blk_file", "relabelto");
-        sepolicy_inject_add_rule(handle, "init", "sd_device", "blk_file", "relabelto");
-        sepolicy_inject_add_rule(handle, "init", "dm_device", "chr_file", "relabelto");
-        sepolicy_inject_add_rule(handle, "init", "frp_block_device", "blk_file", "relabelto");
-        sepolicy_inject_add_rule(handle, "init", "oem_block_device", "blk_file", "relabelto");
-        sepolicy_inject_add_rule(handle, "init", "root_block_device", "blk_file", "relabelto");
-        sepolicy_inject_add_rule(handle, "init", "rpmb_device", "blk_file", "relabelto");
-
-        // the kernel thread for loop images is checked by selinux too
-        sepolicy_inject_add_rule(handle, "kernel", "unlabeled", "file", "read");
-        sepolicy_inject_add_rule(handle, "kernel", "media_rw_data_file", "file", "read");
-
-        if (multiboot_data.is_multiboot) {
-            // this is for the datamedia bind-mount
-            sepolicy_inject_add_rule(handle, "init", "media_rw_data_file", "dir", "mounton");
-        }
-
-        // write new policy
-        sepolicy_inject_write(handle, "/sepolicy");
-        sepolicy_inject_close(handle);
-    }
+    // /sepolicy gets patched in setup_partition_replacements, which mounts the ESP anyway
 
     if (multiboot_data.is_multiboot) {
         // just in case we changed/created it
@@ -374,29 +705,37 @@ static int selinux_fixup(void)
         if (seffile) {
             sefbin_file_t *seffile_mb = sefbin_parse(MBPATH_FILE_CONTEXTS_BIN, 0);
             sefbin_append(seffile, seffile_mb);
-            sefbin_append_multiboot_rules(seffile);
             sefbin_write(seffile, "/file_contexts.bin");
+
+            // our nodes get labeled directly, see selinux_resolve_dev_labels
+            dev_contexts = seffile;
         }
 
         else {
-            util_append_buffer_to_file("/file_contexts.bin", PAYLOAD_PTR(file_contexts), PAYLOAD_SIZE(file_contexts));
-            sefsrc_append_multiboot_rules("/file_contexts.bin");
+            sefsrc_append_multiboot_rules("/file_contexts.bin", PAYLOAD_PTR(file_contexts), PAYLOAD_SIZE(file_contexts));
         }
     }
 
     if (util_exists("/file_contexts", 1)) {
-        util_append_buffer_to_file("/file_contexts", PAYLOAD_PTR(file_contexts), PAYLOAD_SIZE(file_contexts));
-        sefsrc_append_multiboot_rules("/file_contexts");
+        sefsrc_append_multiboot_rules("/file_contexts", PAYLOAD_PTR(file_contexts), PAYLOAD_SIZE(file_contexts));
     }
 
     // we need to manually restore these contexts
     util_append_string_to_file("/init.rc", "\n\n"
                                "on early-init\n"
                                "    restorecon /multiboot_init\n"
-                               "    restorecon_recursive /multiboot/dev\n"
                                "\n"
                               );
 
+    // without a parsed file_contexts.bin we have to rely on init's restorecon
+    if (!dev_contexts) {
+        util_append_string_to_file("/init.rc", "\n\n"
+                                   "on early-init\n"
+                                   "    restorecon_recursive /multiboot/dev\n"
+                                   "\n"
+                                  );
+    }
+
     // flush stdlib messages so they don't appear between the other logs
     fflush(stderr);
     fflush(stdout);
@@ -439,6 +778,7 @@ static int mbini_handler(UNUSED void *user, const char *section, const char *nam
     part->name = safe_strdup(name);
     part->path = safe_strdup(value);
     part->type = MBPART_TYPE_BIND;
+    util_loop_tuning_init(&part->loop_tuning);
 
     // determine partition type
     int pathlen = strlen(part->path);
@@ -487,6 +827,43 @@ static int mbini_handler(UNUSED void *user, const char *section, const char *nam
     return 1;
 }
 
+static multiboot_partition_t *multiboot_part_by_name(const char *name);
+
+static int mbini_loop_handler(UNUSED void *user, const char *section, const char *name, const char *value)
+{
+    loop_tuning_t *tuning;
+
+    // [loop] applies to all partitions, [loop.<name>] to a single one
+    if (!strcmp(section, "loop")) {
+        tuning = &multiboot_data.loop_tuning;
+    }
+    else if (!strncmp(section, "loop.", 5)) {
+        multiboot_partition_t *part = multiboot_part_by_name(section+5);
+        if (!part) {
+            MBABORT("Can't find partition for section [%s]\n", section);
+            return 0;
+        }
+        tuning = &part->loop_tuning;
+    }
+    else {
+        return 1;
+    }
+
+    // validate args
+    if (!name || !value) {
+        MBABORT("Invalid name/value in multiboot.ini\n");
+        return 1;
+    }
+
+    if (util_loop_tuning_set(tuning, name, value)) {
+        MBABORT("Invalid loop setting in [%s]: %s=%s\n", section, name, value);
+        return 0;
+    }
+
+    // inih defines 1 as OK
+    return 1;
+}
+
 static multiboot_partition_t *multiboot_part_by_name(const char *name)
 {
     uint32_t i;
@@ -625,8 +1002,8 @@ static uint32_t get_mb_sdk_version(void)
     }
 
     if (replacement->mountmode==PART_REPLACEMENT_MOUNTMODE_LOOP) {
-        // mount system
-        rc = util_mount(replacement->loopdevice, MBPATH_MB_SYSTEM, NULL, 0, NULL);
+        // mount system, read-only to keep the image mtime stable for the boot plan
+        rc = util_mount(replacement->loopdevice, MBPATH_MB_SYSTEM, NULL, MS_RDONLY, NULL);
         if (rc) {
             MBABORT("Can't mount system: %s\n", strerror(errno));
         }
@@ -667,7 +1044,12 @@ static void prepare_multiboot_data(void)
     char buf[PATH_MAX];
 
     // get sdk version
-    sdk_version = get_mb_sdk_version();
+    sdk_version = multiboot_data.mb_sdk_version;
+    if (!sdk_version) {
+        sdk_version = get_mb_sdk_version();
+        multiboot_data.mb_sdk_version = sdk_version;
+        bootplan_dirty = 1;
+    }
     LOGI("SDK version: %u\n", sdk_version);
 
     // determine required layout version
@@ -678,6 +1060,7 @@ static void prepare_multiboot_data(void)
         layout_version_needed = 2;
     else
         layout_version_needed = 3;
+    multiboot_data.mb_layout_version = layout_version_needed;
 
     // get data replacement
     part_replacement_t *replacement = util_get_replacement_by_mbfstabname("data");
@@ -708,16 +1091,19 @@ static void prepare_multiboot_data(void)
     LOGI("MB layout_version: %u\n", layout_version);
 
     // determine bind-mount mapping
-    const char *datamedia_source = NULL;
-    const char *datamedia_target = NULL;
-    if (ANYEQ_2(multiboot_data.native_data_layout_version, 0, 1))
-        datamedia_source = MBPATH_DATA"/media";
-    else if (ANYEQ_2(multiboot_data.native_data_layout_version, 2, 3))
-        datamedia_source = MBPATH_DATA"/media/0";
-    if (ANYEQ_2(layout_version_needed, 0, 1))
-        datamedia_target = "/media";
-    else if (ANYEQ_2(layout_version_needed, 2, 3))
-        datamedia_target = "/media/0";
+    const char *datamedia_source = multiboot_data.datamedia_source;
+    const char *datamedia_target = multiboot_data.datamedia_target;
+    if (!datamedia_source || !datamedia_target) {
+        if (ANYEQ_2(multiboot_data.native_data_layout_version, 0, 1))
+            datamedia_source = MBPATH_DATA"/media";
+        else if (ANYEQ_2(multiboot_data.native_data_layout_version, 2, 3))
+            datamedia_source = MBPATH_DATA"/media/0";
+        if (ANYEQ_2(layout_version_needed, 0, 1))
+            datamedia_target = "/media";
+        else if (ANYEQ_2(layout_version_needed, 2, 3))
+            datamedia_target = "/media/0";
+        bootplan_dirty = 1;
+    }
 
     // verify results
     if (datamedia_source==NULL || datamedia_target==NULL) {
@@ -757,178 +1143,432 @@ static void prepare_multiboot_data(void)
     }
 }
 
-static int setup_partition_replacements(void)
+typedef struct {
+    multiboot_partition_t *part;
+    const char *basedir;
+
+    part_replacement_t *replacement;
+    int rc;
+    char error[256];
+} mbpart_job_t;
+
+typedef struct {
+    pthread_mutex_t lock;
+    mbpart_job_t *jobs;
+    uint32_t num_jobs;
+    uint32_t next_job;
+} mbpart_pool_t;
+
+#define STUB_LABEL "mbstub"
+
+#define MBPART_SET_ERROR(job, fmt, ...) \
+    snprintf((job)->error, sizeof((job)->error), fmt, ##__VA_ARGS__)
+
+#define MBPART_FAIL(job, fmt, ...) do { \
+    MBPART_SET_ERROR(job, fmt, ##__VA_ARGS__); \
+    return -1; \
+} while(0)
+
+static int stub_template_valid(const char *path, uint64_t size)
 {
+    struct stat sb;
+    uint8_t sbbuf[0x88];
+    ssize_t nbytes;
+
+    if (stat(path, &sb) || !S_ISREG(sb.st_mode) || (uint64_t)sb.st_size!=size)
+        return 0;
+
+    int fd = open(path, O_RDONLY);
+    if (fd<0)
+        return 0;
+
+    // read the beginning of the ext4 superblock
+    nbytes = pread(fd, sbbuf, sizeof(sbbuf), 1024);
+    close(fd);
+    if (nbytes!=sizeof(sbbuf))
+        return 0;
+
+    // s_magic
+    if (sbbuf[0x38]!=0x53 || sbbuf[0x39]!=0xef)
+        return 0;
+
+    // s_volume_name
+    if (strncmp((const char *)sbbuf+0x78, STUB_LABEL, 16))
+        return 0;
+
+    return 1;
+}
+
+static int create_stub_template(mbpart_job_t *job, const char *path, uint64_t size)
+{
+    multiboot_partition_t *part = job->part;
+    char tmpfile[PATH_MAX];
+    char loopdevice[PATH_MAX];
+    char stubdir[PATH_MAX];
+    char buf[PATH_MAX];
+    int attached = 0;
+    int mounted = 0;
+    int rc;
+
+    SAFE_SNPRINTF_RET(LOGE, -1, tmpfile, sizeof(tmpfile), "%s.tmp", path);
+    SAFE_SNPRINTF_RET(LOGE, -1, loopdevice, sizeof(loopdevice), MBPATH_DEV"/block/stubtemplate:%s", part->name);
+    SAFE_SNPRINTF_RET(LOGE, -1, stubdir, sizeof(stubdir), MBPATH_STUB":%s", part->name);
+    SAFE_SNPRINTF_RET(LOGE, -1, buf, sizeof(buf), "%s/.idfile", stubdir);
+
+    // create sparse file
+    int fd = open(tmpfile, O_WRONLY|O_CREAT|O_TRUNC, 0600);
+    if (fd<0) {
+        MBPART_FAIL(job, "Can't create %s: %s", tmpfile, strerror(errno));
+    }
+    rc = ftruncate(fd, size);
+    close(fd);
+    if (rc) {
+        MBPART_SET_ERROR(job, "Can't resize %s: %s", tmpfile, strerror(errno));
+        goto err;
+    }
+
+    // create filesystem
+    rc = util_mkfs_ex(tmpfile, "ext4", STUB_LABEL);
+    if (rc) {
+        MBPART_SET_ERROR(job, "Can't create filesystem on %s", tmpfile);
+        goto err;
+    }
+
+    // create new loop node
+    rc = util_make_loop(loopdevice);
+    if (rc) {
+        MBPART_SET_ERROR(job, "Can't create loop device at %s", loopdevice);
+        goto err;
+    }
+
+    // setup loop device
+    rc = util_losetup(loopdevice, tmpfile, false);
+    if (rc) {
+        MBPART_SET_ERROR(job, "Can't setup loop device at %s for %s", loopdevice, tmpfile);
+        goto err;
+    }
+    attached = 1;
+
+    // other partitions get set up at the same time, so use a private stub mountpoint
+    rc = util_mount(loopdevice, stubdir, "ext4", 0, NULL);
+    if (rc) {
+        MBPART_SET_ERROR(job, "can't mount %s on %s: %s", loopdevice, stubdir, strerror(errno));
+        goto err;
+    }
+    mounted = 1;
+
+    // create id file
+    fd = open(buf, O_RDWR|O_CREAT, 0600);
+    if (fd<0) {
+        MBPART_SET_ERROR(job, "Can't create ID file");
+        goto err;
+    }
+    close(fd);
+
+    // unmount loop device
+    rc = umount(stubdir);
+    if (rc) {
+        MBPART_SET_ERROR(job, "can't unmount %s: %s", stubdir, strerror(errno));
+        goto err;
+    }
+    mounted = 0;
+    rmdir(stubdir);
+
+    // detach loop device
+    rc = util_loop_detach(loopdevice);
+    if (rc) {
+        MBPART_SET_ERROR(job, "Can't detach loop device %s", loopdevice);
+        goto err;
+    }
+    attached = 0;
+    unlink(loopdevice);
+
+    // the template is complete, so make it visible
+    rc = rename(tmpfile, path);
+    if (rc) {
+        MBPART_SET_ERROR(job, "Can't rename %s to %s: %s", tmpfile, path, strerror(errno));
+        goto err;
+    }
+
+    return 0;
+
+err:
+    // don't leave the loop attached or the half-built template behind
+    if (mounted) {
+        if (umount(stubdir))
+            LOGW("can't unmount %s: %s\n", stubdir, strerror(errno));
+    }
+    rmdir(stubdir);
+    if (attached)
+        util_loop_detach(loopdevice);
+    unlink(loopdevice);
+    unlink(tmpfile);
+
+    return -1;
+}
+
+static int setup_multiboot_partition(mbpart_job_t *job)
+{
+    multiboot_partition_t *part = job->part;
     int rc;
-    int i;
-    uint32_t iu;
     char buf[PATH_MAX];
     char buf2[PATH_MAX];
+    char template[PATH_MAX];
 
-    // multiboot
-    if (multiboot_data.is_multiboot) {
-        // get directory of multiboot.ini
-        char *basedir = util_dirname(multiboot_data.path);
-        if (!basedir) {
-            MBABORT("Can't get base dir for multiboot path\n");
-        }
+    // path to multiboot rom dir
+    SAFE_SNPRINTF_RET(LOGE, -1, buf, sizeof(buf), MBPATH_BOOTDEV"%s/%s", job->basedir, part->path);
+    char *partpath = safe_strdup(buf);
 
-        // make sure we have /dev/fuse
-        if (!util_exists("/dev", false)) {
-            rc = util_mkdir("/dev");
+    // path to loop device
+    SAFE_SNPRINTF_RET(LOGE, -1, buf, sizeof(buf), MBPATH_DEV"/block/loopdev:%s", part->name);
+    char *loopdevice = safe_strdup(buf);
+
+    // stat path
+    struct stat sb;
+    rc = lstat(partpath, &sb);
+    if (rc) rc = -errno;
+    if (rc && rc!=-ENOENT) {
+        MBPART_FAIL(job, "Can't stat '%s'", partpath);
+    }
+
+    // check node type
+    if (!rc && (
+                (part->type==MBPART_TYPE_BIND && !S_ISDIR(sb.st_mode)) ||
+                (part->type!=MBPART_TYPE_BIND && !S_ISREG(sb.st_mode))
+            )
+       ) {
+        MBPART_FAIL(job, "path '%s'(type=%d) has invalid mode: %x", partpath, part->type, sb.st_mode);
+    }
+
+    // get loop settings
+    loop_tuning_t tuning;
+    util_loop_tuning_resolve(&tuning, &part->loop_tuning, &multiboot_data.loop_tuning);
+
+    char *loopfile = NULL;
+    if (part->type==MBPART_TYPE_BIND) {
+        // create directory
+        // TODO: don't do that
+        if (rc==-ENOENT) {
+            rc = util_mkdir(partpath);
             if (rc) {
-                MBABORT("Can't create /dev directory\n");
+                MBPART_FAIL(job, "Can't create directory '%s'", partpath);
             }
         }
-        if (!util_exists("/dev/fuse", true)) {
-            rc = mknod("/dev/fuse", S_IFCHR | 0600, makedev(10, 229));
-            if (rc) {
-                MBABORT("Can't create /dev/fuse: %s\n", strerror(errno));
-            }
+
+        // get real device
+        SAFE_SNPRINTF_RET(LOGE, -1, buf, sizeof(buf), MBPATH_DEV"/block/%s", part->uevent_block->devname);
+
+        // get size of original partition
+        unsigned long num_blocks = 0;
+        rc = util_block_num(buf, &num_blocks);
+        if (rc || num_blocks==0) {
+            MBPART_FAIL(job, "Can't get size of device %s", buf);
         }
 
-        // setup multiboot partitions
-        for (iu=0; iu<multiboot_data.num_mbparts; iu++) {
-            multiboot_partition_t *part = &multiboot_data.mbparts[iu];
-
-            // path to multiboot rom dir
-            SAFE_SNPRINTF_RET(MBABORT, -1, buf, sizeof(buf), MBPATH_BOOTDEV"%s/%s", basedir, part->path);
-            char *partpath = safe_strdup(buf);
-
-            // path to loop device
-            SAFE_SNPRINTF_RET(MBABORT, -1, buf, sizeof(buf), MBPATH_DEV"/block/loopdev:%s", part->name);
-            char *loopdevice = safe_strdup(buf);
-
-            // stat path
-            struct stat sb;
-            rc = lstat(partpath, &sb);
-            if (rc) rc = -errno;
-            if (rc && rc!=-ENOENT) {
-                MBABORT("Can't stat '%s'\n", partpath);
-            }
+        // path to stub template
+        SAFE_SNPRINTF_RET(LOGE, -1, template, sizeof(template), MBPATH_BOOTDEV"%s/.stub_%s.img", job->basedir, part->name);
 
-            // check node type
-            if (!rc && (
-                        (part->type==MBPART_TYPE_BIND && !S_ISDIR(sb.st_mode)) ||
-                        (part->type!=MBPART_TYPE_BIND && !S_ISREG(sb.st_mode))
-                    )
-               ) {
-                MBABORT("path '%s'(type=%d) has invalid mode: %x\n", partpath, part->type, sb.st_mode);
-            }
+        // mkfs takes long for large filesystems, so we only do it once per ROM
+        if (!stub_template_valid(template, num_blocks*512llu)) {
+            LOGI("create stub template %s\n", template);
+            rc = create_stub_template(job, template, num_blocks*512llu);
+            if (rc) return rc;
+        }
 
-            char *loopfile = NULL;
-            if (part->type==MBPART_TYPE_BIND) {
-                // create directory
-                // TODO: don't do that
-                if (rc==-ENOENT) {
-                    rc = util_mkdir(partpath);
-                    if (rc) {
-                        MBABORT("Can't create directory '%s'\n", partpath);
-                    }
-                }
+        // path to dynfilefs mountpopint
+        SAFE_SNPRINTF_RET(LOGE, -1, buf2, sizeof(buf2), MBPATH_ROOT"/dynmount:%s", part->name);
 
-                // get real device
-                SAFE_SNPRINTF_RET(MBABORT, -1, buf, sizeof(buf), MBPATH_DEV"/block/%s", part->uevent_block->devname);
+        // path to dynfilefs storage file
+        SAFE_SNPRINTF_RET(LOGE, -1, buf, sizeof(buf), MBPATH_ROOT"/dynstorage:%s", part->name);
 
-                // get size of original partition
-                unsigned long num_blocks = 0;
-                rc = util_block_num(buf, &num_blocks);
-                if (rc || num_blocks==0) {
-                    MBABORT("Can't get size of device %s\n", buf);
-                }
+        // mount dynfilefs
+        rc = util_dynfilefs(buf, buf2, num_blocks*512llu);
+        if (rc) {
+            MBPART_FAIL(job, "can't mount dynfilefs");
+        }
 
-                // mkfs needs much time for large filesystems, so just use max 200MB
-                num_blocks = MIN(num_blocks, (200*1024*1024)/512llu);
+        // path to stub partition backup (in dynfs mountpoint)
+        SAFE_SNPRINTF_RET(LOGE, -1, buf, sizeof(buf), "%s/loop.fs", buf2);
 
-                // path to dynfilefs mountpopint
-                SAFE_SNPRINTF_RET(MBABORT, -1, buf2, sizeof(buf2), MBPATH_ROOT"/dynmount:%s", part->name);
+        // the ROM may format the stub, so it gets a fresh copy on every boot
+        rc = util_copy_sparse(template, buf);
+        if (rc) {
+            MBPART_FAIL(job, "Can't copy stub template %s to %s", template, buf);
+        }
 
-                // path to dynfilefs storage file
-                SAFE_SNPRINTF_RET(MBABORT, -1, buf, sizeof(buf), MBPATH_ROOT"/dynstorage:%s", part->name);
+        // create new loop node
+        rc = util_make_loop(loopdevice);
+        if (rc) {
+            MBPART_FAIL(job, "Can't create loop device at %s", loopdevice);
+        }
 
-                // mount dynfilefs
-                rc = util_dynfilefs(buf, buf2, num_blocks*512llu);
-                if (rc) {
-                    MBABORT("can't mount dynfilefs\n");
-                }
+        // setup loop device
+        rc = util_losetup(loopdevice, buf, false);
+        if (rc) {
+            MBPART_FAIL(job, "Can't setup loop device at %s for %s", loopdevice, buf);
+        }
+    }
 
-                // path to stub partition backup (in dynfs mountpoint)
-                SAFE_SNPRINTF_RET(MBABORT, -1, buf, sizeof(buf), "%s/loop.fs", buf2);
+    else if (part->type==MBPART_TYPE_LOOP) {
+        // create new node
+        rc = util_make_loop(loopdevice);
+        if (rc) {
+            MBPART_FAIL(job, "Can't create loop device at %s", loopdevice);
+        }
 
-                // create new loop node
-                rc = util_make_loop(loopdevice);
-                if (rc) {
-                    MBABORT("Can't create loop device at %s\n", loopdevice);
-                }
+        // setup loop device
+        loopfile = safe_strdup(partpath);
+        rc = util_losetup_ex(loopdevice, loopfile, 0, &tuning);
+        if (rc) {
+            MBPART_FAIL(job, "Can't setup loop device at %s for %s", loopdevice, loopfile);
+        }
+    }
 
-                // setup loop device
-                rc = util_losetup(loopdevice, buf, false);
-                if (rc) {
-                    MBABORT("Can't setup loop device at %s for %s\n", loopdevice, buf);
-                }
+    else {
+        MBPART_FAIL(job, "invalid partition type: %d", part->type);
+    }
 
-                // get fstype
-                const char *fstype = "ext4";
+    part_replacement_t *replacement = safe_calloc(sizeof(part_replacement_t), 1);
+    pthread_mutex_init(&replacement->lock, NULL);
+    replacement->uevent_block = part->uevent_block;
+    if (part->type==MBPART_TYPE_BIND)
+        replacement->mountmode = PART_REPLACEMENT_MOUNTMODE_BIND;
+    else
+        replacement->mountmode = PART_REPLACEMENT_MOUNTMODE_LOOP;
+    replacement->iomode = PART_REPLACEMENT_IOMODE_REDIRECT;
+    if (part->type==MBPART_TYPE_BIND)
+        replacement->bindsource = partpath;
+    else
+        free(partpath);
+    replacement->losetup_done = 1;
+    replacement->loopdevice = loopdevice;
+    replacement->loop_tuning = tuning;
+    replacement->loopfile = loopfile;
 
-                // create filesystem on loop device
-                rc = util_mkfs(loopdevice, fstype);
-                if (rc) {
-                    MBABORT("Can't create '%s' filesystem on %s\n", fstype, loopdevice);
-                }
+    job->replacement = replacement;
 
-                // mount loop device
-                SAFE_MOUNT(loopdevice, MBPATH_STUB, fstype, 0, NULL);
+    return 0;
+}
 
-                // create id file
-                int fd = open(MBPATH_STUB_IDFILE, O_RDWR|O_CREAT);
-                if (fd<0) {
-                    MBABORT("Can't create ID file\n");
-                }
-                close(fd);
+static void *mbpart_worker(void *arg)
+{
+    mbpart_pool_t *pool = arg;
 
-                // unmount loop device
-                SAFE_UMOUNT(MBPATH_STUB);
-            }
+    for (;;) {
+        mbpart_job_t *job;
 
-            else if (part->type==MBPART_TYPE_LOOP) {
-                // create new node
-                rc = util_make_loop(loopdevice);
-                if (rc) {
-                    MBABORT("Can't create loop device at %s\n", loopdevice);
-                }
+        // get the next pending partition
+        pthread_mutex_lock(&pool->lock);
+        if (pool->next_job>=pool->num_jobs) {
+            pthread_mutex_unlock(&pool->lock);
+            break;
+        }
+        job = &pool->jobs[pool->next_job++];
+        pthread_mutex_unlock(&pool->lock);
 
-                // setup loop device
-                loopfile = safe_strdup(partpath);
-                rc = util_losetup(loopdevice, loopfile, false);
-                if (rc) {
-                    MBABORT("Can't setup loop device at %s for %s\n", loopdevice, loopfile);
-                }
-            }
+        LOGV("setup multiboot partition %s\n", job->part->name);
+        job->rc = setup_multiboot_partition(job);
+    }
 
-            else {
-                LOGF("invalid partition type: %d\n", part->type);
-            }
+    return NULL;
+}
 
-            part_replacement_t *replacement = safe_calloc(sizeof(part_replacement_t), 1);
-            pthread_mutex_init(&replacement->lock, NULL);
-            replacement->uevent_block = part->uevent_block;
-            if (part->type==MBPART_TYPE_BIND)
-                replacement->mountmode = PART_REPLACEMENT_MOUNTMODE_BIND;
-            else if (part->type==MBPART_TYPE_LOOP)
-                replacement->mountmode = PART_REPLACEMENT_MOUNTMODE_LOOP;
-            else
-                MBABORT("invalid mbpart type %d\n", part->type);
-            replacement->iomode = PART_REPLACEMENT_IOMODE_REDIRECT;
-            if (part->type==MBPART_TYPE_BIND)
-                replacement->bindsource = partpath;
-            replacement->losetup_done = 1;
-            replacement->loopdevice = loopdevice;
-            replacement->loopfile = loopfile;
+static void setup_multiboot_partitions(const char *basedir)
+{
+    mbpart_pool_t pool;
+    pthread_t *threads;
+    uint32_t num_threads;
+    uint32_t i;
+    int errors = 0;
+
+    if (multiboot_data.num_mbparts==0)
+        return;
 
+    pool.jobs = safe_calloc(sizeof(mbpart_job_t), multiboot_data.num_mbparts);
+    pool.num_jobs = multiboot_data.num_mbparts;
+    pool.next_job = 0;
+    pthread_mutex_init(&pool.lock, NULL);
 
-            list_add_tail(&multiboot_data.replacements, &replacement->node);
+    for (i=0; i<pool.num_jobs; i++) {
+        pool.jobs[i].part = &multiboot_data.mbparts[i];
+        pool.jobs[i].basedir = basedir;
+    }
+
+    // mke2fs is mostly waiting for IO, so use at least 2 workers
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    num_threads = MIN(pool.num_jobs, (uint32_t)MAX(ncpus, 2));
+
+    // the calling thread is a worker, too
+    threads = safe_calloc(sizeof(pthread_t), num_threads);
+    for (i=1; i<num_threads; i++) {
+        int rc = pthread_create(&threads[i], NULL, mbpart_worker, &pool);
+        if (rc) {
+            LOGW("can't create worker thread: %s\n", strerror(rc));
+            break;
+        }
+    }
+    num_threads = i;
+
+    mbpart_worker(&pool);
+    for (i=1; i<num_threads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    // report all failed partitions
+    for (i=0; i<pool.num_jobs; i++) {
+        mbpart_job_t *job = &pool.jobs[i];
+
+        if (job->rc) {
+            LOGE("multiboot partition %s: %s\n", job->part->name, job->error[0] ? job->error : "setup failed");
+            errors++;
+        }
+    }
+    if (errors) {
+        MBABORT("Can't setup %d multiboot partition(s)\n", errors);
+    }
+
+    // add replacements in multiboot.ini order
+    for (i=0; i<pool.num_jobs; i++) {
+        list_add_tail(&multiboot_data.replacements, &pool.jobs[i].replacement->node);
+    }
+
+    pthread_mutex_destroy(&pool.lock);
+    free(threads);
+    free(pool.jobs);
+}
+
+static int setup_partition_replacements(void)
+{
+    int rc;
+    int i;
+    char buf[PATH_MAX];
+    char buf2[PATH_MAX];
+
+    // multiboot
+    if (multiboot_data.is_multiboot) {
+        // get directory of multiboot.ini
+        char *basedir = util_dirname(multiboot_data.path);
+        if (!basedir) {
+            MBABORT("Can't get base dir for multiboot path\n");
+        }
+
+        // make sure we have /dev/fuse
+        if (!util_exists("/dev", false)) {
+            rc = util_mkdir("/dev");
+            if (rc) {
+                MBABORT("Can't create /dev directory\n");
+            }
+        }
+        if (!util_exists("/dev/fuse", true)) {
+            rc = mknod("/dev/fuse", S_IFCHR | 0600, makedev(10, 229));
+            if (rc) {
+                MBABORT("Can't create /dev/fuse: %s\n", strerror(errno));
+            }
         }
 
+        // setup multiboot partitions
+        setup_multiboot_partitions(basedir);
+
         free(basedir);
 
         // prepare datamedia setup
@@ -1000,6 +1640,16 @@ static int setup_partition_replacements(void)
         }
     }
 
+    // patch sepolicy, the cache lives in the ESP directory
+    if (!multiboot_data.is_recovery) {
+        sepolicy_patch_cached(buf);
+    }
+
+    // drop the chunks of images that changed since they were imported
+    if (chunkstore_gc(buf)) {
+        LOGW("Can't clean up the chunk store in %s\n", buf);
+    }
+
     // setup uefi partition redirections
     for (i=0; i<multiboot_data.mbfstab->num_entries; i++) {
         struct fstab_rec *rec = &multiboot_data.mbfstab->recs[i];
@@ -1041,6 +1691,7 @@ static int setup_partition_replacements(void)
         char *loopfile = NULL;
         int losetup_done = 0;
         char *loop_sync_target = NULL;
+        char *chunkstore_image = NULL;
         if (multiboot_data.is_recovery && !multiboot_data.is_multiboot) {
             // path to temporary partition backup
             SAFE_SNPRINTF_RET(MBABORT, -1, buf2, sizeof(buf2), MBPATH_ROOT"/loopfile:%s", rec->mount_point+1);
@@ -1048,28 +1699,50 @@ static int setup_partition_replacements(void)
             loop_sync_target = rec->mount_point+1;
 
             // create temporary partition backup
-            rc = util_cp(espfilename, loopfile);
+            if (chunkstore_enabled(espfilename))
+                rc = chunkstore_materialize(espfilename, loopfile);
+            else
+                rc = util_cp(espfilename, loopfile);
             if (rc) {
                 MBABORT("Can't copy partition from esp to temp\n");
             }
         }
 
+        else if (chunkstore_enabled(espfilename)) {
+            // there's no image, chunkfs assembles it from the store
+            SAFE_SNPRINTF_RET(MBABORT, -1, buf2, sizeof(buf2), MBPATH_ROOT"/chunkmount:%s/loop.fs", rec->mount_point+1);
+            loopfile = buf2;
+            chunkstore_image = espfilename;
+        }
+
         else {
             // path to partition backup
             loopfile = espfilename;
         }
 
-        // create new loop node
-        rc = util_make_loop(buf);
+        // create new loop node, Android attaches it in the postfs stage
+        rc = util_make_loop_ex(buf, !multiboot_data.is_recovery);
         if (rc) {
             MBABORT("Can't create loop device at %s\n", buf);
         }
 
 
+        // get loop settings
+        loop_tuning_t tuning;
+        util_loop_tuning_resolve(&tuning, NULL, &multiboot_data.loop_tuning);
+
         // in Android we'll do that in the postfs stage
         if (multiboot_data.is_recovery) {
+            // the ESP stays mounted in multiboot-recovery, so chunkfs can run now
+            if (chunkstore_image) {
+                rc = util_chunkfs(chunkstore_image, loopfile);
+                if (rc) {
+                    MBABORT("Can't serve %s from the chunk store\n", chunkstore_image);
+                }
+            }
+
             // setup loop device
-            rc = util_losetup(buf, loopfile, false);
+            rc = util_losetup_ex(buf, loopfile, 0, &tuning);
             if (rc) {
                 MBABORT("Can't setup loop device at %s for %s\n", buf, buf2);
             }
@@ -1083,8 +1756,10 @@ static int setup_partition_replacements(void)
         replacement->iomode = PART_REPLACEMENT_IOMODE_REDIRECT;
         replacement->losetup_done = losetup_done;
         replacement->loopdevice = safe_strdup(buf);
+        replacement->loop_tuning = tuning;
         replacement->loopfile = safe_strdup(loopfile);
         replacement->loop_sync_target = loop_sync_target;
+        replacement->chunkstore_image = chunkstore_image;
 
         list_add_tail(&multiboot_data.replacements, &replacement->node);
 
@@ -1145,6 +1820,7 @@ int multiboot_main(UNUSED int argc, char **argv)
     // basic multiboot_data init
     pthread_mutex_init(&multiboot_data.lock, NULL);
     list_initialize(&multiboot_data.replacements);
+    util_loop_tuning_init(&multiboot_data.loop_tuning);
 
     // init logging
     log_init();
@@ -1203,6 +1879,11 @@ int multiboot_main(UNUSED int argc, char **argv)
         MBABORT("Can't parse multiboot fstab: %s\n", strerror(errno));
     }
 
+    // from now on fatal errors can be written to the NV area
+    if (efivar_init()) {
+        LOGW("Can't load NV variables\n");
+    }
+
     // check for hwname
     LOGV("verify hw name\n");
     if (!multiboot_data.hwname) {
@@ -1375,16 +2056,15 @@ int multiboot_main(UNUSED int argc, char **argv)
         LOGI("layout_version: %u\n", multiboot_data.native_data_layout_version);
 
         // scan mounts
-        mounts_state_t mounts_state = LIST_INITIAL_VALUE(mounts_state);
         LOGV("scan mounted volumes\n");
-        rc = scan_mounted_volumes(&mounts_state);
-        if (rc) {
+        mounts_state_t *mounts_state = mounts_cache_get();
+        if (!mounts_state) {
             MBABORT("Can't scan mounted volumes: %s\n", strerror(errno));
         }
 
         // check for bind-mount support
         LOGV("search mounted bootdev\n");
-        const mounted_volume_t *volume = find_mounted_volume_by_mount_point(&mounts_state, MBPATH_BOOTDEV);
+        const mounted_volume_t *volume = find_mounted_volume_by_mount_point(mounts_state, MBPATH_BOOTDEV);
         if (!volume) {
             MBABORT("boot device not mounted (DAFUQ?)\n");
         }
@@ -1393,29 +2073,42 @@ int multiboot_main(UNUSED int argc, char **argv)
             multiboot_data.bootdev_supports_bindmount = 1;
         }
 
-        // free mount state
-        free_mounts_state(&mounts_state);
+        // release mount state
+        mounts_cache_put();
 
-        // build multiboot.ini filename
-        SAFE_SNPRINTF_RET(MBABORT, -1, buf, sizeof(buf), MBPATH_BOOTDEV"%s", multiboot_data.path);
-
-        // count partitions in multiboot.ini
-        LOGD("parse %s using mbini_count_handler\n", buf);
-        rc = ini_parse(buf, mbini_count_handler, NULL);
+        // use the cached boot plan if the configuration didn't change
+        rc = bootplan_load();
         if (rc) {
-            MBABORT("Can't count partitions in '%s': %s\n", buf, strerror(errno));
-        }
+            bootplan_dirty = 1;
 
-        // parse multiboot.ini
-        uint32_t index = 0;
-        LOGD("parse %s using mbini_handler\n", buf);
-        multiboot_data.mbparts = safe_calloc(sizeof(multiboot_partition_t), multiboot_data.num_mbparts);
-        rc = ini_parse(buf, mbini_handler, &index);
-        if (rc) {
-            MBABORT("Can't parse '%s': %s\n", buf, strerror(errno));
-        }
-        if (index != multiboot_data.num_mbparts) {
-            MBABORT("retrieved wrong number of partitions %u/%u\n", index, multiboot_data.num_mbparts);
+            // build multiboot.ini filename
+            SAFE_SNPRINTF_RET(MBABORT, -1, buf, sizeof(buf), MBPATH_BOOTDEV"%s", multiboot_data.path);
+
+            // count partitions in multiboot.ini
+            LOGD("parse %s using mbini_count_handler\n", buf);
+            rc = ini_parse(buf, mbini_count_handler, NULL);
+            if (rc) {
+                MBABORT("Can't count partitions in '%s': %s\n", buf, strerror(errno));
+            }
+
+            // parse multiboot.ini
+            uint32_t index = 0;
+            LOGD("parse %s using mbini_handler\n", buf);
+            multiboot_data.mbparts = safe_calloc(sizeof(multiboot_partition_t), multiboot_data.num_mbparts);
+            rc = ini_parse(buf, mbini_handler, &index);
+            if (rc) {
+                MBABORT("Can't parse '%s': %s\n", buf, strerror(errno));
+            }
+            if (index != multiboot_data.num_mbparts) {
+                MBABORT("retrieved wrong number of partitions %u/%u\n", index, multiboot_data.num_mbparts);
+            }
+
+            // parse loop settings
+            LOGD("parse %s using mbini_loop_handler\n", buf);
+            rc = ini_parse(buf, mbini_loop_handler, NULL);
+            if (rc) {
+                MBABORT("Can't parse '%s': %s\n", buf, strerror(errno));
+            }
         }
 
         // verify that every multiboot partition in mbfstab got replaced
@@ -1440,6 +2133,16 @@ int multiboot_main(UNUSED int argc, char **argv)
     LOGD("setup replacements\n");
     setup_partition_replacements();
 
+    // all our nodes exist now
+    LOGD("resolve dev labels\n");
+    selinux_resolve_dev_labels();
+
+    // cache everything we derived for the next boot
+    if (multiboot_data.is_multiboot && bootplan_dirty) {
+        LOGD("save boot plan\n");
+        bootplan_save();
+    }
+
     // boot recovery
     if (multiboot_data.is_recovery) {
         LOGI("Booting recovery\n");
@@ -1,418 +1,394 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <string.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 
 #include <common.h>
 #include <safe.h>
 #include <lib/fs_mgr.h>
+#include <lib/cksum.h>
 
 #define LOG_TAG "STATE"
 #include <lib/log.h>
 
-#define write_primitive(fd, v) write_data(fd, &(v), sizeof(v))
-#define read_primitive(fd, v) read_data(fd, v, sizeof(*(v)))
-#define write_ptr(fd, v) write_primitive(fd, v)
-#define read_ptr(fd, v) read_primitive(fd, v)
+// the state file is a memory image of multiboot_data and everything it points to.
+// pointers are stored as file offsets (0 is NULL) and the relocation table lists
+// every pointer slot, so restoring is a mmap plus one addition per pointer.
+#define STATE_MAGIC 0x7473626d // "mbst"
+#define STATE_VERSION 1
+#define STATE_ALIGN(x) (((x) + 7) & ~7)
 
 typedef struct {
-    list_node_t node;
-    void *old;
-    void *new;
+    uint32_t magic;
+    uint32_t version;
+    uint32_t layout;
+    uint32_t size;
+    uint32_t root;
+    uint32_t strings_off;
+    uint32_t strings_size;
+    uint32_t relocs_off;
+    uint32_t num_relocs;
+    uint32_t reserved;
+} state_header_t;
+
+typedef struct {
+    const void *ptr;
     size_t size;
-} registered_ptr_t;
+    uint32_t off;
+} state_object_t;
 
 typedef struct {
-    list_node_t node;
-    void *old;
-    void **pnew;
-} required_ptr_t;
+    // offset of the slot within the objects region
+    uint32_t slot;
+    // either a string table offset or a pointer to resolve
+    int is_str;
+    uint32_t stroff;
+    const void *ptr;
+} state_reloc_t;
 
-static list_node_t ptr_registered;
-static list_node_t ptr_required;
+typedef struct {
+    char *data;
+    size_t size;
+    size_t pos;
 
-static void write_data(int fd, const void *value, size_t size)
-{
-    ssize_t num_bytes = write(fd, value, size);
-    if (num_bytes<0 || (size_t)num_bytes != size) {
-        MBABORT("%s: %s\n", __func__, strerror(errno));
-    }
-}
+    char *strings;
+    size_t strings_size;
+    size_t strings_pos;
+
+    state_object_t *objects;
+    size_t num_objects;
+    size_t objects_size;
+
+    state_reloc_t *relocs;
+    size_t num_relocs;
+    size_t relocs_size;
+} state_builder_t;
 
-static void read_data(int fd, void *buf, size_t size)
+#define SLOT(off, type, field) ((off) + offsetof(type, field))
+
+static void *grow(void *buf, size_t *size, size_t needed, size_t elemsize)
 {
-    ssize_t num_bytes = read(fd, buf, size);
-    if (num_bytes<0 || (size_t)num_bytes != size) {
-        MBABORT("%s: %s\n", __func__, strerror(errno));
+    if (needed <= *size)
+        return buf;
+
+    *size = MAX(needed, *size * 2);
+    buf = realloc(buf, *size * elemsize);
+    if (!buf) {
+        MBABORT("Can't allocate memory for state\n");
     }
+
+    return buf;
 }
 
-static void write_str(int fd, const char *value)
+static uint32_t sb_add_object(state_builder_t *sb, const void *ptr, size_t size)
 {
-    write_ptr(fd, value);
-    if (value) {
-        size_t len = strlen(value)+1;
-        write_primitive(fd, len);
-        write_data(fd, value, len);
-    }
+    size_t off = STATE_ALIGN(sb->pos);
+
+    sb->data = grow(sb->data, &sb->size, off + size, 1);
+    memset(sb->data + sb->pos, 0, off - sb->pos);
+    memcpy(sb->data + off, ptr, size);
+    sb->pos = off + size;
+
+    sb->objects = grow(sb->objects, &sb->objects_size, sb->num_objects + 1, sizeof(*sb->objects));
+    sb->objects[sb->num_objects++] = (state_object_t){ptr, size, off};
+
+    return off;
 }
 
-static void read_str(int fd, char **value)
+static state_reloc_t *sb_add_reloc(state_builder_t *sb, uint32_t slot)
 {
-    void *ptrval;
-    size_t len;
-
-    read_ptr(fd, &ptrval);
-    if (ptrval) {
-        read_primitive(fd, &len);
+    sb->relocs = grow(sb->relocs, &sb->relocs_size, sb->num_relocs + 1, sizeof(*sb->relocs));
+    state_reloc_t *reloc = &sb->relocs[sb->num_relocs++];
+    memset(reloc, 0, sizeof(*reloc));
+    reloc->slot = slot;
 
-        void *nptr = safe_malloc(len);
-        read_data(fd, nptr, len);
+    return reloc;
+}
 
-        *value = nptr;
-    } else {
-        *value = NULL;
-    }
+static void sb_clear_slot(state_builder_t *sb, uint32_t slot)
+{
+    memset(sb->data + slot, 0, sizeof(void *));
 }
 
-static void require_ptr(int fd, void **nptr)
+static void sb_set_str(state_builder_t *sb, uint32_t slot, const char *str)
 {
-    void *oldptr;
+    sb_clear_slot(sb, slot);
+    if (!str) return;
 
-    read_ptr(fd, &oldptr);
+    size_t len = strlen(str) + 1;
+    sb->strings = grow(sb->strings, &sb->strings_size, sb->strings_pos + len, 1);
+    memcpy(sb->strings + sb->strings_pos, str, len);
 
-    if (oldptr) {
-        required_ptr_t *p = safe_malloc(sizeof(required_ptr_t));
-        p->old = oldptr;
-        p->pnew = nptr;
+    state_reloc_t *reloc = sb_add_reloc(sb, slot);
+    reloc->is_str = 1;
+    reloc->stroff = sb->strings_pos;
 
-        list_add_tail(&ptr_required, &p->node);
-    } else {
-        *nptr = NULL;
-    }
+    sb->strings_pos += len;
 }
 
-static void register_ptr(void *oldptr, void *newptr, size_t size)
+// the target has to be part of an object by the time the state gets written
+static void sb_set_ptr(state_builder_t *sb, uint32_t slot, const void *ptr)
 {
-    registered_ptr_t *p = safe_malloc(sizeof(registered_ptr_t));
-    p->old = oldptr;
-    p->new = newptr;
-    p->size = size;
+    sb_clear_slot(sb, slot);
+    if (!ptr) return;
 
-    list_add_tail(&ptr_registered, &p->node);
+    sb_add_reloc(sb, slot)->ptr = ptr;
 }
 
-static void *oldptr2newptr(void *oldptr)
+static uint32_t sb_resolve(state_builder_t *sb, const void *ptr)
 {
-    registered_ptr_t *regp;
-    list_for_every_entry(&ptr_registered, regp, registered_ptr_t, node) {
-        if (oldptr>=regp->old && oldptr<regp->old+regp->size) {
-            size_t offset = oldptr - regp->old;
-            return regp->new + offset;
-        }
+    size_t i;
+
+    for (i=0; i<sb->num_objects; i++) {
+        const state_object_t *obj = &sb->objects[i];
+        if ((const char *)ptr>=(const char *)obj->ptr && (const char *)ptr<(const char *)obj->ptr + obj->size)
+            return obj->off + ((const char *)ptr - (const char *)obj->ptr);
     }
 
-    MBABORT("%s: can't find memory for pointer %p\n", __func__, oldptr);
-    return NULL;
+    MBABORT("%s: can't find memory for pointer %p\n", __func__, ptr);
+    return 0;
 }
 
-static void update_required_ptrs(void)
+static void add_loop_tuning(state_builder_t *sb, uint32_t off, const loop_tuning_t *tuning)
 {
-    required_ptr_t *reqp;
-    list_for_every_entry(&ptr_required, reqp, required_ptr_t, node) {
-        void **pnew = reqp->pnew;
+    sb_set_str(sb, SLOT(off, loop_tuning_t, scheduler), tuning->scheduler);
+}
 
-        *pnew = oldptr2newptr(reqp->old);
-    }
+static void add_list_node(state_builder_t *sb, uint32_t off, const list_node_t *node)
+{
+    sb_set_ptr(sb, SLOT(off, list_node_t, prev), node->prev);
+    sb_set_ptr(sb, SLOT(off, list_node_t, next), node->next);
 }
 
-static void write_fstab(int fd, struct fstab *fstab)
+static void add_fstab(state_builder_t *sb, uint32_t slot, const struct fstab *fstab)
 {
+    const struct fstab_arena *block;
+    uint32_t off;
     int i;
 
-    write_ptr(fd, fstab);
+    sb_set_ptr(sb, slot, fstab);
     if (!fstab) return;
 
-    write_primitive(fd, fstab->num_entries);
-    write_ptr(fd, fstab->recs);
-    write_str(fd, fstab->fstab_filename);
-
-    if (fstab->recs) {
-        for (i=0; i<fstab->num_entries; i++) {
-            struct fstab_rec *rec = &fstab->recs[i];
-
-            write_str(fd, rec->blk_device);
-            write_str(fd, rec->mount_point);
-            write_str(fd, rec->fs_type);
-            write_primitive(fd, rec->flags);
-            write_str(fd, rec->fs_options);
-            write_primitive(fd, rec->fs_mgr_flags);
-            write_str(fd, rec->mnt_flags_orig);
-            write_str(fd, rec->fs_mgr_flags_orig);
-            write_str(fd, rec->key_loc);
-            write_str(fd, rec->verity_loc);
-            write_primitive(fd, rec->length);
-            write_str(fd, rec->label);
-            write_primitive(fd, rec->partnum);
-            write_primitive(fd, rec->swap_prio);
-            write_primitive(fd, rec->zram_size);
-            write_primitive(fd, rec->zram_streams);
-            write_str(fd, rec->esp);
-        }
-    }
-}
-
-static void read_fstab(int fd, struct fstab **pfstab)
-{
-    int i;
-    void *oldptr_fstab;
-    void *oldptr_recs;
+    uint32_t fstaboff = sb_add_object(sb, fstab, sizeof(*fstab));
 
-    read_ptr(fd, &oldptr_fstab);
-    if (!oldptr_fstab) {
-        *pfstab = NULL;
-        return;
+    // all strings live in the arena, so the records just point into its blocks
+    sb_set_ptr(sb, SLOT(fstaboff, struct fstab, arena), fstab->arena);
+    for (block=fstab->arena; block; block=block->next) {
+        off = sb_add_object(sb, block, sizeof(*block) + block->size);
+        sb_set_ptr(sb, SLOT(off, struct fstab_arena, next), block->next);
     }
 
-    struct fstab *fstab = safe_malloc(sizeof(struct fstab));
-    register_ptr(oldptr_fstab, fstab, sizeof(*fstab));
-
-    read_primitive(fd, &fstab->num_entries);
-    read_ptr(fd, &oldptr_recs);
-    read_str(fd, &fstab->fstab_filename);
-
-    if (oldptr_recs) {
-        fstab->recs = safe_calloc(fstab->num_entries, sizeof(struct fstab_rec));
-        register_ptr(oldptr_recs, fstab->recs, fstab->num_entries*sizeof(struct fstab_rec));
-
-        for (i=0; i<fstab->num_entries; i++) {
-            struct fstab_rec *rec = &fstab->recs[i];
-
-            read_str(fd, &rec->blk_device);
-            read_str(fd, &rec->mount_point);
-            read_str(fd, &rec->fs_type);
-            read_primitive(fd, &rec->flags);
-            read_str(fd, &rec->fs_options);
-            read_primitive(fd, &rec->fs_mgr_flags);
-            read_str(fd, &rec->mnt_flags_orig);
-            read_str(fd, &rec->fs_mgr_flags_orig);
-            read_str(fd, &rec->key_loc);
-            read_str(fd, &rec->verity_loc);
-            read_primitive(fd, &rec->length);
-            read_str(fd, &rec->label);
-            read_primitive(fd, &rec->partnum);
-            read_primitive(fd, &rec->swap_prio);
-            read_primitive(fd, &rec->zram_size);
-            read_primitive(fd, &rec->zram_streams);
-            read_str(fd, &rec->esp);
-        }
-    } else {
-        fstab->recs = NULL;
+    // the index only contains positions
+    sb_set_ptr(sb, SLOT(fstaboff, struct fstab, index), fstab->index);
+    if (fstab->index)
+        sb_add_object(sb, fstab->index, fstab->index->size);
+
+    sb_set_ptr(sb, SLOT(fstaboff, struct fstab, fstab_filename), fstab->fstab_filename);
+    sb_set_ptr(sb, SLOT(fstaboff, struct fstab, recs), fstab->recs);
+    if (!fstab->recs) return;
+
+    uint32_t recsoff = sb_add_object(sb, fstab->recs, fstab->num_entries*sizeof(struct fstab_rec));
+    for (i=0; i<fstab->num_entries; i++) {
+        const struct fstab_rec *rec = &fstab->recs[i];
+        uint32_t recoff = recsoff + i*sizeof(struct fstab_rec);
+
+        sb_set_ptr(sb, SLOT(recoff, struct fstab_rec, blk_device), rec->blk_device);
+        sb_set_ptr(sb, SLOT(recoff, struct fstab_rec, mount_point), rec->mount_point);
+        sb_set_ptr(sb, SLOT(recoff, struct fstab_rec, fs_type), rec->fs_type);
+        sb_set_ptr(sb, SLOT(recoff, struct fstab_rec, fs_options), rec->fs_options);
+        sb_set_ptr(sb, SLOT(recoff, struct fstab_rec, mnt_flags_orig), rec->mnt_flags_orig);
+        sb_set_ptr(sb, SLOT(recoff, struct fstab_rec, fs_mgr_flags_orig), rec->fs_mgr_flags_orig);
+        sb_set_ptr(sb, SLOT(recoff, struct fstab_rec, key_loc), rec->key_loc);
+        sb_set_ptr(sb, SLOT(recoff, struct fstab_rec, verity_loc), rec->verity_loc);
+        sb_set_ptr(sb, SLOT(recoff, struct fstab_rec, label), rec->label);
+        sb_set_ptr(sb, SLOT(recoff, struct fstab_rec, esp), rec->esp);
     }
-
-    *pfstab = fstab;
 }
 
-static void write_blockinfo(int fd, list_node_t *blockinfo)
+static void add_blockinfo(state_builder_t *sb, uint32_t slot, const list_node_t *blockinfo)
 {
-    write_ptr(fd, blockinfo);
+    sb_set_ptr(sb, slot, blockinfo);
     if (!blockinfo) return;
 
-    size_t listlen = list_length(blockinfo);
-    write_primitive(fd, listlen);
+    uint32_t off = sb_add_object(sb, blockinfo, sizeof(*blockinfo));
+    add_list_node(sb, off, blockinfo);
 
     uevent_block_t *block;
     list_for_every_entry(blockinfo, block, uevent_block_t, node) {
-        write_ptr(fd, block);
-
-        write_str(fd, block->filename);
-        write_primitive(fd, block->major);
-        write_primitive(fd, block->minor);
-        write_primitive(fd, block->partn);
-        write_str(fd, block->devname);
-        write_str(fd, block->partname);
-        write_primitive(fd, block->type);
-    }
-}
+        uint32_t blockoff = sb_add_object(sb, block, sizeof(*block));
 
-static void read_blockinfo(int fd, list_node_t **pblockinfo)
-{
-    uint32_t i;
-    void *oldptr;
-    size_t listlen;
-
-    read_ptr(fd, &oldptr);
-    if (!oldptr) {
-        *pblockinfo = NULL;
-        return;
-    }
-    list_node_t *blockinfo = safe_calloc(sizeof(list_node_t), 1);
-    register_ptr(oldptr, blockinfo, sizeof(*blockinfo));
-    list_initialize(blockinfo);
-
-    read_primitive(fd, &listlen);
-    for (i=0; i<listlen; i++) {
-        void *oldptr_block;
-
-        read_ptr(fd, &oldptr_block);
-        if (!oldptr_block) {
-            MBABORT("%s: NULL block\n", __func__);
-            return;
-        }
-        uevent_block_t *block = safe_calloc(sizeof(uevent_block_t), 1);
-        register_ptr(oldptr_block, block, sizeof(*block));
-
-        read_str(fd, &block->filename);
-        read_primitive(fd, &block->major);
-        read_primitive(fd, &block->minor);
-        read_primitive(fd, &block->partn);
-        read_str(fd, &block->devname);
-        read_str(fd, &block->partname);
-        read_primitive(fd, &block->type);
-
-        list_add_tail(blockinfo, &block->node);
+        add_list_node(sb, SLOT(blockoff, uevent_block_t, node), &block->node);
+        sb_set_str(sb, SLOT(blockoff, uevent_block_t, filename), block->filename);
+        sb_set_str(sb, SLOT(blockoff, uevent_block_t, devname), block->devname);
+        sb_set_str(sb, SLOT(blockoff, uevent_block_t, partname), block->partname);
     }
 }
 
-static void write_replacements(int fd, list_node_t *replacements)
+static void add_replacements(state_builder_t *sb, uint32_t slot, const list_node_t *replacements)
 {
-    write_ptr(fd, replacements);
-    if (!replacements) return;
-
-    size_t listlen = list_length(replacements);
-    write_primitive(fd, listlen);
+    add_list_node(sb, slot, replacements);
 
     part_replacement_t *replacement;
     list_for_every_entry(replacements, replacement, part_replacement_t, node) {
-        write_ptr(fd, replacement);
-
-        write_ptr(fd, replacement->uevent_block);
-        write_primitive(fd, replacement->mountmode);
-        write_primitive(fd, replacement->iomode);
-        write_str(fd, replacement->bindsource);
-        write_primitive(fd, replacement->losetup_done);
-        write_str(fd, replacement->loopdevice);
-        write_str(fd, replacement->loopfile);
-        write_str(fd, replacement->loop_sync_target);
+        uint32_t off = sb_add_object(sb, replacement, sizeof(*replacement));
+
+        add_list_node(sb, SLOT(off, part_replacement_t, node), &replacement->node);
+        sb_set_ptr(sb, SLOT(off, part_replacement_t, uevent_block), replacement->uevent_block);
+        sb_set_str(sb, SLOT(off, part_replacement_t, bindsource), replacement->bindsource);
+        sb_set_str(sb, SLOT(off, part_replacement_t, loopdevice), replacement->loopdevice);
+        add_loop_tuning(sb, SLOT(off, part_replacement_t, loop_tuning), &replacement->loop_tuning);
+        sb_set_str(sb, SLOT(off, part_replacement_t, loopfile), replacement->loopfile);
+        sb_set_str(sb, SLOT(off, part_replacement_t, loop_sync_target), replacement->loop_sync_target);
+        sb_set_str(sb, SLOT(off, part_replacement_t, chunkstore_image), replacement->chunkstore_image);
     }
 }
 
-static void read_replacements(int fd, list_node_t *replacements)
+static void add_multiboot_partitions(state_builder_t *sb, uint32_t slot, const multiboot_partition_t *mbparts, uint32_t num_mbparts)
 {
     uint32_t i;
-    size_t listlen;
-    void *oldptr_replacements;
-
-    read_ptr(fd, &oldptr_replacements);
-    if (!replacements) {
-        MBABORT("%s: NULL replacements\n", __func__);
-        return;
-    }
-    register_ptr(oldptr_replacements, replacements, sizeof(*replacements));
-    list_initialize(replacements);
-
-    read_primitive(fd, &listlen);
-    for (i=0; i<listlen; i++) {
-        void *oldptr_replacement;
-
-        read_ptr(fd, &oldptr_replacement);
-        if (!oldptr_replacement) {
-            MBABORT("%s: NULL replacement\n", __func__);
-            return;
-        }
-        part_replacement_t *replacement = safe_calloc(sizeof(part_replacement_t), 1);
-        register_ptr(oldptr_replacement, replacement, sizeof(*replacement));
-
-        pthread_mutex_init(&replacement->lock, NULL);
-        require_ptr(fd, (void **)&replacement->uevent_block);
-        read_primitive(fd, &replacement->mountmode);
-        read_primitive(fd, &replacement->iomode);
-        read_str(fd, &replacement->bindsource);
-        read_primitive(fd, &replacement->losetup_done);
-        read_str(fd, &replacement->loopdevice);
-        read_str(fd, &replacement->loopfile);
-        read_str(fd, &replacement->loop_sync_target);
-
-        list_add_tail(replacements, &replacement->node);
-    }
-}
 
-static void write_multiboot_partitions(int fd, multiboot_partition_t *mbparts, uint32_t num_mbparts)
-{
-    uint32_t i;
+    sb_set_ptr(sb, slot, mbparts);
+    if (!mbparts) return;
 
+    uint32_t off = sb_add_object(sb, mbparts, num_mbparts*sizeof(*mbparts));
     for (i=0; i<num_mbparts; i++) {
-        multiboot_partition_t *part = &mbparts[i];
+        const multiboot_partition_t *part = &mbparts[i];
+        uint32_t partoff = off + i*sizeof(*part);
 
-        write_str(fd, part->name);
-        write_str(fd, part->path);
-        write_primitive(fd, part->type);
-        write_ptr(fd, part->uevent_block);
+        sb_set_str(sb, SLOT(partoff, multiboot_partition_t, name), part->name);
+        sb_set_str(sb, SLOT(partoff, multiboot_partition_t, path), part->path);
+        sb_set_ptr(sb, SLOT(partoff, multiboot_partition_t, uevent_block), part->uevent_block);
+        add_loop_tuning(sb, SLOT(partoff, multiboot_partition_t, loop_tuning), &part->loop_tuning);
     }
 }
 
-static void read_multiboot_partitions(int fd, multiboot_partition_t *mbparts, uint32_t num_mbparts)
+// the file is only valid for the binary that wrote it
+static uint32_t state_layout(void)
 {
-    uint32_t i;
-
-    for (i=0; i<num_mbparts; i++) {
-        multiboot_partition_t *part = &mbparts[i];
-
-        read_str(fd, &part->name);
-        read_str(fd, &part->path);
-        read_primitive(fd, &part->type);
-        require_ptr(fd, (void **)&part->uevent_block);
-    }
+    const uint32_t sizes[] = {
+        sizeof(void *),
+        sizeof(multiboot_data_t),
+        sizeof(part_replacement_t),
+        sizeof(multiboot_partition_t),
+        sizeof(uevent_block_t),
+        sizeof(struct fstab),
+        sizeof(struct fstab_rec),
+        sizeof(struct fstab_arena),
+        sizeof(struct fstab_index),
+    };
+
+    return cksum_crc32(0, (const unsigned char *)sizes, sizeof(sizes));
 }
 
-
 int state_save(void)
 {
     multiboot_data_t *multiboot_data = multiboot_get_data();
+    state_builder_t sb;
+    state_header_t hdr;
+    uint32_t *relocs;
+    size_t i;
+    int rc = -1;
+
+    memset(&sb, 0, sizeof(sb));
+
+    uint32_t root = sb_add_object(&sb, multiboot_data, sizeof(*multiboot_data));
+    sb_set_ptr(&sb, SLOT(root, multiboot_data_t, esp), multiboot_data->esp);
+    sb_set_ptr(&sb, SLOT(root, multiboot_data_t, espdev), multiboot_data->espdev);
+    add_fstab(&sb, SLOT(root, multiboot_data_t, mbfstab), multiboot_data->mbfstab);
+    add_blockinfo(&sb, SLOT(root, multiboot_data_t, blockinfo), multiboot_data->blockinfo);
+    sb_set_str(&sb, SLOT(root, multiboot_data_t, hwname), multiboot_data->hwname);
+    sb_set_str(&sb, SLOT(root, multiboot_data_t, slot_suffix), multiboot_data->slot_suffix);
+    add_fstab(&sb, SLOT(root, multiboot_data_t, romfstab), multiboot_data->romfstab);
+    sb_set_str(&sb, SLOT(root, multiboot_data_t, romfstabpath), multiboot_data->romfstabpath);
+    add_replacements(&sb, SLOT(root, multiboot_data_t, replacements), &multiboot_data->replacements);
+    sb_set_str(&sb, SLOT(root, multiboot_data_t, guid), multiboot_data->guid);
+    sb_set_str(&sb, SLOT(root, multiboot_data_t, path), multiboot_data->path);
+    sb_set_str(&sb, SLOT(root, multiboot_data_t, pttype), multiboot_data->pttype);
+    sb_set_ptr(&sb, SLOT(root, multiboot_data_t, bootdev), multiboot_data->bootdev);
+    add_multiboot_partitions(&sb, SLOT(root, multiboot_data_t, mbparts), multiboot_data->mbparts, multiboot_data->num_mbparts);
+    add_loop_tuning(&sb, SLOT(root, multiboot_data_t, loop_tuning), &multiboot_data->loop_tuning);
+    sb_set_str(&sb, SLOT(root, multiboot_data_t, datamedia_source), multiboot_data->datamedia_source);
+    sb_set_str(&sb, SLOT(root, multiboot_data_t, datamedia_target), multiboot_data->datamedia_target);
+
+    // layout: header, objects, strings, relocations
+    uint32_t objects_off = STATE_ALIGN(sizeof(hdr));
+    uint32_t strings_off = objects_off + sb.pos;
+    uint32_t relocs_off = STATE_ALIGN(strings_off + sb.strings_pos);
+
+    // turn all references into file offsets
+    relocs = safe_calloc(sb.num_relocs ?: 1, sizeof(*relocs));
+    for (i=0; i<sb.num_relocs; i++) {
+        const state_reloc_t *reloc = &sb.relocs[i];
+        uintptr_t value;
+
+        if (reloc->is_str)
+            value = strings_off + reloc->stroff;
+        else
+            value = objects_off + sb_resolve(&sb, reloc->ptr);
+
+        memcpy(sb.data + reloc->slot, &value, sizeof(value));
+        relocs[i] = objects_off + reloc->slot;
+    }
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = STATE_MAGIC;
+    hdr.version = STATE_VERSION;
+    hdr.layout = state_layout();
+    hdr.size = relocs_off + sb.num_relocs*sizeof(*relocs);
+    hdr.root = objects_off + root;
+    hdr.strings_off = strings_off;
+    hdr.strings_size = sb.strings_pos;
+    hdr.relocs_off = relocs_off;
+    hdr.num_relocs = sb.num_relocs;
+
+    static const char padding[8];
+    struct iovec iov[] = {
+        {&hdr, sizeof(hdr)},
+        {(void *)padding, objects_off - sizeof(hdr)},
+        {sb.data, sb.pos},
+        {sb.strings, sb.strings_pos},
+        {(void *)padding, relocs_off - (strings_off + sb.strings_pos)},
+        {relocs, sb.num_relocs*sizeof(*relocs)},
+    };
 
     // open state file
     int fd = open(MBPATH_STATEFILE, O_WRONLY|O_TRUNC|O_CREAT, 0700);
     if (fd<0) {
-        return -1;
+        goto out;
     }
 
-    write_primitive(fd, multiboot_data->is_multiboot);
-    write_primitive(fd, multiboot_data->is_recovery);
-    write_ptr(fd, multiboot_data->esp);
-    write_ptr(fd, multiboot_data->espdev);
-    write_fstab(fd, multiboot_data->mbfstab);
-    write_blockinfo(fd, multiboot_data->blockinfo);
-    write_str(fd, multiboot_data->hwname);
-    write_str(fd, multiboot_data->slot_suffix);
-    write_fstab(fd, multiboot_data->romfstab);
-    write_str(fd, multiboot_data->romfstabpath);
-    write_replacements(fd, &multiboot_data->replacements);
-    write_str(fd, multiboot_data->guid);
-    write_str(fd, multiboot_data->path);
-    write_str(fd, multiboot_data->pttype);
-    write_ptr(fd, multiboot_data->bootdev);
-    write_primitive(fd, multiboot_data->bootdev_supports_bindmount);
-
-    write_primitive(fd, multiboot_data->num_mbparts);
-    write_ptr(fd, multiboot_data->mbparts);
-    if (multiboot_data->mbparts) {
-        write_multiboot_partitions(fd, multiboot_data->mbparts, multiboot_data->num_mbparts);
+    ssize_t num_bytes = writev(fd, iov, ARRAY_SIZE(iov));
+    if (num_bytes<0 || (size_t)num_bytes!=hdr.size) {
+        LOGE("%s: %s\n", __func__, strerror(errno));
+        close(fd);
+        goto out;
     }
 
-    write_primitive(fd, multiboot_data->native_data_layout_version);
-    write_str(fd, multiboot_data->datamedia_source);
-    write_str(fd, multiboot_data->datamedia_target);
-
-
     // close state file
     close(fd);
+    rc = 0;
 
-    return 0;
+out:
+    free(relocs);
+    free(sb.data);
+    free(sb.strings);
+    free(sb.objects);
+    free(sb.relocs);
+
+    return rc;
 }
 
 int state_restore(void)
 {
     multiboot_data_t *multiboot_data = multiboot_get_data();
-    void *oldptr_mbparts;
+    struct stat sb;
+    uint32_t i;
 
     // open state file
     int fd = open(MBPATH_STATEFILE, O_RDONLY);
@@ -420,44 +396,63 @@ int state_restore(void)
         return -1;
     }
 
-    pthread_mutex_init(&multiboot_data->lock, NULL);
+    if (fstat(fd, &sb) || (size_t)sb.st_size<sizeof(state_header_t)) {
+        close(fd);
+        return -1;
+    }
+
+    // private, so relocating doesn't touch the file. this stays mapped for the lifetime of the process.
+    char *base = mmap(NULL, sb.st_size, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base==MAP_FAILED) {
+        LOGE("%s: can't map state: %s\n", __func__, strerror(errno));
+        return -1;
+    }
 
-    list_initialize(&ptr_registered);
-    list_initialize(&ptr_required);
-
-    read_primitive(fd, &multiboot_data->is_multiboot);
-    read_primitive(fd, &multiboot_data->is_recovery);
-    require_ptr(fd, (void **)&multiboot_data->esp);
-    require_ptr(fd, (void **)&multiboot_data->espdev);
-    read_fstab(fd, &multiboot_data->mbfstab);
-    read_blockinfo(fd, &multiboot_data->blockinfo);
-    read_str(fd, &multiboot_data->hwname);
-    read_str(fd, &multiboot_data->slot_suffix);
-    read_fstab(fd, &multiboot_data->romfstab);
-    read_str(fd, &multiboot_data->romfstabpath);
-    read_replacements(fd, &multiboot_data->replacements);
-    read_str(fd, &multiboot_data->guid);
-    read_str(fd, &multiboot_data->path);
-    read_str(fd, &multiboot_data->pttype);
-    require_ptr(fd, (void **)&multiboot_data->bootdev);
-    read_primitive(fd, &multiboot_data->bootdev_supports_bindmount);
-
-    read_primitive(fd, &multiboot_data->num_mbparts);
-    read_ptr(fd, &oldptr_mbparts);
-    if (oldptr_mbparts) {
-        multiboot_data->mbparts = safe_calloc(multiboot_data->num_mbparts, sizeof(multiboot_partition_t));
-        register_ptr(oldptr_mbparts, multiboot_data->mbparts, multiboot_data->num_mbparts*sizeof(multiboot_partition_t));
-        read_multiboot_partitions(fd, multiboot_data->mbparts, multiboot_data->num_mbparts);
+    const state_header_t *hdr = (const state_header_t *)base;
+    if (hdr->magic!=STATE_MAGIC || hdr->version!=STATE_VERSION || hdr->layout!=state_layout() || hdr->size!=sb.st_size
+        || hdr->root > hdr->size - sizeof(multiboot_data_t) || hdr->relocs_off > hdr->size
+        || hdr->num_relocs > (hdr->size - hdr->relocs_off) / sizeof(uint32_t))
+    {
+        LOGE("%s: invalid state file\n", __func__);
+        munmap(base, sb.st_size);
+        return -1;
     }
 
-    read_primitive(fd, &multiboot_data->native_data_layout_version);
-    read_str(fd, (char **)&multiboot_data->datamedia_source);
-    read_str(fd, (char **)&multiboot_data->datamedia_target);
+    // relocate
+    const uint32_t *relocs = (const uint32_t *)(base + hdr->relocs_off);
+    for (i=0; i<hdr->num_relocs; i++) {
+        uintptr_t value;
 
-    update_required_ptrs();
+        if (relocs[i] > hdr->size - sizeof(value)) {
+            MBABORT("%s: invalid relocation %u\n", __func__, relocs[i]);
+        }
 
-    // close state file
-    close(fd);
+        memcpy(&value, base + relocs[i], sizeof(value));
+        if (value==0 || value>=hdr->size) {
+            MBABORT("%s: invalid reference %lu\n", __func__, (unsigned long)value);
+        }
+
+        value += (uintptr_t)base;
+        memcpy(base + relocs[i], &value, sizeof(value));
+    }
+
+    multiboot_data_t *root = (multiboot_data_t *)(base + hdr->root);
+    memcpy(multiboot_data, root, sizeof(*multiboot_data));
+    pthread_mutex_init(&multiboot_data->lock, NULL);
+
+    // the list head moved out of the mapping
+    if (multiboot_data->replacements.next==&root->replacements) {
+        list_initialize(&multiboot_data->replacements);
+    } else {
+        multiboot_data->replacements.next->prev = &multiboot_data->replacements;
+        multiboot_data->replacements.prev->next = &multiboot_data->replacements;
+    }
+
+    part_replacement_t *replacement;
+    list_for_every_entry(&multiboot_data->replacements, replacement, part_replacement_t, node) {
+        pthread_mutex_init(&replacement->lock, NULL);
+    }
 
     return 0;
 }
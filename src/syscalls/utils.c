@@ -17,6 +17,7 @@
 #include <lib/mounts.h>
 #include <common.h>
 #include <util.h>
+#include <chunkstore.h>
 
 #include "syscalls_private.h"
 
@@ -244,34 +245,41 @@ int lindev_from_mountpoint(const char *mountpoint, unsigned *major, unsigned *mi
 {
     int rc;
     const mounted_volume_t *volume;
-    mounts_state_t mounts_state = LIST_INITIAL_VALUE(mounts_state);
 
-    rc = scan_mounted_volumes(&mounts_state);
-    if (rc) {
+    mounts_state_t *mounts_state = mounts_cache_get();
+    if (!mounts_state) {
         MBABORT("Can't scan mounted volumes\n");
     }
 
-    volume =  find_mounted_volume_by_mount_point(&mounts_state, mountpoint);
+    volume =  find_mounted_volume_by_mount_point(mounts_state, mountpoint);
     if (!volume) {
         rc = -ENOENT;
     } else {
         *major = volume->major;
         *minor = volume->minor;
 
-        // free mount state
-        free_mounts_state(&mounts_state);
-
         rc = 0;
     }
 
-    return 0;
+    mounts_cache_put();
+
+    return rc;
+}
+
+// with the chunk store, only the changed chunks end up on the ESP
+static int syshookutil_copy_to_esp(const char *loopdevice, const char *espfilename)
+{
+    if (chunkstore_enabled(espfilename))
+        return chunkstore_import(loopdevice, espfilename);
+
+    return util_dd(loopdevice, espfilename, 0);
 }
 
 static int syshookutil_handle_close_synctarget(part_replacement_t *replacement)
 {
     int rc;
     const char *mountpoint = NULL;
-    mounts_state_t mounts_state = LIST_INITIAL_VALUE(mounts_state);
+    char esp_mount_point[PATH_MAX];
 
     if (replacement) {
         LOGI("%s has changed. syncing ESP replacement\n", replacement->loopdevice);
@@ -279,17 +287,20 @@ static int syshookutil_handle_close_synctarget(part_replacement_t *replacement)
         LOGI("ESP dev got closed. syncing ALL ESP replacements\n");
     }
 
-    // scan mounted volumes
-    rc = scan_mounted_volumes(&mounts_state);
-    if (rc) {
+    // find esp
+    mounts_state_t *mounts_state = mounts_cache_get();
+    if (!mounts_state) {
         MBABORT("Can't scan mounted volumes: %s\n", strerror(errno));
         return -1;
     }
+    const mounted_volume_t *volume = find_mounted_volume_by_majmin(mounts_state, syshook_multiboot_data->espdev->major, syshook_multiboot_data->espdev->minor, 0);
+    if (volume) {
+        SAFE_SNPRINTF_RET(MBABORT, -1, esp_mount_point, sizeof(esp_mount_point), "%s", volume->mount_point);
+    }
+    mounts_cache_put();
 
-    // find esp
-    const mounted_volume_t *volume = find_mounted_volume_by_majmin(&mounts_state, syshook_multiboot_data->espdev->major, syshook_multiboot_data->espdev->minor, 0);
     if (volume) {
-        mountpoint = volume->mount_point;
+        mountpoint = esp_mount_point;
     } else {
         // mount ESP
         util_mount_esp(1);
@@ -305,7 +316,7 @@ static int syshookutil_handle_close_synctarget(part_replacement_t *replacement)
         }
 
         // copy loop to esp
-        rc = util_dd(replacement->loopdevice, espfilename, 0);
+        rc = syshookutil_copy_to_esp(replacement->loopdevice, espfilename);
         if (rc) {
             MBABORT("Can't dd %s to %s\n", replacement->loopdevice, espfilename);
         }
@@ -336,7 +347,7 @@ static int syshookutil_handle_close_synctarget(part_replacement_t *replacement)
 
             // copy loop to esp
             if (!util_exists(replacement->loop_sync_target, false)) {
-                rc = util_dd(replacement->loopdevice, espfilename, 0);
+                rc = syshookutil_copy_to_esp(replacement->loopdevice, espfilename);
                 if (rc) {
                     MBABORT("Can't dd %s to %s\n", replacement->loopdevice, espfilename);
                 }
@@ -352,9 +363,6 @@ static int syshookutil_handle_close_synctarget(part_replacement_t *replacement)
     if (!volume) {
         // unmount ESP
         SAFE_UMOUNT(MBPATH_ESP);
-    } else {
-        // free mount state
-        free_mounts_state(&mounts_state);
     }
 
     return 0;
@@ -14,6 +14,7 @@
  * limitations under the License.
 */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <ctype.h>
 #include <stdlib.h>
@@ -22,27 +23,44 @@
 #include <unistd.h>
 #include <limits.h>
 #include <errno.h>
+#include <time.h>
+#include <inttypes.h>
 #include <libgen.h>
+#include <pthread.h>
+#include <spawn.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
 #include <sys/mount.h>
 #include <sys/syscall.h>
 #include <sys/param.h>
+#include <sys/ioctl.h>
+#include <linux/loop.h>
 
 #include <lib/klog.h>
 #include <lib/fs_mgr.h>
+#include <lib/mounts.h>
 #include <lib/dynfilefs.h>
 #include <blkid/blkid.h>
 #include <ini.h>
 
 #include <common.h>
 #include <util.h>
+#include <chunkstore.h>
 
 #define LOG_TAG "UTIL"
 #include <lib/log.h>
 
 #define ROUNDUP(a, b) (((a) + ((b)-1)) & ~((b)-1))
 
+#ifndef FICLONE
+#define FICLONE _IOW(0x94, 9, int)
+#endif
+
+#ifndef SEEK_DATA
+#define SEEK_DATA 3
+#define SEEK_HOLE 4
+#endif
+
 char *util_basename(const char *path)
 {
     // duplicate input path
@@ -185,21 +203,90 @@ done:
     return rc;
 }
 
-int util_exec_main(int argc, char **argv, int (*mainfn)(int, char **))
+static uint64_t util_time_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec*1000000llu + ts.tv_nsec/1000;
+}
+
+static const struct {
+    int (*mainfn)(int, char **);
+    const char *name;
+} applets[] = {
+    {busybox_main, "busybox"},
+    {mke2fs_main, "mke2fs"},
+    {dynfilefs_main, "dynfilefs"},
+    {chunkfs_main, "chunkfs"},
+};
+
+static uint32_t exec_count;
+static uint64_t exec_total_us;
+
+// runs the applet in a fresh image of ourselves, so we don't have to copy our address space
+static pid_t util_spawn_applet(int argc, char **argv, const char *applet)
 {
     pid_t pid;
+    int i, n = 0;
+    int rc;
+
+    const char **args = safe_calloc(argc + 3, sizeof(*args));
+    args[n++] = "multiboot_init";
+    // main() passes argv+1, so the applet name doubles as argv[0] if it isn't there already
+    if (strcmp(argv[0], applet))
+        args[n++] = applet;
+    for (i=0; i<argc; i++) {
+        args[n++] = argv[i];
+    }
+    args[n] = NULL;
+
+    rc = posix_spawn(&pid, MBPATH_PROC"/self/exe", NULL, NULL, (char **)args, environ);
+    free(args);
+    if (rc) {
+        LOGV("can't spawn %s: %s\n", applet, strerror(rc));
+        return -1;
+    }
+
+    return pid;
+}
+
+int util_exec_main(int argc, char **argv, int (*mainfn)(int, char **))
+{
+    pid_t pid = -1;
     int status = 0;
+    const char *method = "fork";
+    uint32_t i;
 
-    pid = safe_fork();
-    if (!pid) {
-        optind = 1;
-        opterr = 1;
-        optopt = '?';
-        exit(mainfn(argc, argv));
-    } else {
-        waitpid(pid, &status, 0);
+    uint64_t starttime = util_time_us();
+
+    for (i=0; i<ARRAY_SIZE(applets); i++) {
+        if (applets[i].mainfn==mainfn) {
+            pid = util_spawn_applet(argc, argv, applets[i].name);
+            method = "spawn";
+            break;
+        }
     }
 
+    // unknown applets and missing procfs need the old way
+    if (pid<0) {
+        method = "fork";
+        pid = safe_fork();
+        if (!pid) {
+            optind = 1;
+            opterr = 1;
+            optopt = '?';
+            exit(mainfn(argc, argv));
+        }
+    }
+
+    waitpid(pid, &status, 0);
+
+    // the mbpart workers run applets concurrently
+    uint64_t us = util_time_us() - starttime;
+    uint32_t count = __sync_add_and_fetch(&exec_count, 1);
+    uint64_t total_us = __sync_add_and_fetch(&exec_total_us, us);
+    LOGD("%s: %s took %"PRIu64"us (%u calls, %"PRIu64"us total)\n", argv[0], method, us, count, total_us);
+
     return status;
 }
 
@@ -278,59 +365,439 @@ int util_mount(const char *source, const char *target,
         return -1;
     }
 
+    // our own mounts invalidate the table without waiting for poll
+    mounts_cache_invalidate();
+
     // cleanup
     free(util_fstype);
 
     return rc;
 }
 
-int util_make_loop(const char *path)
+// LOOP_CONFIGURE was added in linux 5.8, LOOP_SET_BLOCK_SIZE in 4.14,
+// LOOP_SET_DIRECT_IO in 4.4 and loop-control in 3.1
+#ifndef LOOP_CTL_GET_FREE
+#define LOOP_CTL_ADD 0x4C80
+#define LOOP_CTL_GET_FREE 0x4C82
+#endif
+#ifndef LOOP_SET_DIRECT_IO
+#define LOOP_SET_DIRECT_IO 0x4C08
+#define LO_FLAGS_DIRECT_IO 16
+#endif
+#ifndef LOOP_SET_BLOCK_SIZE
+#define LOOP_SET_BLOCK_SIZE 0x4C09
+#endif
+#ifndef LOOP_CONFIGURE
+#define LOOP_CONFIGURE 0x4C0A
+struct loop_config {
+    uint32_t fd;
+    uint32_t block_size;
+    struct loop_info64 info;
+    uint64_t __reserved[8];
+};
+#endif
+
+#define LOOP_MAJOR 7
+#define LOOP_MINOR_MAX (1<<20)
+#define LOOP_PROBE_PATH MBPATH_DEV"/loop-probe"
+
+static pthread_mutex_t loop_lock = PTHREAD_MUTEX_INITIALIZER;
+static int loop_control_fd = -1;
+static int *loop_minors = NULL;
+static size_t loop_minors_count = 0;
+
+static int loop_minor_is_reserved(int minor)
+{
+    size_t i;
+
+    for (i=0; i<loop_minors_count; i++) {
+        if (loop_minors[i]==minor)
+            return 1;
+    }
+
+    return 0;
+}
+
+static void loop_reserve_minor(int minor)
+{
+    loop_minors = realloc(loop_minors, (loop_minors_count+1) * sizeof(*loop_minors));
+    if (!loop_minors) {
+        MBABORT("Can't allocate memory for loop minors\n");
+    }
+
+    loop_minors[loop_minors_count++] = minor;
+}
+
+static void loop_release_minor(int minor)
+{
+    size_t i;
+
+    for (i=0; i<loop_minors_count; i++) {
+        if (loop_minors[i]==minor) {
+            loop_minors[i] = loop_minors[--loop_minors_count];
+            return;
+        }
+    }
+}
+
+// returns 0 if nothing is attached to the loop, 1 if it's in use and -1 if we can't tell
+static int loop_probe_minor(int minor)
 {
-    static int loops_created = 0;
-    int minor = 255 - loops_created;
+    struct loop_info64 info;
+    int fd;
     int rc;
 
+    unlink(LOOP_PROBE_PATH);
+    if (mknod(LOOP_PROBE_PATH, S_IRUSR | S_IWUSR | S_IFBLK, makedev(LOOP_MAJOR, minor)))
+        return -1;
+
+    fd = open(LOOP_PROBE_PATH, O_RDONLY|O_CLOEXEC);
+    unlink(LOOP_PROBE_PATH);
+    if (fd<0)
+        return -1;
+
+    rc = ioctl(fd, LOOP_GET_STATUS64, &info);
+    if (rc && errno==ENXIO)
+        rc = 0;
+    else if (!rc)
+        rc = 1;
+    close(fd);
+
+    return rc;
+}
+
+static int loop_get_control_fd(void)
+{
+    if (loop_control_fd>=0)
+        return loop_control_fd;
+
     // create node
-    rc = mknod(path, S_IRUSR | S_IWUSR | S_IFBLK, makedev(7, minor));
+    if (!util_exists(MBPATH_DEV"/loop-control", false)) {
+        if (mknod(MBPATH_DEV"/loop-control", S_IRUSR | S_IWUSR | S_IFCHR, makedev(10, 237))) {
+            return -1;
+        }
+    }
+
+    loop_control_fd = open(MBPATH_DEV"/loop-control", O_RDWR|O_CLOEXEC);
+    return loop_control_fd;
+}
+
+// returns 0 on success, 1 if the minor is taken already
+static int loop_try_add(int fd, int minor)
+{
+    if (loop_minor_is_reserved(minor))
+        return 1;
+
+    if (ioctl(fd, LOOP_CTL_ADD, minor)>=0)
+        return 0;
+
+    if (errno==EEXIST)
+        return 1;
+
+    LOGE("LOOP_CTL_ADD(%d): %s\n", minor, strerror(errno));
+    return -1;
+}
+
+static int loop_alloc_minor(bool attach_later)
+{
+    int fd;
+    int minor;
+    int rc;
+
+    fd = loop_get_control_fd();
+
+    // kernels without loop-control create the device on first open,
+    // count down from the top so we don't take loops the ROM expects to be free
+    if (fd<0) {
+        for (minor=255; minor>=0; minor--) {
+            if (!loop_minor_is_reserved(minor) && !loop_probe_minor(minor))
+                return minor;
+        }
+        return -1;
+    }
+
+    if (!attach_later) {
+        minor = ioctl(fd, LOOP_CTL_GET_FREE);
+        if (minor<0) {
+            LOGE("LOOP_CTL_GET_FREE: %s\n", strerror(errno));
+            return -1;
+        }
+
+        // the kernel returns the lowest unbound loop, which may be one we handed
+        // out but which didn't get attached yet
+        if (!loop_minor_is_reserved(minor))
+            return minor;
+    }
+
+    // add a new device. the ROM takes free loops via LOOP_CTL_GET_FREE which starts
+    // at the lowest one, so unattached loops have to live at the top
+    for (minor=255; minor>=0; minor--) {
+        rc = loop_try_add(fd, minor);
+        if (rc<=0) return rc ? rc : minor;
+    }
+    for (minor=256; minor<LOOP_MINOR_MAX; minor++) {
+        rc = loop_try_add(fd, minor);
+        if (rc<=0) return rc ? rc : minor;
+    }
+
+    return -1;
+}
+
+int util_make_loop_ex(const char *path, bool attach_later)
+{
+    int rc = -1;
+    int minor;
+
+    pthread_mutex_lock(&loop_lock);
+
+    // get free minor
+    minor = loop_alloc_minor(attach_later);
+    if (minor<0) {
+        LOGE("no free loop device for %s\n", path);
+        errno = ENODEV;
+        goto out;
+    }
+
+    // create node
+    rc = mknod(path, S_IRUSR | S_IWUSR | S_IFBLK, makedev(LOOP_MAJOR, minor));
     if (rc) {
-        return rc;
+        goto out;
     }
 
-    // increase count
-    loops_created++;
+    loop_reserve_minor(minor);
+    LOGV("created loop%d at %s\n", minor, path);
 
+out:
+    pthread_mutex_unlock(&loop_lock);
     return rc;
 }
 
-int util_losetup(const char *_device, const char *_file, bool ro)
+int util_make_loop(const char *path)
 {
-    char *par[64];
-    int i = 0;
+    return util_make_loop_ex(path, false);
+}
+
+void util_loop_tuning_init(loop_tuning_t *tuning)
+{
+    tuning->direct_io = -1;
+    tuning->block_size = -1;
+    tuning->nr_requests = -1;
+    tuning->read_ahead_kb = -1;
+    tuning->scheduler = NULL;
+}
+
+int util_loop_tuning_set(loop_tuning_t *tuning, const char *name, const char *value)
+{
+    char *endptr = NULL;
+    long val;
+
+    if (!strcmp(name, "scheduler")) {
+        free(tuning->scheduler);
+        tuning->scheduler = safe_strdup(value);
+        return 0;
+    }
+
+    errno = 0;
+    val = strtol(value, &endptr, 10);
+    if (errno || !endptr || *endptr || val<0 || val>INT_MAX) {
+        return -1;
+    }
+
+    if (!strcmp(name, "direct_io")) {
+        if (val>1) return -1;
+        tuning->direct_io = val;
+    }
+    else if (!strcmp(name, "block_size")) {
+        // the kernel accepts powers of two between 512 and PAGE_SIZE
+        if (val<512 || (val & (val-1))) return -1;
+        tuning->block_size = val;
+    }
+    else if (!strcmp(name, "nr_requests")) {
+        tuning->nr_requests = val;
+    }
+    else if (!strcmp(name, "read_ahead_kb")) {
+        tuning->read_ahead_kb = val;
+    }
+    else {
+        return -1;
+    }
+
+    return 0;
+}
+
+#define LOOP_TUNING_RESOLVE(field, defval) \
+    tuning->field = (part && part->field>=0) ? part->field : ((global && global->field>=0) ? global->field : (defval))
+
+void util_loop_tuning_resolve(loop_tuning_t *tuning, const loop_tuning_t *part, const loop_tuning_t *global)
+{
+    // direct IO is on by default, the kernel falls back to buffered IO if the backing fs can't do it
+    LOOP_TUNING_RESOLVE(direct_io, 1);
+
+    // everything else keeps the kernel defaults.
+    // a 4K block size breaks images with smaller filesystem blocks, so it has to be requested
+    LOOP_TUNING_RESOLVE(block_size, -1);
+    LOOP_TUNING_RESOLVE(nr_requests, -1);
+    LOOP_TUNING_RESOLVE(read_ahead_kb, -1);
+
+    if (part && part->scheduler)
+        tuning->scheduler = part->scheduler;
+    else if (global && global->scheduler)
+        tuning->scheduler = global->scheduler;
+    else
+        tuning->scheduler = NULL;
+}
+
+static int loop_write_queue_attr(dev_t dev, const char *name, const char *value)
+{
+    char buf[PATH_MAX];
     int rc;
 
-    // duplicate arguments
-    char *device = safe_strdup(_device);
-    char *file = safe_strdup(_file);
+    SAFE_SNPRINTF_RET(LOGE, -1, buf, sizeof(buf), MBPATH_SYS"/dev/block/%u:%u/queue/%s", major(dev), minor(dev), name);
 
-    // tool
-    par[i++] = "losetup";
+    int fd = open(buf, O_WRONLY|O_CLOEXEC);
+    if (fd<0) {
+        LOGW("can't open %s: %s\n", buf, strerror(errno));
+        return -1;
+    }
 
-    // access mode
-    if (ro)
-        par[i++] = "-r";
+    rc = write(fd, value, strlen(value))==(ssize_t)strlen(value) ? 0 : -1;
+    if (rc) {
+        LOGW("can't write '%s' to %s: %s\n", value, buf, strerror(errno));
+    }
+    close(fd);
 
-    // paths
-    par[i++] = device;
-    par[i++] = file;
+    return rc;
+}
 
-    // end
-    par[i++] = (char *)0;
+static void loop_apply_tuning(int dfd, int configured, const loop_tuning_t *tuning)
+{
+    struct stat sb;
+    char buf[32];
 
-    rc = util_exec_main(i-1, par, busybox_main);
+    // LOOP_CONFIGURE did these already
+    if (!configured) {
+        if (tuning->block_size>0 && ioctl(dfd, LOOP_SET_BLOCK_SIZE, (unsigned long)tuning->block_size)) {
+            LOGW("can't set loop block size to %d: %s\n", tuning->block_size, strerror(errno));
+        }
 
-    // free arguments
-    free(device);
-    free(file);
+        // has to happen after setting the block size because of the alignment requirements
+        if (tuning->direct_io>0 && ioctl(dfd, LOOP_SET_DIRECT_IO, 1UL)) {
+            LOGV("no direct IO support: %s\n", strerror(errno));
+        }
+    }
+
+    if (fstat(dfd, &sb)) {
+        LOGW("can't stat loop device: %s\n", strerror(errno));
+        return;
+    }
+
+    if (tuning->nr_requests>=0) {
+        snprintf(buf, sizeof(buf), "%d", tuning->nr_requests);
+        loop_write_queue_attr(sb.st_rdev, "nr_requests", buf);
+    }
+    if (tuning->read_ahead_kb>=0) {
+        snprintf(buf, sizeof(buf), "%d", tuning->read_ahead_kb);
+        loop_write_queue_attr(sb.st_rdev, "read_ahead_kb", buf);
+    }
+    if (tuning->scheduler) {
+        loop_write_queue_attr(sb.st_rdev, "scheduler", tuning->scheduler);
+    }
+}
+
+int util_losetup_ex(const char *device, const char *file, uint32_t lo_flags, const loop_tuning_t *tuning)
+{
+    struct loop_config config;
+    int configured = 1;
+    int openflags = (lo_flags & LO_FLAGS_READ_ONLY) ? O_RDONLY : O_RDWR;
+    int ffd = -1;
+    int dfd = -1;
+    int rc = -1;
+
+    // open backing file
+    ffd = open(file, openflags|O_CLOEXEC);
+    if (ffd<0) {
+        LOGE("can't open %s: %s\n", file, strerror(errno));
+        goto out;
+    }
+
+    // open loop device
+    dfd = open(device, openflags|O_CLOEXEC);
+    if (dfd<0) {
+        LOGE("can't open %s: %s\n", device, strerror(errno));
+        goto out;
+    }
+
+    memset(&config, 0, sizeof(config));
+    config.fd = ffd;
+    config.info.lo_flags = lo_flags;
+    if (tuning && tuning->direct_io>0)
+        config.info.lo_flags |= LO_FLAGS_DIRECT_IO;
+    if (tuning && tuning->block_size>0)
+        config.block_size = tuning->block_size;
+    strlcpy((char *)config.info.lo_file_name, file, sizeof(config.info.lo_file_name));
+
+    // attach and configure at once
+    rc = ioctl(dfd, LOOP_CONFIGURE, &config);
+    if (rc && (errno==EINVAL || errno==ENOTTY)) {
+        // old kernel
+        configured = 0;
+        config.info.lo_flags &= ~LO_FLAGS_DIRECT_IO;
+        rc = ioctl(dfd, LOOP_SET_FD, ffd);
+        if (rc==0) {
+            rc = ioctl(dfd, LOOP_SET_STATUS64, &config.info);
+            if (rc) {
+                int olderrno = errno;
+                ioctl(dfd, LOOP_CLR_FD, 0);
+                errno = olderrno;
+            }
+        }
+    }
+    if (rc) {
+        LOGE("can't attach %s to %s: %s\n", file, device, strerror(errno));
+        goto out;
+    }
+
+    LOGV("attached %s to %s flags=0x%x\n", file, device, lo_flags);
+
+    if (tuning)
+        loop_apply_tuning(dfd, configured, tuning);
+
+out:
+    if (dfd>=0)
+        close(dfd);
+    if (ffd>=0)
+        close(ffd);
+
+    return rc;
+}
+
+int util_losetup(const char *device, const char *file, bool ro)
+{
+    return util_losetup_ex(device, file, ro ? LO_FLAGS_READ_ONLY : 0, NULL);
+}
+
+int util_loop_detach(const char *device)
+{
+    int rc;
+    struct stat sb;
+
+    int fd = open(device, O_RDONLY|O_CLOEXEC);
+    if (fd<0) {
+        LOGE("can't open %s: %s\n", device, strerror(errno));
+        return -1;
+    }
+
+    rc = ioctl(fd, LOOP_CLR_FD, 0);
+    if (rc) {
+        LOGE("can't detach %s: %s\n", device, strerror(errno));
+    }
+    else if (!fstat(fd, &sb) && major(sb.st_rdev)==LOOP_MAJOR) {
+        // the minor can be handed out again
+        pthread_mutex_lock(&loop_lock);
+        loop_release_minor(minor(sb.st_rdev));
+        pthread_mutex_unlock(&loop_lock);
+    }
+    close(fd);
 
     return rc;
 }
@@ -341,21 +808,32 @@ int util_losetup_free(const char *device)
     return util_exec_main(3, (char **)args, busybox_main);
 }
 
-static int util_mke2fs(const char *device, const char *fstype)
+static int util_mke2fs(const char *device, const char *fstype, const char *label)
 {
-    const char *args[] = {"mke2fs", "-t", fstype, "-O", "^64bit", "-m", "0", "-F", device, 0};
-    return util_exec_main(9, (char **)args, mke2fs_main);
+    if (label) {
+        const char *args[] = {"mke2fs", "-t", fstype, "-O", "^64bit", "-m", "0", "-L", label, "-F", device, 0};
+        return util_exec_main(11, (char **)args, mke2fs_main);
+    }
+    else {
+        const char *args[] = {"mke2fs", "-t", fstype, "-O", "^64bit", "-m", "0", "-F", device, 0};
+        return util_exec_main(9, (char **)args, mke2fs_main);
+    }
 }
 
-int util_mkfs(const char *device, const char *fstype)
+int util_mkfs_ex(const char *device, const char *fstype, const char *label)
 {
     if (!strcmp(fstype, "ext2") || !strcmp(fstype, "ext3") || !strcmp(fstype, "ext4"))
-        return util_mke2fs(device, fstype);
+        return util_mke2fs(device, fstype, label);
 
     LOGE("filesystem %s is not supported\n", fstype);
     return -1;
 }
 
+int util_mkfs(const char *device, const char *fstype)
+{
+    return util_mkfs_ex(device, fstype, NULL);
+}
+
 int util_block_num(const char *path, unsigned long *numblocks)
 {
     int fd;
@@ -372,62 +850,386 @@ int util_block_num(const char *path, unsigned long *numblocks)
     return 0;
 }
 
+#define COPY_BUFSZ (1024*1024)
+#define COPY_ZERO_BLKSZ 4096
+
+// don't truncate the target
+#define COPY_FLAG_NOTRUNC (1<<0)
+// the target reads as zeros, so zero blocks never have to be written
+#define COPY_FLAG_ZEROED (1<<1)
+
+typedef struct {
+    const char *source;
+    const char *target;
+    int sfd;
+    int dfd;
+    int sparse;
+
+    const char *method;
+    uint64_t skipped;
+} copy_ctx_t;
+
+static uint64_t util_time_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec*1000llu + ts.tv_nsec/1000000;
+}
+
+static int util_fd_size(int fd, const struct stat *sb, uint64_t *psize)
+{
+    if (S_ISBLK(sb->st_mode))
+        return ioctl(fd, BLKGETSIZE64, psize);
+
+    *psize = sb->st_size;
+    return 0;
+}
+
+int util_buf_is_zero(const void *buf, size_t len)
+{
+    const uint64_t *p = buf;
+    const uint8_t *p8;
+    size_t i;
+
+    for (i=0; i<len/sizeof(*p); i++) {
+        if (p[i])
+            return 0;
+    }
+
+    for (p8 = (const uint8_t *)(p+i); p8<(const uint8_t *)buf+len; p8++) {
+        if (*p8)
+            return 0;
+    }
+
+    return 1;
+}
+
+// returns the number of bytes copied or -1 if nothing could be copied
+static int64_t copy_fd_range(int sfd, int dfd, uint64_t off, uint64_t end)
+{
+#ifdef __NR_copy_file_range
+    loff_t soff = off;
+    loff_t doff = off;
+
+    while ((uint64_t)soff<end) {
+        ssize_t nbytes = syscall(__NR_copy_file_range, sfd, &soff, dfd, &doff, MIN(end-soff, (uint64_t)1<<30), 0);
+        if (nbytes<0) {
+            return (uint64_t)soff>off ? (int64_t)(soff-off) : -1;
+        }
+        if (nbytes==0)
+            break;
+    }
+
+    return soff-off;
+#else
+    (void)sfd; (void)dfd; (void)off; (void)end;
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+static int copy_fd_buffered(copy_ctx_t *ctx, void *buf, uint64_t off, uint64_t end)
+{
+    while (off<end) {
+        size_t len = MIN(end-off, (uint64_t)COPY_BUFSZ);
+        size_t pos;
+
+        ssize_t nbytes = pread(ctx->sfd, buf, len, off);
+        if (nbytes<0 && errno==EINVAL && (fcntl(ctx->sfd, F_GETFL) & O_DIRECT)) {
+            // the device doesn't like our alignment
+            fcntl(ctx->sfd, F_SETFL, fcntl(ctx->sfd, F_GETFL) & ~O_DIRECT);
+            continue;
+        }
+        if (nbytes<=0) {
+            LOGE("can't read %s: %s\n", ctx->source, nbytes ? strerror(errno) : "EOF");
+            return -1;
+        }
+
+        // write everything but zero blocks, which stay holes
+        for (pos=0; pos<(size_t)nbytes; ) {
+            size_t chunk = (size_t)nbytes;
+            size_t start = pos;
+
+            if (ctx->sparse) {
+                chunk = MIN((size_t)nbytes, pos + COPY_ZERO_BLKSZ);
+                if (util_buf_is_zero((char *)buf + pos, chunk-pos)) {
+                    ctx->skipped += chunk-pos;
+                    pos = chunk;
+                    continue;
+                }
+
+                // merge consecutive data blocks into one write
+                while (chunk<(size_t)nbytes) {
+                    size_t next = MIN((size_t)nbytes, chunk + COPY_ZERO_BLKSZ);
+                    if (util_buf_is_zero((char *)buf + chunk, next-chunk))
+                        break;
+                    chunk = next;
+                }
+            }
+
+            if (pwrite(ctx->dfd, (char *)buf + start, chunk-start, off+start)!=(ssize_t)(chunk-start)) {
+                LOGE("can't write %s: %s\n", ctx->target, strerror(errno));
+                return -1;
+            }
+            pos = chunk;
+        }
+
+        off += nbytes;
+    }
+
+    return 0;
+}
+
+// copies [off, end) of the source
+static int copy_segment(copy_ctx_t *ctx, void *buf, uint64_t off, uint64_t end, int use_range)
+{
+    if (use_range) {
+        int64_t copied = copy_fd_range(ctx->sfd, ctx->dfd, off, end);
+        if (copied>=0 && (uint64_t)copied==end-off) {
+            ctx->method = "copy_file_range";
+            return 0;
+        }
+        if (copied>0) {
+            LOGE("copy_file_range from %s to %s failed: %s\n", ctx->source, ctx->target, strerror(errno));
+            return -1;
+        }
+    }
+
+    ctx->method = "buffered";
+    return copy_fd_buffered(ctx, buf, off, end);
+}
+
+// copies 'size' bytes from source to target, or everything if size is 0
+static int util_copy_ex(const char *source, const char *target, uint64_t size, int flags)
+{
+    struct stat ssb, dsb;
+    uint64_t starttime = util_time_ms();
+    copy_ctx_t ctx = {.source = source, .target = target, .sfd = -1, .dfd = -1};
+    void *buf = NULL;
+    int use_range = 0;
+    int use_seek = 0;
+    uint64_t off;
+    int rc = -1;
+
+    ctx.sfd = open(source, O_RDONLY|O_CLOEXEC);
+    if (ctx.sfd<0) {
+        LOGE("can't open %s: %s\n", source, strerror(errno));
+        goto out;
+    }
+    if (fstat(ctx.sfd, &ssb)) {
+        LOGE("can't stat %s: %s\n", source, strerror(errno));
+        goto out;
+    }
+
+    // partitions get read only once, so bypass the page cache
+    if (S_ISBLK(ssb.st_mode)) {
+        fcntl(ctx.sfd, F_SETFL, fcntl(ctx.sfd, F_GETFL) | O_DIRECT);
+    }
+    posix_fadvise(ctx.sfd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    if (size==0) {
+        if (util_fd_size(ctx.sfd, &ssb, &size)) {
+            LOGE("can't get size of %s: %s\n", source, strerror(errno));
+            goto out;
+        }
+    }
+
+    // like dd and cp, regular files get truncated
+    ctx.dfd = open(target, O_WRONLY|O_CREAT|O_CLOEXEC|((flags&COPY_FLAG_NOTRUNC) ? 0 : O_TRUNC), ssb.st_mode & 0777);
+    if (ctx.dfd<0) {
+        LOGE("can't open %s: %s\n", target, strerror(errno));
+        goto out;
+    }
+    if (fstat(ctx.dfd, &dsb)) {
+        LOGE("can't stat %s: %s\n", target, strerror(errno));
+        goto out;
+    }
+
+    // zero blocks can be skipped if the target reads as zeros. block devices never do.
+    if (S_ISREG(dsb.st_mode) && (!(flags&COPY_FLAG_NOTRUNC) || (flags&COPY_FLAG_ZEROED)))
+        ctx.sparse = 1;
+
+    if (S_ISREG(ssb.st_mode) && S_ISREG(dsb.st_mode)) {
+        // share the extents if the filesystem supports reflinks
+        if (!(flags&COPY_FLAG_NOTRUNC) && ssb.st_dev==dsb.st_dev && size==(uint64_t)ssb.st_size && ioctl(ctx.dfd, FICLONE, ctx.sfd)==0) {
+            ctx.method = "reflink";
+            rc = 0;
+            goto done;
+        }
+
+        // copy_file_range writes zero blocks, so only use it if we don't care about them
+        use_range = !(flags&COPY_FLAG_ZEROED);
+    }
+
+    // only copy the data segments of sparse files, the skipped holes have to read as zeros
+    use_seek = ctx.sparse && S_ISREG(ssb.st_mode);
+
+    // O_DIRECT needs aligned buffers
+    if (posix_memalign(&buf, 4096, COPY_BUFSZ)) {
+        LOGE("can't allocate copy buffer\n");
+        goto out;
+    }
+
+    for (off=0; off<size; ) {
+        off_t data = off;
+        off_t hole = size;
+
+        if (use_seek) {
+            data = lseek(ctx.sfd, off, SEEK_DATA);
+            if (data<0 && errno==ENXIO) {
+                // there's only a hole left
+                ctx.skipped += size-off;
+                break;
+            }
+            else if (data<0) {
+                // the filesystem doesn't support SEEK_DATA
+                use_seek = 0;
+                data = off;
+            }
+            else {
+                hole = lseek(ctx.sfd, data, SEEK_HOLE);
+                if (hole<0 || (uint64_t)hole>size)
+                    hole = size;
+            }
+        }
+        if ((uint64_t)data>=size) {
+            ctx.skipped += size-off;
+            break;
+        }
+        ctx.skipped += data-off;
+
+        rc = copy_segment(&ctx, buf, data, hole, use_range);
+        if (rc) goto out;
+
+        off = hole;
+    }
+
+    // set the final size, the end may be a hole
+    if (ctx.sparse) {
+        struct stat tsb;
+        if (!fstat(ctx.dfd, &tsb) && (uint64_t)tsb.st_size<size && ftruncate(ctx.dfd, size)) {
+            LOGE("can't resize %s: %s\n", target, strerror(errno));
+            rc = -1;
+            goto out;
+        }
+    }
+
+    // we won't need these pages again
+    posix_fadvise(ctx.sfd, 0, 0, POSIX_FADV_DONTNEED);
+    rc = 0;
+
+done:
+    {
+        uint64_t ms = util_time_ms() - starttime;
+        LOGI("copied %s to %s: %"PRIu64" bytes (%"PRIu64" sparse) in %"PRIu64"ms (%"PRIu64" KiB/s, %s)\n",
+             source, target, size, ctx.skipped, ms, (size/1024) * 1000 / (ms ?: 1), ctx.method ?: "none");
+    }
+
+out:
+    free(buf);
+    if (ctx.dfd>=0)
+        close(ctx.dfd);
+    if (ctx.sfd>=0)
+        close(ctx.sfd);
+
+    return rc;
+}
+
 int util_dd(const char *source, const char *target, unsigned long blocks)
 {
-    int rc;
-    int i = 0;
-    char *par[64];
-    char buf[PATH_MAX];
-    char *buf_if = NULL, *buf_of = NULL, *buf_bs = NULL, *buf_count = NULL;
+    return util_copy_ex(source, target, blocks*512llu, 0);
+}
 
-    // get number of blocks
-    if (blocks==0) {
-        rc = util_block_num(source, &blocks);
-        if (rc) return rc;
+int util_copy_sparse(const char *source, const char *target)
+{
+    // the target may be a fixed-size file like the dynfilefs one, so don't truncate it
+    return util_copy_ex(source, target, 0, COPY_FLAG_NOTRUNC|COPY_FLAG_ZEROED);
+}
+
+// punches holes into the zero blocks of a file, returns 0 or a negative errno
+int util_resparsify(const char *filename, uint64_t *pfreed)
+{
+    struct stat sb;
+    char *buf = NULL;
+    uint64_t freed = 0;
+    off_t off = 0;
+    int rc = -1;
+
+    int fd = open(filename, O_RDWR|O_CLOEXEC);
+    if (fd<0) {
+        rc = -errno;
+        LOGE("can't open %s: %s\n", filename, strerror(errno));
+        return rc;
     }
 
-    // tool
-    par[i++] = "dd";
+    if (fstat(fd, &sb)) {
+        rc = -errno;
+        LOGE("can't stat %s: %s\n", filename, strerror(errno));
+        goto out;
+    }
+    if (!S_ISREG(sb.st_mode)) {
+        rc = -EINVAL;
+        LOGE("%s is not a regular file\n", filename);
+        goto out;
+    }
 
-    // input
-    SAFE_SNPRINTF_RET(LOGE, -1, buf, ARRAY_SIZE(buf), "if=%s", source);
-    buf_if = safe_strdup(buf);
-    par[i++] = buf_if;
+    buf = safe_malloc(COPY_ZERO_BLKSZ);
 
-    // output
-    SAFE_SNPRINTF_RET(LOGE, -1, buf, ARRAY_SIZE(buf), "of=%s", target);
-    buf_of = safe_strdup(buf);
-    par[i++] = buf_of;
+    while (off<sb.st_size) {
+        off_t data = lseek(fd, off, SEEK_DATA);
+        off_t hole;
 
-    // blocksize (get_blknum returns 512byte blocks)
-    SAFE_SNPRINTF_RET(LOGE, -1, buf, ARRAY_SIZE(buf), "bs=%d", 512);
-    buf_bs = safe_strdup(buf);
-    par[i++] = buf_bs;
+        if (data<0 && errno==ENXIO)
+            break;
+        if (data<0) {
+            // no SEEK_DATA support, scan everything
+            data = off;
+            hole = sb.st_size;
+        }
+        else {
+            hole = lseek(fd, data, SEEK_HOLE);
+            if (hole<0)
+                hole = sb.st_size;
+        }
 
-    // count
-    SAFE_SNPRINTF_RET(LOGE, -1, buf, ARRAY_SIZE(buf), "count=%lu", blocks);
-    buf_count = safe_strdup(buf);
-    par[i++] = buf_count;
+        // punch out zero blocks
+        for (off=data; off<hole; ) {
+            size_t len = MIN((off_t)COPY_ZERO_BLKSZ, hole-off);
 
-    // end
-    par[i++] = (char *)0;
+            ssize_t nbytes = pread(fd, buf, len, off);
+            if (nbytes<=0) {
+                rc = nbytes ? -errno : -EIO;
+                LOGE("can't read %s: %s\n", filename, nbytes ? strerror(errno) : "EOF");
+                goto out;
+            }
 
-    // exec
-    rc = util_exec_main(i-1, par, busybox_main);
+            if (nbytes==COPY_ZERO_BLKSZ && util_buf_is_zero(buf, nbytes)) {
+                if (fallocate(fd, FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE, off, nbytes)) {
+                    rc = -errno;
+                    LOGE("can't punch hole into %s: %s\n", filename, strerror(errno));
+                    goto out;
+                }
+                freed += nbytes;
+            }
 
-    // cleanup
-    free(buf_if);
-    free(buf_of);
-    free(buf_bs);
-    free(buf_count);
+            off += nbytes;
+        }
+    }
+
+    rc = 0;
+    if (pfreed)
+        *pfreed = freed;
+
+out:
+    free(buf);
+    close(fd);
 
     return rc;
 }
 
 int util_cp(const char *source, const char *target)
 {
-    const char *args[] = {"cp", source, target, 0};
-    return util_exec_main(3, (char **)args, busybox_main);
+    return util_copy_ex(source, target, 0, 0);
 }
 
 int util_shell(const char *cmd)
@@ -551,6 +1353,28 @@ int util_create_partition_backup_ex(const char *device, const char *file, unsign
 {
     int rc;
 
+    // with the chunk store, the image only exists as a manifest
+    if (chunkstore_enabled(file)) {
+        int have_image = util_exists(file, false);
+
+        if (!force && !have_image && chunkstore_has_manifest(file))
+            return 0;
+
+        // an image from before the store got enabled has the current data
+        const char *source = (!force && have_image) ? file : device;
+        rc = chunkstore_import(source, file);
+        if (rc) {
+            LOGE("Can't import %s into the chunk store\n", source);
+            return -1;
+        }
+
+        if (have_image && unlink(file)) {
+            LOGW("Can't remove %s: %s\n", file, strerror(errno));
+        }
+
+        return 0;
+    }
+
     // get number of blocks
     if (num_blocks==0)
         util_block_num(device, &num_blocks);
@@ -675,6 +1499,64 @@ int util_dynfilefs(const char *_source, const char *_target, uint64_t size)
     return rc;
 }
 
+int util_chunkfs(const char *image, const char *loopfile)
+{
+    char *par[64];
+    char overlay[PATH_MAX];
+    int i = 0;
+    int rc;
+
+    // loopfile is <mountpoint>/loop.fs
+    char *mountpoint = util_dirname(loopfile);
+    if (!mountpoint) {
+        LOGE("Can't get directory of %s\n", loopfile);
+        return -1;
+    }
+
+    // create mountpoint directory
+    rc = util_mkdir(mountpoint);
+    if (rc) {
+        LOGE("Can't create directory at %s\n", mountpoint);
+        free(mountpoint);
+        return -1;
+    }
+
+    // written chunks wait here until the loop gets flushed
+    rc = snprintf(overlay, sizeof(overlay), "%s.overlay", mountpoint);
+    if (SNPRINTF_ERROR(rc, sizeof(overlay))) {
+        LOGE("snprintf error\n");
+        free(mountpoint);
+        return -1;
+    }
+
+    // duplicate arguments
+    char *source = safe_strdup(image);
+
+    // tool
+    par[i++] = "chunkfs";
+
+    par[i++] = "-o";
+    par[i++] = "direct_io";
+
+    // source
+    par[i++] = source;
+    par[i++] = overlay;
+
+    // target
+    par[i++] = mountpoint;
+
+    // end
+    par[i++] = (char *)0;
+
+    rc = util_exec_main(i-1, par, chunkfs_main);
+
+    // free arguments
+    free(mountpoint);
+    free(source);
+
+    return rc;
+}
+
 int util_mount_mbinipart(const char *name, const char *mountpoint)
 {
     multiboot_data_t *multiboot_data = multiboot_get_data();